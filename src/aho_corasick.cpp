@@ -0,0 +1,144 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "aho_corasick.h"
+#include <deque>
+#include <stdexcept>
+
+namespace pargrep {
+
+    constexpr std::uint32_t AhoCorasick::MATCH_BIT;
+
+    AhoCorasick::AhoCorasick(const std::vector<std::string>& patterns)
+    {
+        constexpr std::uint32_t NONE = ~std::uint32_t(0);
+
+        // Give each byte used by a pattern its own class, leaving class zero for everything else:
+        for(const std::string& pattern : patterns) {
+            for(const char c : pattern) {
+                std::uint8_t& cls = classes_[std::uint8_t(c)];
+                if(cls == 0) {
+                    cls = std::uint8_t(numClasses_++);
+                }
+            }
+        }
+
+        // Build the trie in a scratch table where NONE marks a missing edge:
+        std::vector<std::uint32_t> trie(numClasses_, NONE);
+        outputs_.emplace_back();
+        numStates_ = 1;
+        for(PatternId id = 0; id < patterns.size(); ++id)
+        {
+            const std::string& pattern = patterns[id];
+            if(pattern.empty()) {
+                matchesEmpty_ = true;
+                continue;
+            }
+            std::uint32_t state = 0;
+            for(const char c : pattern)
+            {
+                std::uint32_t& next = trie[state * numClasses_ + classes_[std::uint8_t(c)]];
+                if(next == NONE) {
+                    next = numStates_++;
+                    trie.resize(std::size_t(numStates_) * numClasses_, NONE);
+                    outputs_.emplace_back();
+                    // trie may have moved:
+                    state = trie[state * numClasses_ + classes_[std::uint8_t(c)]];
+                } else {
+                    state = next;
+                }
+            }
+            outputs_[state].push_back(id);
+        }
+        if(std::uint64_t(numStates_) * numClasses_ >= MATCH_BIT) {
+            throw std::length_error("pargrep: too many patterns for the Aho-Corasick transition table");
+        }
+
+        // Breadth first, resolve failure links into a complete DFA:
+        std::vector<std::uint32_t> fail(numStates_, 0);
+        std::vector<bool> terminal(numStates_, false);
+        outputLinks_.assign(numStates_, NONE);
+        transitions_.assign(std::size_t(numStates_) * numClasses_, 0);
+        std::deque<std::uint32_t> queue;
+        for(std::uint32_t cls = 0; cls < numClasses_; ++cls)
+        {
+            const std::uint32_t next = trie[cls];
+            if(next != NONE) {
+                fail[next] = 0;
+                queue.push_back(next);
+            }
+            transitions_[cls] = next == NONE ? 0 : next;
+        }
+        while(!queue.empty())
+        {
+            const std::uint32_t state = queue.front();
+            queue.pop_front();
+            const std::uint32_t failState = fail[state];
+            terminal[state] = !outputs_[state].empty() || terminal[failState];
+            outputLinks_[state] = !outputs_[failState].empty() ? failState : outputLinks_[failState];
+            for(std::uint32_t cls = 0; cls < numClasses_; ++cls)
+            {
+                const std::uint32_t next = trie[state * numClasses_ + cls];
+                const std::uint32_t failNext = transitions_[failState * numClasses_ + cls];
+                if(next != NONE) {
+                    fail[next] = failNext;
+                    queue.push_back(next);
+                    transitions_[state * numClasses_ + cls] = next;
+                } else {
+                    transitions_[state * numClasses_ + cls] = failNext;
+                }
+            }
+        }
+
+        // Switch to premultiplied row offsets and flag transitions into terminal states:
+        for(std::uint32_t& entry : transitions_) {
+            entry = (entry * numClasses_) | (terminal[entry] ? MATCH_BIT : 0);
+        }
+    }
+
+    const char* AhoCorasick::findEnd(const char* const begin, const char* const end) const
+    {
+        // Callers skip the lines before the position returned, and an empty pattern matches them all:
+        if(matchesEmpty_) {
+            return begin;
+        }
+        const std::uint32_t* const table = transitions_.data();
+        if(!table) {
+            return end;
+        }
+        std::uint32_t row = 0;
+        for(const char* p = begin; p < end; ++p)
+        {
+            const std::uint32_t next = table[row + classes_[std::uint8_t(*p)]];
+            if(next & MATCH_BIT) {
+                return p;
+            }
+            row = next;
+        }
+        return end;
+    }
+
+    void AhoCorasick::findAll(const char* const begin, const char* const end, std::vector<PatternId>& found) const
+    {
+        constexpr std::uint32_t NONE = ~std::uint32_t(0);
+        found.clear();
+        const std::uint32_t* const table = transitions_.data();
+        if(!table) {
+            return;
+        }
+        std::uint32_t row = 0;
+        for(const char* p = begin; p < end; ++p)
+        {
+            const std::uint32_t next = table[row + classes_[std::uint8_t(*p)]];
+            row = next & ~MATCH_BIT;
+            if(next & MATCH_BIT)
+            {
+                for(std::uint32_t state = row / numClasses_; state != NONE; state = outputLinks_[state]) {
+                    found.insert(found.end(), outputs_[state].begin(), outputs_[state].end());
+                }
+            }
+        }
+    }
+}
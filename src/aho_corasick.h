@@ -0,0 +1,76 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// Simultaneous search for many fixed strings.
+//
+#ifndef PARGREP_AHO_CORASICK_H
+#define PARGREP_AHO_CORASICK_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pargrep {
+
+    /**
+     * An Aho-Corasick automaton finding any of a set of fixed strings in a single
+     * pass over the text, however many strings there are.
+     * Failure links are resolved at build time into a complete DFA held in one flat
+     * transition table. Bytes are first mapped to the classes of characters that
+     * appear in the patterns, so each state's row is only as wide as the patterns'
+     * alphabet (e.g. ~40 entries for hex request IDs rather than 256).
+     * Once built it is immutable, so one instance is shared by all worker threads.
+     */
+    class AhoCorasick
+    {
+    public:
+        using PatternId = std::uint32_t;
+
+        AhoCorasick() = default;
+        explicit AhoCorasick(const std::vector<std::string>& patterns);
+
+        /**
+         * @return A pointer to the last character of the first (earliest ending)
+         * occurrence of any pattern in [begin, end), or end if there is none. Begin
+         * if one of the patterns is empty, since that occurs everywhere.
+         */
+        const char* findEnd(const char* begin, const char* end) const;
+
+        /// True if any of the patterns occurs in [begin, end).
+        bool search(const char* begin, const char* end) const
+        {
+            return matchesEmpty_ || findEnd(begin, end) != end;
+        }
+
+        /**
+         * Find every pattern occurring in [begin, end) in one pass.
+         * @param[out] found The ids (indices into the constructor's vector) of the patterns
+         * found, with one entry per occurrence, in order of where they end.
+         */
+        void findAll(const char* begin, const char* end, std::vector<PatternId>& found) const;
+
+        std::size_t numStates() const { return numStates_; }
+        std::size_t numClasses() const { return numClasses_; }
+
+    private:
+        // Set on a transition whose target state completes one or more patterns:
+        static constexpr std::uint32_t MATCH_BIT = std::uint32_t(1) << 31;
+
+        // Byte to column of the transition table:
+        std::uint8_t classes_[256] = {};
+        std::uint32_t numClasses_ = 1;
+        std::uint32_t numStates_ = 0;
+        // Row per state. Entries are the target state's row offset (state * numClasses_)
+        // so the hot loop needs no multiply, ORed with MATCH_BIT:
+        std::vector<std::uint32_t> transitions_;
+        // Patterns ending exactly at each state and the next state along the failure
+        // chain which also ends patterns (or ~0u), for findAll():
+        std::vector<std::vector<PatternId>> outputs_;
+        std::vector<std::uint32_t> outputLinks_;
+        // An empty pattern matches every line:
+        bool matchesEmpty_ = false;
+    };
+}
+
+#endif //PARGREP_AHO_CORASICK_H
@@ -3,10 +3,25 @@
 // All rights reserved worldwide
 //
 #include "pargrep.h"
+#include "substring_search.h"
+#include "lazy_dfa.h"
+#include "bit_parallel.h"
+#include "static_pattern.h"
+#include "concurrent_queue.h"
+#include "thread_pool.h"
+#include "trigram_index.h"
+#include "search_daemon.h"
+#include "matcher.h"
 #include <benchmark/benchmark.h>
 #include <regex>
 #include <random>
 #include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <sys/stat.h>
 
 namespace benchmark_helpers
 {
@@ -34,27 +49,127 @@ namespace benchmark_helpers
         }
     }
 
-    static void RegexMatch(benchmark::State &state, const std::string &pattern) {
-        const std::regex aRegex{pattern};
+    // The regex engines which can be compared by RegexMatch():
+    enum class Engine { StdRegex, LazyDfa, BitParallel };
+
+    static void RegexMatch(benchmark::State &state, const std::string &pattern, const Engine engine = Engine::StdRegex) {
+        const std::string s = RandomString(state.range(0));
+        const char* const begin = s.data();
+        const char* const end = begin + s.size();
+
+        unsigned found = 0;
+        if (engine == Engine::LazyDfa) {
+            pargrep::LazyDfa dfa{pargrep::RegexProgram::compile(pattern)};
+            while (state.KeepRunning()) {
+                found += dfa.search(begin, end);
+            }
+        } else if (engine == Engine::BitParallel) {
+            const auto nfa = pargrep::BitParallelMatcher::compile(pattern);
+            while (state.KeepRunning()) {
+                found += nfa->search(begin, end);
+            }
+        } else {
+            const std::regex aRegex{pattern};
+            while (state.KeepRunning()) {
+                found += regex_search(s, aRegex);
+            }
+        }
+        benchmark::DoNotOptimize(found);
+    }
+
+    template<const char* Pattern>
+    static void StaticMatch(benchmark::State &state) {
+        const pargrep::static_pattern<Pattern> matcher;
+        const std::string s = RandomString(state.range(0));
+        const char* const begin = s.data();
+        const char* const end = begin + s.size();
+
+        unsigned found = 0;
+        while (state.KeepRunning()) {
+            found += matcher.search(begin, end);
+        }
+        benchmark::DoNotOptimize(found);
+    }
+
+    static void FixedMatch(benchmark::State &state, const std::string &needle) {
+        const pargrep::SubstringSearcher searcher{needle};
         const std::string s = RandomString(state.range(0));
+        const char* const begin = s.data();
+        const char* const end = begin + s.size();
 
         unsigned found = 0;
         while (state.KeepRunning()) {
-            found += regex_search(s, aRegex);
+            found += searcher.find(begin, end) != end;
         }
         benchmark::DoNotOptimize(found);
+        state.SetBytesProcessed(state.iterations() * s.size());
+        state.SetLabel(pargrep::SubstringSearcher::implementation());
     }
 
-    static void RegexMatchRepeated(benchmark::State &state, const std::string pattern) {
+    static void RegexMatchRepeated(benchmark::State &state, const std::string pattern, const Engine engine = Engine::StdRegex) {
         auto dups = state.range(1);
         std::string dupedPattern;
         dupedPattern.reserve(pattern.size() * dups);
         for (int dup = 0; dup < dups; ++dup) {
             dupedPattern.append(pattern);
         }
-        RegexMatch(state, dupedPattern);
+        RegexMatch(state, dupedPattern, engine);
+    }
+
+    /**
+     * Push pointers from state.range(0) producer threads through a queue to this
+     * thread, popping them in batches as the pipelines' consumers do.
+     */
+    template<typename Queue>
+    static void QueueContention(benchmark::State &state, Queue& queue) {
+        constexpr unsigned ITEMS_PER_PRODUCER = 64 * 1024;
+        const unsigned numProducers = state.range(0);
+        std::vector<int> items(numProducers);
+        std::vector<int*> buffer;
+
+        while (state.KeepRunning()) {
+            std::vector<std::thread> producers;
+            for (unsigned p = 0; p < numProducers; ++p) {
+                producers.emplace_back([&queue, &items, p]() {
+                    for (unsigned i = 0; i < ITEMS_PER_PRODUCER; ++i) {
+                        int* item = &items[p];
+                        queue.push(item);
+                    }
+                });
+            }
+            std::size_t received = 0;
+            while (received < std::size_t(numProducers) * ITEMS_PER_PRODUCER) {
+                queue.popAll(buffer);
+                received += buffer.size();
+            }
+            for (auto& producer : producers) {
+                producer.join();
+            }
+        }
+        state.SetItemsProcessed(state.iterations() * numProducers * ITEMS_PER_PRODUCER);
     }
 
+    /**
+     * A matcher which is pathologically slow on lines starting "[SLOW]", to skew the
+     * work given to par2's workers.
+     */
+    class SkewedMatcher
+    {
+    public:
+        bool search(const char* begin, const char* end) const
+        {
+            if(end - begin >= 6 && std::equal(begin, begin + 6, "[SLOW]")) {
+                const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(2);
+                while(std::chrono::steady_clock::now() < until) {}
+            }
+            return std::find(begin, end, 'q') != end;
+        }
+        bool search(const std::string& line) const { return search(line.data(), line.data() + line.size()); }
+        const char* nextCandidate(const char* begin, const char*) const { return begin; }
+        bool canSkip() const { return false; }
+        const char* engineName() const { return "skewed"; }
+    };
+
     /**
      * Make a text file which can be read in and grepped over by tests.
      */
@@ -113,10 +228,92 @@ namespace benchmarks
     }
     // Args are {string length, number of repetitions of match pattern}:
     BENCHMARK(BM_RegexMatchDigits)->Args({512, 2})->Args({512, 3})->Args({512, 4})->Args({512, 5});
+
+    static void BM_LazyDfaMatchAnything(benchmark::State &state) {
+        RegexMatch(state, ".", Engine::LazyDfa);
+    }
+    BENCHMARK(BM_LazyDfaMatchAnything)->Arg(64)->Arg(512);
+
+    static void BM_LazyDfaMatchDigits(benchmark::State &state) {
+        RegexMatchRepeated(state, "[[:digit:]]", Engine::LazyDfa);
+    }
+    BENCHMARK(BM_LazyDfaMatchDigits)->Args({512, 2})->Args({512, 3})->Args({512, 4})->Args({512, 5});
+
+    static void BM_BitParallelMatchAnything(benchmark::State &state) {
+        RegexMatch(state, ".", Engine::BitParallel);
+    }
+    BENCHMARK(BM_BitParallelMatchAnything)->Arg(64)->Arg(512);
+
+    static void BM_BitParallelMatchDigits(benchmark::State &state) {
+        RegexMatchRepeated(state, "[[:digit:]]", Engine::BitParallel);
+    }
+    BENCHMARK(BM_BitParallelMatchDigits)->Args({512, 2})->Args({512, 3})->Args({512, 4})->Args({512, 5});
+
+    // The kind of short class main.cpp searches for, which never occurs in the random strings:
+    static void BM_RegexMatchClass(benchmark::State &state) {
+        RegexMatch(state, "[_-]");
+    }
+    BENCHMARK(BM_RegexMatchClass)->Arg(64)->Arg(512);
+
+    static void BM_BitParallelMatchClass(benchmark::State &state) {
+        RegexMatch(state, "[_-]", Engine::BitParallel);
+    }
+    BENCHMARK(BM_BitParallelMatchClass)->Arg(64)->Arg(512);
+
+    // Needs the general follow tables rather than just a shift:
+    static void BM_RegexMatchStar(benchmark::State &state) {
+        RegexMatch(state, "[a-f]+[0-9]*-[A-F]");
+    }
+    BENCHMARK(BM_RegexMatchStar)->Arg(64)->Arg(512);
+
+    static void BM_BitParallelMatchStar(benchmark::State &state) {
+        RegexMatch(state, "[a-f]+[0-9]*-[A-F]", Engine::BitParallel);
+    }
+    BENCHMARK(BM_BitParallelMatchStar)->Arg(64)->Arg(512);
+
+    static constexpr char CLASS_PATTERN[] = "[_-]";
+    BENCHMARK_TEMPLATE(StaticMatch, CLASS_PATTERN)->Arg(64)->Arg(512);
+
+    static constexpr char STAR_PATTERN[] = "[a-f]+[0-9]*-[A-F]";
+    BENCHMARK_TEMPLATE(StaticMatch, STAR_PATTERN)->Arg(64)->Arg(512);
+
+    // A request ID style literal which never occurs in the random strings, so the whole string is always scanned:
+    static void BM_RegexMatchLiteral(benchmark::State &state) {
+        RegexMatch(state, "req-7f3a9c");
+    }
+    BENCHMARK(BM_RegexMatchLiteral)->Arg(64)->Arg(512)->Arg(4096);
+
+    static void BM_FixedMatchLiteral(benchmark::State &state) {
+        FixedMatch(state, "req-7f3a9c");
+    }
+    BENCHMARK(BM_FixedMatchLiteral)->Arg(64)->Arg(512)->Arg(4096);
+
+    // Arg is the number of producer threads:
+    static void BM_QueueMutex(benchmark::State &state) {
+        pargrep::BlockingPointerSet<int> queue;
+        QueueContention(state, queue);
+    }
+    BENCHMARK(BM_QueueMutex)->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
+
+    static void BM_QueueSpsc(benchmark::State &state) {
+        pargrep::SpscQueue<int> queue {1024};
+        QueueContention(state, queue);
+    }
+    BENCHMARK(BM_QueueSpsc)->Arg(1)->UseRealTime();
+
+    static void BM_QueueMpsc(benchmark::State &state) {
+        pargrep::MpscQueue<int> queue {1024};
+        QueueContention(state, queue);
+    }
+    BENCHMARK(BM_QueueMpsc)->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
 #endif
 
+    // Find errors that start and end with digits (the rest of the pattern is just to increase complexity):
+    static constexpr char GREP_PATTERN[] = "^\\[ERROR\\] *: *[[:digit:]]+.*[a-z]+.*[A-Z]+.*[[:digit:]]$";
+
     // Benchmark of simple grep over a file, writing to a second file:
-    static void BM_RegexGrep(benchmark::State &state) {
+    template<typename MatcherT>
+    static void Grep(benchmark::State &state, const MatcherT& matcher) {
         using namespace std;
 
         vector<string> prefixes {
@@ -127,20 +324,438 @@ namespace benchmarks
         };
         const auto numLines = state.range(0);
         const string fullPath = CreateTempFile(prefixes, 10, 120, numLines, "BM_RegexGrep_input.log");
-
-        // Find errors that start and end with digits (the rest of the pattern is just to increase complexity):
-        const string pattern {"^\\[ERROR\\] *: *[[:digit:]]+.*[a-z]+.*[A-Z]+.*[[:digit:]]$"};
+        pargrep::Options options;
 
         while (state.KeepRunning())
         {
             ifstream in(fullPath);
             ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
-            pargrep::grep_stream(in, pattern, out, true);
+            pargrep::grep_stream(in, matcher, out, options);
             in.close();
             out.close();
         }
     }
+
+    static void BM_RegexGrep(benchmark::State &state) {
+        Grep(state, std::string(GREP_PATTERN));
+    }
+
+    static void BM_StaticPatternGrep(benchmark::State &state) {
+        Grep(state, pargrep::static_pattern<GREP_PATTERN>());
+    }
+    // Many thread grep where about one line in 200 is very slow to match, reporting how well the workers share the load:
+    static void BM_SkewedGrepPar2(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes(199, "[INFO]: ");
+        prefixes.push_back("[SLOW]: ");
+        const string fullPath = CreateTempFile(prefixes, 10, 120, state.range(0), "BM_SkewedGrep_input.log");
+        pargrep::Options options;
+        pargrep::PipelineStats stats;
+        options.stats = &stats;
+
+        double maxReorderBlocks = 0, p99LatencyMs = 0, maxLatencyMs = 0, stolen = 0, peakBytes = 0;
+        while (state.KeepRunning())
+        {
+            ifstream in(fullPath);
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            pargrep::pargrep_stream_par2(in, SkewedMatcher(), out, options);
+            maxReorderBlocks = max(maxReorderBlocks, double(stats.maxReorderBlocks));
+            p99LatencyMs = max(p99LatencyMs, stats.p99BlockLatencyMs);
+            maxLatencyMs = max(maxLatencyMs, stats.maxBlockLatencyMs);
+            stolen += stats.blocksStolen;
+            peakBytes = max(peakBytes, double(stats.peakBytes));
+        }
+        state.counters["max_reorder_blocks"] = maxReorderBlocks;
+        state.counters["p99_latency_ms"] = p99LatencyMs;
+        state.counters["max_latency_ms"] = maxLatencyMs;
+        state.counters["stolen_per_run"] = stolen / state.iterations();
+        state.counters["peak_bytes"] = peakBytes;
+    }
+
+    // Grep where nearly every line matches, so the cost is in writing them out, with and without a flush per line:
+    static void BM_HighMatchGrep(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {"[INFO]: "};
+        const string fullPath = CreateTempFile(prefixes, 10, 120, state.range(0), "BM_HighMatchGrep_input.log");
+        pargrep::Options options;
+        options.lineNumbers = true;
+        options.lineBuffered = state.range(1) != 0;
+
+        while (state.KeepRunning())
+        {
+            ifstream in(fullPath);
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            pargrep::grep_stream(in, std::string("INFO"), out, options);
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+    // As BM_HighMatchGrep for the many thread version, where the workers format the lines they match:
+    static void BM_HighMatchGrepPar2(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {"[INFO]: "};
+        const string fullPath = CreateTempFile(prefixes, 10, 120, state.range(0), "BM_HighMatchGrep_input.log");
+        pargrep::Options options;
+        options.lineNumbers = true;
+
+        while (state.KeepRunning())
+        {
+            ifstream in(fullPath);
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            pargrep::pargrep_stream_par2(in, std::string("INFO"), out, options);
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+    // The many thread version on the same input, outputting every line, counting them, or stopping at the first:
+    static void BM_EarlyExitGrepPar2(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {"[INFO]: "};
+        const string fullPath = CreateTempFile(prefixes, 10, 120, state.range(0), "BM_HighMatchGrep_input.log");
+        pargrep::Options options;
+        options.mode = pargrep::OutputMode(state.range(1));
+
+        while (state.KeepRunning())
+        {
+            ifstream in(fullPath);
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            pargrep::pargrep_stream_par2(in, std::string("INFO"), out, options);
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+    // A set of strings with an empty one among them, which matches every line, searched by the versions which skip
+    // ahead to candidates: the many thread version, then the mapped file version. Fails if any line is dropped:
+    static void BM_EmptyPatternSetGrep(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {"[INFO]: "};
+        const string fullPath = CreateTempFile(prefixes, 10, 120, state.range(0), "BM_EmptyPatternSetGrep_input.log");
+        const pargrep::Matcher matcher(vector<string>{"qz", ""}, true);
+        pargrep::Options options;
+
+        std::uint64_t matches = 0;
+        while (state.KeepRunning())
+        {
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            if(state.range(1)) {
+                matches = pargrep::pargrep_file_mmap(fullPath, matcher, out, options);
+            } else {
+                ifstream in(fullPath);
+                matches = pargrep::pargrep_stream_par2(in, matcher, out, options);
+            }
+        }
+        if(matches != std::uint64_t(state.range(0))) {
+            state.SkipWithError("lines matching the empty pattern were skipped");
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+    // Splitting a file into lines without searching them, to see the cost of reading apart from matching.
+    // Args are the number of lines and their longest length:
+    template<typename ReadFunction>
+    static void ReadLines(benchmark::State &state, ReadFunction readLines) {
+        using namespace std;
+
+        vector<string> prefixes {"[INFO]: "};
+        const string fullPath = CreateTempFile(prefixes, 1, state.range(1), state.range(0), "BM_ReadLines_input.log");
+        struct stat info;
+        stat(fullPath.c_str(), &info);
+        std::size_t totalBytes = 0;
+
+        while (state.KeepRunning())
+        {
+            ifstream in(fullPath);
+            totalBytes += readLines(in);
+        }
+        state.SetBytesProcessed(state.iterations() * info.st_size);
+        benchmark::DoNotOptimize(totalBytes);
+    }
+
+    static void BM_ReadLinesGetline(benchmark::State &state) {
+        ReadLines(state, [](std::istream& in) {
+            std::size_t bytes = 0;
+            std::string line;
+            while(std::getline(in, line)) {
+                bytes += line.size();
+            }
+            return bytes;
+        });
+    }
+
+    static void BM_ReadLinesLineReader(benchmark::State &state) {
+        ReadLines(state, [](std::istream& in) {
+            std::size_t bytes = 0;
+            pargrep::LineReader reader(in);
+            std::string_view line;
+            while(reader.next(line)) {
+                bytes += line.size();
+            }
+            return bytes;
+        });
+        state.SetLabel(pargrep::NewlineScanner::implementation());
+    }
+
+    // As the many thread version reads: whole lines copied a block at a time, then counted as a worker would:
+    static void BM_ReadLinesBlocks(benchmark::State &state) {
+        ReadLines(state, [](std::istream& in) {
+            std::size_t lines = 0;
+            pargrep::LineReader reader(in);
+            std::string text;
+            while(reader.nextLines(text, 256 * 1024)) {
+                lines += pargrep::NewlineScanner::count(text.data(), text.data() + text.size());
+                text.clear();
+            }
+            return lines;
+        });
+        state.SetLabel(pargrep::NewlineScanner::implementation());
+    }
+
+    // The many thread version with and without line numbers, which the workers count:
+    static void BM_NumberedGrepPar2(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {
+                "[DEBUG]: ",
+                "[WARNING]: ",
+                "[INFO]: ",
+                "[ERROR]: "
+        };
+        const string fullPath = CreateTempFile(prefixes, 10, 120, state.range(0), "BM_NumberedGrep_input.log");
+        pargrep::Options options;
+        options.lineNumbers = state.range(1) != 0;
+
+        while (state.KeepRunning())
+        {
+            ifstream in(fullPath);
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            pargrep::pargrep_stream_par2(in, std::string("ERROR"), out, options);
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+
+    // The many thread version on a log of a few lines repeated over and over, with and without the workers' line caches:
+    static void BM_RepeatedLinesGrepPar2(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {
+                "heartbeat: ok",
+                "    at com.example.Worker.run(Worker.java:42)",
+                "    at java.lang.Thread.run(Thread.java:748)",
+                "",
+                "[ERROR]: connection reset by peer"
+        };
+        const string fullPath = CreateTempFile(prefixes, 0, 0, state.range(0), "BM_RepeatedLinesGrep_input.log");
+        pargrep::Options options;
+        options.lineCacheEntries = state.range(1);
+        pargrep::PipelineStats stats;
+        options.stats = &stats;
+
+        while (state.KeepRunning())
+        {
+            ifstream in(fullPath);
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            pargrep::pargrep_stream_par2(in, std::string("[0-9][0-9]\\)$|^$"), out, options);
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+        state.counters["hit_rate"] = stats.lineCacheLookups == 0 ? 0 : double(stats.lineCacheHits) / stats.lineCacheLookups;
+    }
+
+    // The many thread version with a few lines of context around each match, which the writer formats:
+    static void BM_ContextGrepPar2(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {
+                "[DEBUG]: ",
+                "[WARNING]: ",
+                "[INFO]: ",
+                "[ERROR]: "
+        };
+        const string fullPath = CreateTempFile(prefixes, 10, 120, state.range(0), "BM_ContextGrep_input.log");
+        pargrep::Options options;
+        options.beforeContext = options.afterContext = state.range(1);
+
+        while (state.KeepRunning())
+        {
+            ifstream in(fullPath);
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            pargrep::pargrep_stream_par2(in, std::string("ERROR"), out, options);
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+    // A rare message in a big log, searched in full and through a trigram index of the log:
+    static void BM_IndexedGrep(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {
+                "[DEBUG]: ",
+                "[WARNING]: ",
+                "[INFO]: ",
+                "[ERROR]: "
+        };
+        const string fullPath = CreateTempFile(prefixes, 10, 120, state.range(0), "BM_IndexedGrep_input.log");
+        {
+            ofstream append(fullPath, ios_base::app);
+            append << "[FATAL]: disk full" << endl;
+        }
+        const string indexPath = fullPath + pargrep::TRIGRAM_INDEX_SUFFIX;
+        pargrep::TrigramIndex::build(fullPath, indexPath);
+        pargrep::Options options;
+
+        while (state.KeepRunning())
+        {
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            if(state.range(1)) {
+                pargrep::pargrep_file_indexed(fullPath, indexPath, std::string("FATAL.*full"), out, options);
+            } else {
+                pargrep::pargrep_file_mmap(fullPath, std::string("FATAL.*full"), out, options);
+            }
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+
+    // Grep over a directory of many small files, as when searching rotated logs:
+    static void BM_TreeGrep(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {
+                "[DEBUG]: ",
+                "[WARNING]: ",
+                "[INFO]: ",
+                "[ERROR]: "
+        };
+        const auto numFiles = state.range(0);
+        const string directory = "BM_TreeGrep";
+        mkdir(("/tmp/" + directory).c_str(), 0777);
+        for(long i = 0; i < numFiles; ++i) {
+            CreateTempFile(prefixes, 10, 120, 200, directory + "/" + to_string(i) + ".log");
+        }
+        pargrep::Options options;
+        options.recursive = true;
+        options.withFilenames = true;
+
+        while (state.KeepRunning())
+        {
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            pargrep::pargrep_tree({"/tmp/" + directory}, GREP_PATTERN, out, options);
+        }
+        state.SetItemsProcessed(state.iterations() * numFiles);
+    }
+    // End to end latency of a search of a short log compiled and run cold, as by prep, or sent to a daemon with the pattern already compiled:
+    static void BM_DaemonGrep(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {
+                "[DEBUG]: ",
+                "[WARNING]: ",
+                "[INFO]: ",
+                "[ERROR]: "
+        };
+        const string fullPath = CreateTempFile(prefixes, 10, 120, 50, "BM_DaemonGrep_input.log");
+        // Word boundaries need std::regex, the slowest of the engines to compile:
+        string pattern = "\\b(";
+        for(int i = 0; i < 256; ++i) {
+            pattern += (i == 0 ? "" : "|") + string("Code") + to_string(i * 37);
+        }
+        pattern += ")\\b";
+        // The daemon changes directory for each search, so put this process's back afterwards:
+        const auto directory = std::filesystem::current_path();
+        const string socketPath = "/tmp/pargrep_benchmark.sock";
+        pargrep::SearchDaemon daemon(socketPath);
+        std::thread server;
+        if(state.range(0) && daemon.listen()) {
+            server = std::thread([&daemon]() { daemon.serve(); });
+        }
+
+        while (state.KeepRunning())
+        {
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            if(state.range(0)) {
+                std::uint64_t matches = 0;
+                pargrep::searchOnDaemon(socketPath, {pattern, fullPath}, out, matches);
+            } else {
+                pargrep::Options options;
+                options.label = fullPath;
+                ifstream in(fullPath);
+                pargrep::pargrep_auto(in, pargrep::makeMatcher({pattern}, options), out, options);
+            }
+        }
+        if(server.joinable()) {
+            daemon.stop();
+            server.join();
+        }
+        std::filesystem::current_path(directory);
+    }
+    // Grep letting pargrep_auto() choose how, reporting how many workers it settled on:
+    static void BM_AutoGrep(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {
+                "[DEBUG]: ",
+                "[WARNING]: ",
+                "[INFO]: ",
+                "[ERROR]: "
+        };
+        const string fullPath = CreateTempFile(prefixes, 10, 120, state.range(0), "BM_AutoGrep_input.log");
+        pargrep::Options options;
+        pargrep::PipelineStats stats;
+        options.stats = &stats;
+
+        double peakWorkers = 0;
+        while (state.KeepRunning())
+        {
+            ifstream in(fullPath);
+            ofstream out("/tmp/pargrep_benchmark_out.log", ios_base::trunc);
+            pargrep::pargrep_auto(in, std::string(GREP_PATTERN), out, options);
+            peakWorkers = max(peakWorkers, double(stats.peakWorkers));
+        }
+        state.counters["peak_workers"] = peakWorkers;
+    }
+    // Latency of many thread grep over a short input, with its threads started for each search or kept in a pool:
+    static void BM_ShortGrepPar2(benchmark::State &state) {
+        using namespace std;
+
+        vector<string> prefixes {
+                "[DEBUG]: ",
+                "[WARNING]: ",
+                "[INFO]: ",
+                "[ERROR]: "
+        };
+        const string fullPath = CreateTempFile(prefixes, 10, 120, 100, "BM_ShortGrep_input.log");
+        ifstream file(fullPath);
+        const string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        pargrep::ThreadPool pool;
+        pargrep::Options options;
+        options.pool = state.range(0) ? &pool : nullptr;
+
+        while (state.KeepRunning())
+        {
+            istringstream in(text);
+            ostringstream out;
+            pargrep::pargrep_stream_par2(in, std::string(GREP_PATTERN), out, options);
+        }
+    }
 #if 1
+    BENCHMARK(BM_ShortGrepPar2)->Unit(benchmark::kMicrosecond)->UseRealTime()->Arg(0)->Arg(1);
+    BENCHMARK(BM_DaemonGrep)->Unit(benchmark::kMicrosecond)->UseRealTime()->Arg(0)->Arg(1);
+    BENCHMARK(BM_AutoGrep)->Unit(benchmark::kMillisecond)->UseRealTime()->Arg(100)->Arg(100000);
+    BENCHMARK(BM_IndexedGrep)->Unit(benchmark::kMillisecond)->UseRealTime()->Args({1000000, 0})->Args({1000000, 1});
+    BENCHMARK(BM_TreeGrep)->Unit(benchmark::kMillisecond)->UseRealTime()->Arg(1000);
+    BENCHMARK(BM_ReadLinesGetline)->Unit(benchmark::kMillisecond)->Args({1000000, 20})->Args({1000000, 120});
+    BENCHMARK(BM_ReadLinesLineReader)->Unit(benchmark::kMillisecond)->Args({1000000, 20})->Args({1000000, 120});
+    BENCHMARK(BM_ReadLinesBlocks)->Unit(benchmark::kMillisecond)->Args({1000000, 20})->Args({1000000, 120});
+    BENCHMARK(BM_NumberedGrepPar2)->Unit(benchmark::kMillisecond)->UseRealTime()->Args({100000, 0})->Args({100000, 1});
+    BENCHMARK(BM_RepeatedLinesGrepPar2)->Unit(benchmark::kMillisecond)->UseRealTime()->Args({100000, 0})->Args({100000, 4096});
+    BENCHMARK(BM_ContextGrepPar2)->Unit(benchmark::kMillisecond)->UseRealTime()->Args({100000, 0})->Args({100000, 2});
+    BENCHMARK(BM_EmptyPatternSetGrep)->Unit(benchmark::kMillisecond)->UseRealTime()->Args({200000, 0})->Args({200000, 1});
+    BENCHMARK(BM_EarlyExitGrepPar2)->Unit(benchmark::kMillisecond)->UseRealTime()->Args({100000, 0})->Args({100000, 1})->Args({100000, 3});
+    BENCHMARK(BM_HighMatchGrepPar2)->Unit(benchmark::kMillisecond)->UseRealTime()->Arg(100000);
+    BENCHMARK(BM_HighMatchGrep)->Unit(benchmark::kMillisecond)->Args({100000, 0})->Args({100000, 1});
+
+    BENCHMARK(BM_SkewedGrepPar2)->Unit(benchmark::kMillisecond)->UseRealTime()->Arg(20000)->Arg(100000);
+
+    BENCHMARK(BM_StaticPatternGrep)->Unit(benchmark::kMillisecond)->Arg(100)->Arg(1000)->Arg(2000)->Arg(3000);
+
     BENCHMARK(BM_RegexGrep)->Unit(benchmark::kMillisecond)->Repetitions(3)->ReportAggregatesOnly(true)->Arg(100)->Arg(1000)->Arg(2000)->Arg(3000)->ComputeStatistics("max", [](const std::vector<double>& v) -> double {
         return *(std::max_element(std::begin(v), std::end(v)));
     })->ComputeStatistics("min", [](const std::vector<double>& v) -> double {
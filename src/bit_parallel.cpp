@@ -0,0 +1,211 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "bit_parallel.h"
+#include "regex_syntax.h"
+#include <bitset>
+#include <vector>
+
+namespace pargrep {
+    using std::uint64_t;
+    using regex_syntax::Node;
+
+    constexpr unsigned BitParallelMatcher::MAX_POSITIONS;
+
+    namespace {
+        /**
+         * Glushkov construction: the positions a subexpression can start and end on,
+         * and whether it matches the empty string. Follow sets are accumulated as
+         * subexpressions are joined.
+         */
+        struct Glushkov {
+            bool nullable = true;
+            uint64_t first = 0;
+            uint64_t last = 0;
+        };
+
+        class Builder
+        {
+        public:
+            Builder(const std::vector<std::bitset<256>>& sets) : sets_(sets) {}
+
+            bool build(const Node& n, Glushkov& g)
+            {
+                g = visit(n);
+                return ok_;
+            }
+
+            uint64_t follow[BitParallelMatcher::MAX_POSITIONS] = {};
+            // The set of bytes each position accepts:
+            std::vector<std::uint32_t> positionSets;
+
+        private:
+            Glushkov concatenate(const Glushkov& a, const Glushkov& b)
+            {
+                for(unsigned i = 0; i < positionSets.size(); ++i) {
+                    if(a.last >> i & 1) {
+                        follow[i] |= b.first;
+                    }
+                }
+                Glushkov g;
+                g.nullable = a.nullable && b.nullable;
+                g.first = a.first | (a.nullable ? b.first : 0);
+                g.last = b.last | (b.nullable ? a.last : 0);
+                return g;
+            }
+
+            Glushkov visit(const Node& n)
+            {
+                Glushkov g;
+                if(!ok_) {
+                    return g;
+                }
+                switch(n.kind)
+                {
+                    case Node::Empty:
+                        break;
+                    case Node::Set: {
+                        if(positionSets.size() >= BitParallelMatcher::MAX_POSITIONS) {
+                            ok_ = false;
+                            break;
+                        }
+                        const uint64_t bit = uint64_t(1) << positionSets.size();
+                        positionSets.push_back(n.set);
+                        g.nullable = false;
+                        g.first = g.last = bit;
+                        break;
+                    }
+                    case Node::Concat:
+                        for(const Node& child : n.children) {
+                            g = concatenate(g, visit(child));
+                        }
+                        break;
+                    case Node::Alt:
+                        g.nullable = false;
+                        for(const Node& child : n.children) {
+                            const Glushkov branch = visit(child);
+                            g.nullable = g.nullable || branch.nullable;
+                            g.first |= branch.first;
+                            g.last |= branch.last;
+                        }
+                        break;
+                    case Node::Repeat: {
+                        const Node& child = n.children[0];
+                        for(int i = 0; i < n.min; ++i) {
+                            g = concatenate(g, visit(child));
+                        }
+                        if(n.max == regex_syntax::UNBOUNDED) {
+                            Glushkov loop = visit(child);
+                            for(unsigned i = 0; i < positionSets.size(); ++i) {
+                                if(loop.last >> i & 1) {
+                                    follow[i] |= loop.first;
+                                }
+                            }
+                            loop.nullable = true;
+                            g = concatenate(g, loop);
+                        } else {
+                            for(int i = n.min; i < n.max; ++i) {
+                                Glushkov optional = visit(child);
+                                optional.nullable = true;
+                                g = concatenate(g, optional);
+                            }
+                        }
+                        break;
+                    }
+                    case Node::Begin: case Node::End:
+                        // Anchors are only supported at the ends of the whole pattern, which are stripped before building:
+                        ok_ = false;
+                        break;
+                }
+                return g;
+            }
+
+            const std::vector<std::bitset<256>>& sets_;
+            bool ok_ = true;
+        };
+    }
+
+    std::shared_ptr<const BitParallelMatcher> BitParallelMatcher::compile(const std::string& pattern)
+    {
+        Node root;
+        std::vector<std::bitset<256>> sets;
+        if(!regex_syntax::parse(pattern, root, sets)) {
+            return nullptr;
+        }
+
+        std::shared_ptr<BitParallelMatcher> matcher(new BitParallelMatcher());
+        if(root.kind == Node::Concat && !root.children.empty() && root.children.front().kind == Node::Begin) {
+            matcher->anchoredBegin_ = true;
+            root.children.erase(root.children.begin());
+        }
+        if(root.kind == Node::Concat && !root.children.empty() && root.children.back().kind == Node::End) {
+            matcher->anchoredEnd_ = true;
+            root.children.pop_back();
+        }
+
+        Builder builder(sets);
+        Glushkov g;
+        if(!builder.build(root, g)) {
+            return nullptr;
+        }
+
+        const unsigned numPositions = unsigned(builder.positionSets.size());
+        matcher->numPositions_ = numPositions;
+        matcher->first_ = g.first;
+        matcher->last_ = g.last;
+        matcher->nullable_ = g.nullable;
+        matcher->numTables_ = (numPositions + 7) / 8;
+
+        matcher->linear_ = true;
+        for(unsigned i = 0; i < numPositions; ++i)
+        {
+            const uint64_t next = i + 1 < numPositions ? uint64_t(1) << (i + 1) : 0;
+            matcher->linear_ = matcher->linear_ && builder.follow[i] == next;
+            for(unsigned b = 0; b < 256; ++b) {
+                if(sets[builder.positionSets[i]][b]) {
+                    matcher->accepts_[b] |= uint64_t(1) << i;
+                }
+            }
+        }
+        for(unsigned t = 0; t < matcher->numTables_; ++t) {
+            for(unsigned v = 0; v < 256; ++v) {
+                uint64_t follow = 0;
+                for(unsigned j = 0; j < 8 && 8 * t + j < numPositions; ++j) {
+                    if(v >> j & 1) {
+                        follow |= builder.follow[8 * t + j];
+                    }
+                }
+                matcher->follow_[t][v] = follow;
+            }
+        }
+        return matcher;
+    }
+
+    bool BitParallelMatcher::search(const char* const begin, const char* const end) const
+    {
+        // An empty match at the start (or end) of the line:
+        if(nullable_ && (!anchoredBegin_ || !anchoredEnd_ || begin == end)) {
+            return true;
+        }
+        uint64_t states = 0;
+        // Positions a match may start on at the next byte:
+        uint64_t start = first_;
+        for(const char* p = begin; p < end; ++p)
+        {
+            const uint64_t reached = (linear_ ? states << 1 : followOf(states)) | start;
+            states = reached & accepts_[std::uint8_t(*p)];
+            if(anchoredBegin_) {
+                start = 0;
+                if(!states) {
+                    return false;
+                }
+            }
+            if(!anchoredEnd_ && (states & last_)) {
+                return true;
+            }
+        }
+        return anchoredEnd_ && (states & last_);
+    }
+}
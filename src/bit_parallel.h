@@ -0,0 +1,71 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// Bit-parallel NFA simulation for short regexes.
+//
+#ifndef PARGREP_BIT_PARALLEL_H
+#define PARGREP_BIT_PARALLEL_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace pargrep {
+
+    /**
+     * Simulates the Glushkov NFA of a regex with at most 64 positions (characters,
+     * classes and dots, after expanding counted repetitions) in a single 64-bit word,
+     * one bit per position.
+     * Each byte costs a shift (for patterns which are plain sequences of classes, as
+     * in classic shift-and) or a few table lookups to follow transitions, then a mask
+     * with the positions accepting that byte. Searching allocates nothing, never
+     * backtracks, and mutates nothing, so one instance serves every thread.
+     */
+    class BitParallelMatcher
+    {
+    public:
+        static constexpr unsigned MAX_POSITIONS = 64;
+
+        /**
+         * @return Null if regex_syntax::parse() doesn't support the pattern, it has
+         * more than MAX_POSITIONS positions, or it uses ^ / $ anywhere but the very
+         * start / end.
+         */
+        static std::shared_ptr<const BitParallelMatcher> compile(const std::string& pattern);
+
+        /// True if any part of the line [begin, end) matches.
+        bool search(const char* begin, const char* end) const;
+
+        unsigned numPositions() const { return numPositions_; }
+
+    private:
+        BitParallelMatcher() = default;
+
+        std::uint64_t followOf(const std::uint64_t states) const
+        {
+            std::uint64_t follow = 0;
+            for(unsigned t = 0; t < numTables_; ++t) {
+                follow |= follow_[t][std::uint8_t(states >> (8 * t))];
+            }
+            return follow;
+        }
+
+        // Positions accepting each byte:
+        std::uint64_t accepts_[256] = {};
+        // Positions following any of the positions in each byte of the state word:
+        std::uint64_t follow_[8][256] = {};
+        unsigned numTables_ = 0;
+        unsigned numPositions_ = 0;
+        std::uint64_t first_ = 0;
+        std::uint64_t last_ = 0;
+        // Position i is only ever followed by position i + 1:
+        bool linear_ = false;
+        // The empty string matches:
+        bool nullable_ = false;
+        bool anchoredBegin_ = false;
+        bool anchoredEnd_ = false;
+    };
+}
+
+#endif //PARGREP_BIT_PARALLEL_H
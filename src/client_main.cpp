@@ -0,0 +1,26 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// prep-client: run a search on prep-daemon, taking the same arguments as prep.
+//
+#include "search_daemon.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+    using namespace pargrep;
+
+    if(argc < 2) {
+        cerr << "usage: prep-client socket [prep's arguments]" << endl;
+        return 2;
+    }
+    std::uint64_t matches = 0;
+    const int status = searchOnDaemon(argv[1], std::vector<std::string>(argv + 2, argv + argc), std::cout, matches);
+    cout.flush();
+    return status;
+}
@@ -0,0 +1,129 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "command_line.h"
+#include "matcher.h"
+#include "trigram_index.h"
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+
+namespace pargrep {
+
+    /**
+     * The number after an option such as -m, moving i on to it.
+     * @throw std::invalid_argument If there is none or it isn't a number.
+     */
+    std::uint64_t optionValue(const std::vector<std::string>& args, std::size_t& i)
+    {
+        const std::string& option = args[i];
+        if(++i == args.size()) {
+            throw std::invalid_argument("option requires an argument -- " + option.substr(1));
+        }
+        const std::string& value = args[i];
+        char* end = nullptr;
+        const std::uint64_t number = std::strtoull(value.c_str(), &end, 10);
+        if(value.empty() || !std::isdigit(static_cast<unsigned char>(value.front())) || *end != '\0') {
+            throw std::invalid_argument("invalid number " + value + " for " + option);
+        }
+        return number;
+    }
+
+    // See command_line.h
+    Command parseCommandLine(const std::vector<std::string>& args)
+    {
+        Command command;
+        Options& options = command.options;
+        unsigned positional = 0;
+        bool optionsEnded = false;
+        for(std::size_t i = 0; i < args.size(); ++i)
+        {
+            const std::string& arg = args[i];
+            // Anything after -- is the pattern or a file, even if it starts with a dash:
+            if(optionsEnded || arg.size() < 2 || arg.front() != '-') {
+                if(positional == 0) {
+                    command.pattern = arg;
+                } else {
+                    command.filenames.push_back(arg);
+                }
+                ++positional;
+            } else if(arg == "--") {
+                optionsEnded = true;
+            } else if(arg == "-F") {
+                options.fixedStrings = true;
+            } else if(arg == "-r") {
+                options.recursive = true;
+            } else if(arg == "-c") {
+                options.mode = OutputMode::Count;
+            } else if(arg == "-l") {
+                options.mode = OutputMode::FilesWithMatches;
+            } else if(arg == "-q") {
+                options.mode = OutputMode::Quiet;
+            } else if(arg == "-m") {
+                options.maxCount = optionValue(args, i);
+                command.searchNothing = options.maxCount == 0;
+            } else if(arg == "-A") {
+                options.afterContext = optionValue(args, i);
+            } else if(arg == "-B") {
+                options.beforeContext = optionValue(args, i);
+            } else if(arg == "-C") {
+                options.beforeContext = options.afterContext = optionValue(args, i);
+            } else if(arg == "-f") {
+                if(i + 1 == args.size()) {
+                    throw std::invalid_argument("option requires an argument -- f");
+                }
+                // The pattern is a file of patterns:
+                options.patternFile = true;
+                command.pattern = args[++i];
+                ++positional;
+            } else {
+                // Rather than search for it, as that would quietly do something else:
+                throw std::invalid_argument("unknown option " + arg);
+            }
+        }
+        return command;
+    }
+
+    // See command_line.h
+    std::uint64_t runCommand(Command command, const std::vector<std::string>& patterns, const Matcher& matcher, std::ostream& output)
+    {
+        if(command.searchNothing) {
+            return 0;
+        }
+        Options& options = command.options;
+        if(options.recursive || command.filenames.size() > 1)
+        {
+            if(command.filenames.empty()) {
+                command.filenames.push_back(".");
+            }
+            // Say which file each line came from, like grep:
+            options.withFilenames = true;
+            return pargrep_tree(command.filenames, matcher, output, options);
+        }
+        const std::string filename = command.filenames.empty() ? "/tmp/pargrep.in" : command.filenames.front();
+        options.label = filename;
+
+        // A file indexed by prep-index need only be searched where the index allows:
+        const std::string indexFilename = filename + TRIGRAM_INDEX_SUFFIX;
+        if(std::ifstream(indexFilename).good()) {
+            return pargrep_file_indexed(filename, indexFilename, patterns, matcher, output, options);
+        }
+        std::ifstream in(filename);
+        if(!in.is_open()) {
+            throw std::runtime_error("unable to open " + filename);
+        }
+        return pargrep_auto(in, matcher, output, options);
+    }
+
+    // See command_line.h
+    int exitStatus(const Options& options, const std::uint64_t matches, const bool failed)
+    {
+        if(failed) {
+            return options.mode == OutputMode::Quiet && matches > 0 ? 0 : 2;
+        }
+        return matches > 0 ? 0 : 1;
+    }
+}
@@ -0,0 +1,57 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// prep's command line, shared by prep and the search daemon.
+//
+#ifndef PARGREP_COMMAND_LINE_H
+#define PARGREP_COMMAND_LINE_H
+
+#include "pargrep.h"
+#include <string>
+#include <vector>
+
+namespace pargrep {
+
+    /**
+     * A search as given on prep's command line.
+     */
+    struct Command {
+        std::string pattern = "[qz]";
+        std::vector<std::string> filenames;
+        Options options;
+        /// Set by -m 0, which like grep finds no match without reading anything. Options::maxCount
+        /// can't say this, as there zero is no limit.
+        bool searchNothing = false;
+    };
+
+    /// prep's arguments, for a usage message:
+    constexpr const char* COMMAND_LINE_USAGE = "[-F] [-r] [-c|-l|-q] [-m n] [-A n] [-B n] [-C n] [--] pattern|-f patternFile [file...]";
+
+    /**
+     * Read prep's arguments, not counting the program name, as in COMMAND_LINE_USAGE.
+     * @throw std::invalid_argument If an option isn't known or is missing its value.
+     */
+    Command parseCommandLine(const std::vector<std::string>& args);
+
+    /**
+     * Run a search as prep does, with its patterns already compiled.
+     * Many files, or -r, are searched as a tree. A single file is searched through
+     * its trigram index if prep-index has built one, else as a stream. Nothing is
+     * searched or output for -m 0.
+     * @param patterns The command's patterns from patternList().
+     * @param matcher The patterns compiled by makeMatcher().
+     * @return The number of matching lines.
+     * @throw std::runtime_error If the single file to search can't be opened.
+     */
+    std::uint64_t runCommand(Command command, const std::vector<std::string>& patterns, const Matcher& matcher, std::ostream& output);
+
+    /**
+     * The status prep exits with, as grep's: 0 if a line matched, 1 if none did
+     * and 2 if the search failed, unless -q had already found a match.
+     * @param failed Whether the search threw, see UnsearchedFiles.
+     */
+    int exitStatus(const Options& options, std::uint64_t matches, bool failed);
+}
+
+#endif //PARGREP_COMMAND_LINE_H
@@ -0,0 +1,360 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// Bounded lock-free queues of pointers for handing work between threads.
+//
+#ifndef PARGREP_CONCURRENT_QUEUE_H
+#define PARGREP_CONCURRENT_QUEUE_H
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pargrep {
+
+    /**
+     * Where a thread waits for a queue to change state.
+     * Waiters spin on the condition for a while before sleeping on a condition
+     * variable, and wakers only touch the mutex if someone is actually asleep, so
+     * a busy pipeline runs without any system calls.
+     */
+    class Parker
+    {
+    public:
+        /**
+         * Return once ready() has returned true.
+         * ready() is called under the parker's lock so it mustn't notify anything.
+         */
+        template<typename Ready>
+        void wait(Ready ready)
+        {
+            for(unsigned i = 0; i < SPINS; ++i) {
+                if(ready()) {
+                    return;
+                }
+            }
+            for(unsigned i = 0; i < YIELDS; ++i) {
+                std::this_thread::yield();
+                if(ready()) {
+                    return;
+                }
+            }
+            std::unique_lock<std::mutex> lock(m_);
+            // Paired with the fence in notify() so either we see the new state or the waker sees us:
+            sleepers_.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while(!ready()) {
+                c_.wait(lock);
+            }
+            sleepers_.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        /// Wake all waiters, after publishing whatever they are waiting for.
+        void notify()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(sleepers_.load(std::memory_order_relaxed) != 0) {
+                std::lock_guard<std::mutex> lock(m_);
+                c_.notify_all();
+            }
+        }
+
+    private:
+        static constexpr unsigned SPINS = 256;
+        static constexpr unsigned YIELDS = 16;
+
+        std::atomic<unsigned> sleepers_ {0};
+        std::mutex m_;
+        std::condition_variable c_;
+    };
+
+    inline std::size_t roundUpToPowerOfTwo(const std::size_t n)
+    {
+        std::size_t p = 1;
+        while(p < n) {
+            p <<= 1;
+        }
+        return p;
+    }
+
+    /**
+     * A bounded ring of pointers from a single producer thread to a single consumer
+     * thread, owned _elsewhere_ (**if at all**).
+     * Neither end takes a lock unless it has to sleep because the ring is full or
+     * empty.
+     */
+    template<typename T>
+    class SpscQueue
+    {
+    public:
+        /// @param capacity The most pointers the queue can hold, rounded up to a power of two.
+        explicit SpscQueue(const std::size_t capacity) :
+            slots_(roundUpToPowerOfTwo(capacity)),
+            mask_(slots_.size() - 1)
+        {}
+
+        /**
+         * Add a pointer to the back of the queue if there is room for it.
+         * @param item A reference to a pointer. This will be null on return if it was
+         * pushed, to force the caller to segfault if it uses it.
+         * @return False if the queue was full.
+         */
+        bool tryPush(T*& item)
+        {
+            const std::size_t tail = tail_.load(std::memory_order_relaxed);
+            if(tail - head_.load(std::memory_order_acquire) == slots_.size()) {
+                return false;
+            }
+            slots_[tail & mask_] = item;
+            tail_.store(tail + 1, std::memory_order_release);
+            item = nullptr;
+            notEmpty_.notify();
+            return true;
+        }
+
+        /// As tryPush(), waiting for room if the queue is full.
+        void push(T*& item)
+        {
+            if(!tryPush(item)) {
+                notFull_.wait([&]() { return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire) < slots_.size(); });
+                tryPush(item);
+            }
+        }
+
+        /**
+         * Retrieve everything in the queue, returning immediately if it is empty.
+         * @param outItems A buffer to hold popped pointers. Contents will be overwritten not appended-to.
+         */
+        void tryPopAll(std::vector<T*>& outItems)
+        {
+            outItems.clear();
+            std::size_t head = head_.load(std::memory_order_relaxed);
+            const std::size_t tail = tail_.load(std::memory_order_acquire);
+            if(head == tail) {
+                return;
+            }
+            for(; head != tail; ++head) {
+                outItems.push_back(slots_[head & mask_]);
+            }
+            head_.store(head, std::memory_order_release);
+            notFull_.notify();
+        }
+
+        /// As tryPopAll(), waiting for something to pop if the queue is empty.
+        void popAll(std::vector<T*>& outItems)
+        {
+            tryPopAll(outItems);
+            if(outItems.empty()) {
+                notEmpty_.wait([&]() { return !empty(); });
+                tryPopAll(outItems);
+            }
+        }
+
+        /// In concurrent use, this is of course only a hint.
+        bool empty() const
+        {
+            return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+        }
+
+    private:
+        std::vector<T*> slots_;
+        const std::size_t mask_;
+        // Each end on its own cacheline:
+        alignas(64) std::atomic<std::size_t> head_ {0};
+        alignas(64) std::atomic<std::size_t> tail_ {0};
+        Parker notEmpty_;
+        Parker notFull_;
+    };
+
+    /**
+     * A bounded ring of pointers from many producer threads to a single consumer
+     * thread.
+     * Producers claim slots with a compare and swap on the tail then publish them by
+     * bumping a per-slot sequence number, so a slow producer only holds up the
+     * consumer at its own slot.
+     */
+    template<typename T>
+    class MpscQueue
+    {
+    public:
+        /// @param capacity The most pointers the queue can hold, rounded up to a power of two.
+        explicit MpscQueue(const std::size_t capacity) :
+            slots_(roundUpToPowerOfTwo(capacity)),
+            mask_(slots_.size() - 1)
+        {
+            for(std::size_t i = 0; i < slots_.size(); ++i) {
+                slots_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        /// See SpscQueue::tryPush().
+        bool tryPush(T*& item)
+        {
+            std::size_t tail = tail_.load(std::memory_order_relaxed);
+            Slot* slot = nullptr;
+            while(true)
+            {
+                slot = &slots_[tail & mask_];
+                const std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+                const std::ptrdiff_t lag = std::ptrdiff_t(sequence) - std::ptrdiff_t(tail);
+                if(lag == 0) {
+                    if(tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if(lag < 0) {
+                    // The consumer hasn't freed this slot from the last time round:
+                    return false;
+                } else {
+                    tail = tail_.load(std::memory_order_relaxed);
+                }
+            }
+            slot->item = item;
+            slot->sequence.store(tail + 1, std::memory_order_release);
+            item = nullptr;
+            notEmpty_.notify();
+            return true;
+        }
+
+        /// See SpscQueue::push().
+        void push(T*& item)
+        {
+            // Other producers may beat us to the room made:
+            while(!tryPush(item)) {
+                notFull_.wait([&]() { return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire) < slots_.size(); });
+            }
+        }
+
+        /// See SpscQueue::tryPopAll().
+        void tryPopAll(std::vector<T*>& outItems)
+        {
+            outItems.clear();
+            std::size_t head = head_.load(std::memory_order_relaxed);
+            while(true)
+            {
+                Slot& slot = slots_[head & mask_];
+                if(slot.sequence.load(std::memory_order_acquire) != head + 1) {
+                    break;
+                }
+                outItems.push_back(slot.item);
+                slot.sequence.store(head + slots_.size(), std::memory_order_release);
+                ++head;
+            }
+            if(head != head_.load(std::memory_order_relaxed)) {
+                head_.store(head, std::memory_order_release);
+                notFull_.notify();
+            }
+        }
+
+        /// See SpscQueue::popAll().
+        void popAll(std::vector<T*>& outItems)
+        {
+            tryPopAll(outItems);
+            if(outItems.empty()) {
+                notEmpty_.wait([&]() { return !empty(); });
+                tryPopAll(outItems);
+            }
+        }
+
+        /// Only meaningful on the consumer thread.
+        bool empty() const
+        {
+            const std::size_t head = head_.load(std::memory_order_relaxed);
+            return slots_[head & mask_].sequence.load(std::memory_order_acquire) != head + 1;
+        }
+
+    private:
+        struct Slot {
+            std::atomic<std::size_t> sequence {0};
+            T* item = nullptr;
+        };
+
+        std::vector<Slot> slots_;
+        const std::size_t mask_;
+        // Only written by the consumer:
+        alignas(64) std::atomic<std::size_t> head_ {0};
+        alignas(64) std::atomic<std::size_t> tail_ {0};
+        Parker notEmpty_;
+        Parker notFull_;
+    };
+
+    /**
+     * Puts items numbered 1, 2, 3, ... which arrive in any order back into order.
+     * Items are filed in a ring indexed by their sequence number, so insertion and
+     * taking the next item are O(1) however far ahead of the oldest one the newest
+     * has got.
+     * The ring has a fixed capacity. The producer of the items calls waitForRoom()
+     * before sending out each one, so nothing can arrive which doesn't fit: the
+     * consumer falling behind holds back the producer instead of growing a buffer.
+     * Only the consumer thread may insert() and pop().
+     */
+    template<typename T>
+    class ReorderWindow
+    {
+    public:
+        /// @param capacity The most items held at once, rounded up to a power of two.
+        explicit ReorderWindow(const std::size_t capacity) :
+            slots_(roundUpToPowerOfTwo(capacity), nullptr),
+            mask_(slots_.size() - 1)
+        {}
+
+        /// Wait until the item with the given sequence number would fit in the window.
+        void waitForRoom(const std::uint64_t sequence)
+        {
+            notFull_.wait([&]() { return sequence <= retired_.load(std::memory_order_acquire) + slots_.size(); });
+        }
+
+        void insert(T* const item, const std::uint64_t sequence)
+        {
+            assert(sequence > retired_.load(std::memory_order_relaxed));
+            assert(sequence <= retired_.load(std::memory_order_relaxed) + slots_.size());
+            assert(slots_[sequence & mask_] == nullptr);
+            slots_[sequence & mask_] = item;
+            ++held_;
+        }
+
+        /// @return The next item in order, or null if it hasn't been inserted yet.
+        T* pop()
+        {
+            const std::uint64_t next = retired_.load(std::memory_order_relaxed) + 1;
+            T*& slot = slots_[next & mask_];
+            T* const item = slot;
+            if(item)
+            {
+                slot = nullptr;
+                --held_;
+                retired_.store(next, std::memory_order_release);
+                notFull_.notify();
+            }
+            return item;
+        }
+
+        /**
+         * Count the next item as popped without it going through the window, for a
+         * consumer which doesn't care about order. Don't mix with insert() and pop().
+         */
+        void retireUnordered()
+        {
+            retired_.store(retired_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            notFull_.notify();
+        }
+
+        /// The number of items waiting for an earlier one.
+        std::size_t size() const { return held_; }
+
+    private:
+        std::vector<T*> slots_;
+        const std::size_t mask_;
+        std::size_t held_ = 0;
+        // The sequence number of the last item popped:
+        alignas(64) std::atomic<std::uint64_t> retired_ {0};
+        Parker notFull_;
+    };
+}
+
+#endif //PARGREP_CONCURRENT_QUEUE_H
@@ -0,0 +1,54 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// prep-daemon: serve prep's searches on a Unix domain socket for prep-client.
+//
+#include "search_daemon.h"
+#include <csignal>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+namespace {
+    pargrep::SearchDaemon* running = nullptr;
+
+    void stopDaemon(int)
+    {
+        running->stop();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    using namespace pargrep;
+
+    std::string socketPath;
+    std::size_t cacheEntries = SearchDaemon::DEFAULT_CACHE_ENTRIES;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            cacheEntries = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            socketPath = argv[i];
+        }
+    }
+    if(socketPath.empty()) {
+        cerr << "usage: prep-daemon [-c cachedPatterns] socket" << endl;
+        return 2;
+    }
+
+    SearchDaemon server(socketPath, cacheEntries);
+    if(!server.listen()) {
+        return 1;
+    }
+    // Stop cleanly, so the socket is removed:
+    running = &server;
+    std::signal(SIGINT, stopDaemon);
+    std::signal(SIGTERM, stopDaemon);
+    server.serve();
+    return 0;
+}
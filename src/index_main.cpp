@@ -0,0 +1,45 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// prep-index: build the trigram index prep searches a file through.
+//
+#include "trigram_index.h"
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+    using namespace pargrep;
+
+    std::vector<std::string> filenames;
+    std::size_t blockBytes = TrigramIndex::DEFAULT_BLOCK_BYTES;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            blockBytes = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            filenames.push_back(argv[i]);
+        }
+    }
+    if(filenames.empty()) {
+        cerr << "usage: prep-index [-b blockBytes] file..." << endl;
+        return 2;
+    }
+
+    // Each index goes next to its file, where prep looks for it:
+    int status = 0;
+    for(const std::string& filename : filenames)
+    {
+        if(!TrigramIndex::build(filename, filename + TRIGRAM_INDEX_SUFFIX, blockBytes)) {
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,376 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "lazy_dfa.h"
+#include "regex_syntax.h"
+#include <algorithm>
+#include <map>
+
+namespace pargrep {
+    using std::string;
+    using std::vector;
+    using std::uint32_t;
+    using std::bitset;
+    using regex_syntax::Node;
+    using regex_syntax::UNBOUNDED;
+
+    namespace {
+        constexpr uint32_t NONE = ~uint32_t(0);
+        // Beyond this, counted repetitions have blown the NFA up and std::regex can have it:
+        constexpr std::size_t MAX_NFA_STATES = 16 * 1024;
+
+        /**
+         * Thompson construction of the NFA from the parse tree.
+         */
+        class Compiler
+        {
+        public:
+            explicit Compiler(vector<RegexProgram::State>& states) : states_(states) {}
+
+            // A partly built NFA: its start and the out pointers left dangling (state index, which out):
+            struct Fragment {
+                uint32_t start;
+                vector<std::pair<uint32_t, bool>> outs;
+            };
+
+            bool compile(const Node& root, uint32_t& start)
+            {
+                Fragment f = fragment(root);
+                if(!ok_) {
+                    return false;
+                }
+                const uint32_t match = add(RegexProgram::State::Match);
+                patch(f, match);
+                start = f.start;
+                return ok_;
+            }
+
+        private:
+            uint32_t add(RegexProgram::State::Kind kind, uint32_t set = 0)
+            {
+                if(states_.size() >= MAX_NFA_STATES) {
+                    ok_ = false;
+                }
+                states_.push_back(RegexProgram::State{kind, set, NONE, NONE});
+                return uint32_t(states_.size() - 1);
+            }
+
+            void patch(const Fragment& f, const uint32_t target)
+            {
+                for(const auto& out : f.outs) {
+                    (out.second ? states_[out.first].out1 : states_[out.first].out) = target;
+                }
+            }
+
+            Fragment epsilon()
+            {
+                const uint32_t s = add(RegexProgram::State::Split);
+                return Fragment{s, {{s, false}}};
+            }
+
+            Fragment fragment(const Node& n)
+            {
+                if(!ok_) {
+                    return Fragment{0, {}};
+                }
+                switch(n.kind)
+                {
+                    case Node::Empty:
+                        return epsilon();
+                    case Node::Set: {
+                        const uint32_t s = add(RegexProgram::State::Byte, n.set);
+                        return Fragment{s, {{s, false}}};
+                    }
+                    case Node::Begin: case Node::End: {
+                        const uint32_t s = add(n.kind == Node::Begin ? RegexProgram::State::Begin : RegexProgram::State::End);
+                        return Fragment{s, {{s, false}}};
+                    }
+                    case Node::Concat: {
+                        if(n.children.empty()) {
+                            return epsilon();
+                        }
+                        Fragment result = fragment(n.children[0]);
+                        for(size_t i = 1; i < n.children.size() && ok_; ++i) {
+                            Fragment next = fragment(n.children[i]);
+                            patch(result, next.start);
+                            result.outs = std::move(next.outs);
+                        }
+                        return result;
+                    }
+                    case Node::Alt: {
+                        Fragment result = fragment(n.children.back());
+                        for(size_t i = n.children.size() - 1; i-- > 0 && ok_;) {
+                            Fragment branch = fragment(n.children[i]);
+                            const uint32_t split = add(RegexProgram::State::Split);
+                            states_[split].out = branch.start;
+                            states_[split].out1 = result.start;
+                            branch.outs.insert(branch.outs.end(), result.outs.begin(), result.outs.end());
+                            result = Fragment{split, std::move(branch.outs)};
+                        }
+                        return result;
+                    }
+                    case Node::Repeat: {
+                        const Node& child = n.children[0];
+                        Fragment result = epsilon();
+                        for(int i = 0; i < n.min && ok_; ++i) {
+                            Fragment next = fragment(child);
+                            patch(result, next.start);
+                            result.outs = std::move(next.outs);
+                        }
+                        if(n.max == UNBOUNDED) {
+                            Fragment body = fragment(child);
+                            const uint32_t split = add(RegexProgram::State::Split);
+                            states_[split].out = body.start;
+                            patch(body, split);
+                            patch(result, split);
+                            result.outs = {{split, true}};
+                        } else {
+                            for(int i = n.min; i < n.max && ok_; ++i) {
+                                Fragment body = fragment(child);
+                                const uint32_t split = add(RegexProgram::State::Split);
+                                states_[split].out = body.start;
+                                patch(result, split);
+                                body.outs.emplace_back(split, true);
+                                result.outs = std::move(body.outs);
+                            }
+                        }
+                        return result;
+                    }
+                }
+                return epsilon();
+            }
+
+            vector<RegexProgram::State>& states_;
+            bool ok_ = true;
+        };
+    }
+
+    std::shared_ptr<const RegexProgram> RegexProgram::compile(const string& pattern)
+    {
+        auto program = std::make_shared<RegexProgram>();
+        Node root;
+        if(!regex_syntax::parse(pattern, root, program->sets)) {
+            return nullptr;
+        }
+        Compiler compiler(program->states);
+        if(!compiler.compile(root, program->start)) {
+            return nullptr;
+        }
+
+        // Bytes belonging to exactly the same sets are interchangeable:
+        std::map<vector<bool>, std::uint8_t> signatures;
+        for(unsigned b = 0; b < 256; ++b)
+        {
+            vector<bool> signature(program->sets.size());
+            for(size_t s = 0; s < program->sets.size(); ++s) {
+                signature[s] = program->sets[s][b];
+            }
+            const auto found = signatures.find(signature);
+            if(found == signatures.end()) {
+                const auto cls = std::uint8_t(program->representatives.size());
+                signatures.emplace(std::move(signature), cls);
+                program->representatives.push_back(std::uint8_t(b));
+                program->classes[b] = cls;
+            } else {
+                program->classes[b] = found->second;
+            }
+        }
+        return program;
+    }
+
+    std::size_t LazyDfa::KeyHash::operator()(const vector<uint32_t>& key) const
+    {
+        std::size_t h = 14695981039346656037ULL;
+        for(const uint32_t k : key) {
+            h = (h ^ k) * 1099511628211ULL;
+        }
+        return h;
+    }
+
+    LazyDfa::LazyDfa(std::shared_ptr<const RegexProgram> program, const std::size_t cacheBytes) :
+        program_(std::move(program)),
+        numClasses_(program_ ? program_->representatives.size() : 0),
+        maxStates_(std::max<std::size_t>(16, cacheBytes / (numClasses_ * sizeof(std::int32_t) + sizeof(DState) + 64)))
+    {
+        if(program_) {
+            visited_.assign(program_->states.size(), 0);
+        }
+    }
+
+    LazyDfa::LazyDfa(const LazyDfa& other) :
+        program_(other.program_),
+        numClasses_(other.numClasses_),
+        maxStates_(other.maxStates_)
+    {
+        if(program_) {
+            visited_.assign(program_->states.size(), 0);
+        }
+    }
+
+    constexpr std::uint8_t LazyDfa::MATCH;
+    constexpr std::uint8_t LazyDfa::DEAD;
+
+    void LazyDfa::nextGeneration()
+    {
+        if(++generation_ == 0) {
+            std::fill(visited_.begin(), visited_.end(), 0);
+            generation_ = 1;
+        }
+    }
+
+    void LazyDfa::closure(const uint32_t nfaState, const bool atBegin, vector<uint32_t>& members)
+    {
+        const auto& states = program_->states;
+        stack_.push_back(nfaState);
+        while(!stack_.empty())
+        {
+            const uint32_t s = stack_.back();
+            stack_.pop_back();
+            if(s == NONE || visited_[s] == generation_) {
+                continue;
+            }
+            visited_[s] = generation_;
+            const RegexProgram::State& state = states[s];
+            switch(state.kind)
+            {
+                case RegexProgram::State::Split:
+                    stack_.push_back(state.out1);
+                    stack_.push_back(state.out);
+                    break;
+                case RegexProgram::State::Begin:
+                    if(atBegin) {
+                        stack_.push_back(state.out);
+                    }
+                    break;
+                default:
+                    members.push_back(s);
+            }
+        }
+    }
+
+    bool LazyDfa::reachesMatchAtEnd(const vector<uint32_t>& members, const bool atBegin)
+    {
+        const auto& states = program_->states;
+        nextGeneration();
+        for(const uint32_t m : members) {
+            if(states[m].kind == RegexProgram::State::End) {
+                stack_.push_back(states[m].out);
+            }
+        }
+        bool found = false;
+        while(!stack_.empty())
+        {
+            const uint32_t s = stack_.back();
+            stack_.pop_back();
+            if(s == NONE || visited_[s] == generation_) {
+                continue;
+            }
+            visited_[s] = generation_;
+            const RegexProgram::State& state = states[s];
+            switch(state.kind)
+            {
+                case RegexProgram::State::Match: found = true; break;
+                case RegexProgram::State::Split: stack_.push_back(state.out1); stack_.push_back(state.out); break;
+                case RegexProgram::State::End: stack_.push_back(state.out); break;
+                case RegexProgram::State::Begin: if(atBegin) { stack_.push_back(state.out); } break;
+                case RegexProgram::State::Byte: break;
+            }
+        }
+        stack_.clear();
+        return found;
+    }
+
+    void LazyDfa::flush()
+    {
+        ++flushes_;
+        states_.clear();
+        flags_.clear();
+        transitions_.clear();
+        index_.clear();
+        startState_ = -1;
+    }
+
+    std::int32_t LazyDfa::addState(vector<uint32_t>& members, const bool atBegin)
+    {
+        std::sort(members.begin(), members.end());
+        members.push_back(atBegin);
+        const auto found = index_.find(members);
+        if(found != index_.end()) {
+            return found->second;
+        }
+        if(states_.size() >= maxStates_) {
+            flush();
+        }
+        const auto id = std::int32_t(states_.size());
+        index_.emplace(members, id);
+        members.pop_back();
+
+        DState state;
+        state.atBegin = atBegin;
+        state.match = std::any_of(members.begin(), members.end(), [this](uint32_t m) {
+            return program_->states[m].kind == RegexProgram::State::Match;
+        });
+        state.dead = members.empty();
+        state.matchAtEnd = state.match || reachesMatchAtEnd(members, atBegin);
+        state.members = std::move(members);
+        flags_.push_back((state.match ? MATCH : 0) | (state.dead ? DEAD : 0));
+        states_.push_back(std::move(state));
+        transitions_.resize(transitions_.size() + numClasses_, -1);
+        return id;
+    }
+
+    std::int32_t LazyDfa::transition(const std::int32_t from, const std::uint8_t cls)
+    {
+        const std::uint8_t byte = program_->representatives[cls];
+        const auto& states = program_->states;
+        vector<uint32_t> members;
+        nextGeneration();
+        for(const uint32_t m : states_[from].members)
+        {
+            const RegexProgram::State& state = states[m];
+            if(state.kind == RegexProgram::State::Byte && program_->sets[state.set][byte]) {
+                closure(state.out, false, members);
+            }
+        }
+        // A match may also start at the next position:
+        closure(program_->start, false, members);
+
+        const std::size_t flushesBefore = flushes_;
+        const std::int32_t to = addState(members, false);
+        if(flushes_ == flushesBefore) {
+            transitions_[std::size_t(from) * numClasses_ + cls] = to;
+        }
+        return to;
+    }
+
+    bool LazyDfa::search(const char* const begin, const char* const end)
+    {
+        if(startState_ < 0)
+        {
+            vector<uint32_t> members;
+            nextGeneration();
+            closure(program_->start, true, members);
+            startState_ = addState(members, true);
+        }
+        std::int32_t s = startState_;
+        if(states_[s].match) {
+            return true;
+        }
+        const std::uint8_t* const classes = program_->classes;
+        for(const char* p = begin; p < end; ++p)
+        {
+            const std::uint8_t cls = classes[std::uint8_t(*p)];
+            std::int32_t next = transitions_[std::size_t(s) * numClasses_ + cls];
+            if(next < 0) {
+                next = transition(s, cls);
+            }
+            s = next;
+            if(flags_[s]) {
+                return (flags_[s] & MATCH) != 0;
+            }
+        }
+        return states_[s].matchAtEnd;
+    }
+}
@@ -0,0 +1,115 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// A regex engine that doesn't backtrack, for the subset of ECMAScript regex
+// that needs no backtracking.
+//
+#ifndef PARGREP_LAZY_DFA_H
+#define PARGREP_LAZY_DFA_H
+
+#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace pargrep {
+
+    /**
+     * A regex compiled to a Thompson NFA over classes of bytes.
+     * Immutable once compiled, so it is shared between the LazyDfas of all threads.
+     */
+    class RegexProgram
+    {
+    public:
+        /**
+         * Compile a pattern if it only uses the features regex_syntax::parse() supports.
+         * @return Null if the pattern uses anything else (e.g. backreferences,
+         * lookahead, \b) or is too big, so the caller can fall back to std::regex.
+         */
+        static std::shared_ptr<const RegexProgram> compile(const std::string& pattern);
+
+        struct State {
+            enum Kind : std::uint8_t { Byte, Split, Begin, End, Match };
+            Kind kind;
+            // For Byte states, the index of the set of bytes accepted:
+            std::uint32_t set;
+            std::uint32_t out;
+            std::uint32_t out1;
+        };
+
+        std::vector<State> states;
+        std::vector<std::bitset<256>> sets;
+        std::uint32_t start = 0;
+        // Bytes which no set distinguishes share a class:
+        std::uint8_t classes[256] = {};
+        // A representative byte of each class:
+        std::vector<std::uint8_t> representatives;
+    };
+
+    /**
+     * Searches lines with a DFA built lazily from a RegexProgram, one state at a
+     * time as the input needs it, so it never backtracks and costs a table lookup
+     * per byte once warm.
+     * The cache of DFA states is bounded and simply flushed when full.
+     * Not thread safe: copies share the program but start with their own empty
+     * cache, so give each thread a copy.
+     */
+    class LazyDfa
+    {
+    public:
+        explicit LazyDfa(std::shared_ptr<const RegexProgram> program, std::size_t cacheBytes = 1024 * 1024);
+        LazyDfa(const LazyDfa& other);
+        LazyDfa& operator=(const LazyDfa&) = delete;
+
+        /// True if any part of the line [begin, end) matches.
+        bool search(const char* begin, const char* end);
+
+        /// Count of times the cache filled and was flushed.
+        std::size_t flushes() const { return flushes_; }
+
+    private:
+        struct DState {
+            // NFA Byte, End and Match states reached:
+            std::vector<std::uint32_t> members;
+            bool atBegin;
+            bool match;
+            bool matchAtEnd;
+            bool dead;
+        };
+        struct KeyHash {
+            std::size_t operator()(const std::vector<std::uint32_t>& key) const;
+        };
+
+        // Bits of flags_, a compact copy of the DState flags for the search loop:
+        static constexpr std::uint8_t MATCH = 1;
+        static constexpr std::uint8_t DEAD = 2;
+
+        void nextGeneration();
+        std::int32_t addState(std::vector<std::uint32_t>& members, bool atBegin);
+        std::int32_t transition(std::int32_t from, std::uint8_t cls);
+        void closure(std::uint32_t nfaState, bool atBegin, std::vector<std::uint32_t>& members);
+        bool reachesMatchAtEnd(const std::vector<std::uint32_t>& members, bool atBegin);
+        void flush();
+
+        std::shared_ptr<const RegexProgram> program_;
+        std::size_t numClasses_;
+        std::size_t maxStates_;
+        std::vector<DState> states_;
+        std::vector<std::uint8_t> flags_;
+        // Row per DFA state, -1 for a transition not yet computed:
+        std::vector<std::int32_t> transitions_;
+        // Keyed by sorted members with the atBegin flag appended:
+        std::unordered_map<std::vector<std::uint32_t>, std::int32_t, KeyHash> index_;
+        std::int32_t startState_ = -1;
+        // Scratch for closure():
+        std::vector<std::uint32_t> visited_;
+        std::uint32_t generation_ = 0;
+        std::vector<std::uint32_t> stack_;
+        std::size_t flushes_ = 0;
+    };
+}
+
+#endif //PARGREP_LAZY_DFA_H
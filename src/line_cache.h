@@ -0,0 +1,130 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// Remembering whether repeated lines matched.
+//
+#ifndef PARGREP_LINE_CACHE_H
+#define PARGREP_LINE_CACHE_H
+
+#include "concurrent_queue.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pargrep {
+
+    /// A quick hash of a line, eight bytes at a time.
+    inline std::uint64_t hashLine(const char* cursor, const char* const end)
+    {
+        std::uint64_t hash = 0x9e3779b97f4a7c15ULL ^ std::uint64_t(end - cursor);
+        std::uint64_t word = 0;
+        for(; end - cursor >= 8; cursor += 8) {
+            std::memcpy(&word, cursor, 8);
+            hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+            hash ^= hash >> 32;
+        }
+        word = 0;
+        std::memcpy(&word, cursor, end - cursor);
+        hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ULL;
+        return hash ^ (hash >> 29);
+    }
+
+    /**
+     * Remembers whether lines seen recently matched, so a line repeated over and
+     * over, such as a heartbeat message or a common stack frame, is only searched
+     * once. The empty line is the commonest repeat of all, and its answer is always
+     * remembered.
+     * Lines are filed in a direct-mapped table by hash, each replacing whatever
+     * was in its slot, so the cache never grows. The text is kept along with the
+     * hash, so a collision can't give a wrong answer.
+     * Input with few repeats only pays for the hashing, so once a trial of lookups
+     * has found too few hits the cache stops being consulted.
+     * Each thread searching has its own, so there is no locking.
+     */
+    class LineCache
+    {
+    public:
+        /// @param entries How many lines to remember, rounded up to a power of two. Zero to only remember the empty line.
+        explicit LineCache(const std::size_t entries) :
+            entries_(entries == 0 ? 0 : roundUpToPowerOfTwo(entries)),
+            mask_(entries_.empty() ? 0 : entries_.size() - 1),
+            enabled_(!entries_.empty())
+        {}
+
+        /// Search a line, or look up the answer for the same text searched before.
+        template<typename MatcherT>
+        bool search(MatcherT& matcher, const char* const begin, const char* const end)
+        {
+            if(begin == end)
+            {
+                ++lookups_;
+                if(emptyMatches_ < 0) {
+                    emptyMatches_ = matcher.search(begin, end);
+                } else {
+                    ++hits_;
+                }
+                endTrial();
+                return emptyMatches_;
+            }
+            if(!enabled_ || std::size_t(end - begin) > MAX_LINE_BYTES) {
+                return matcher.search(begin, end);
+            }
+            ++lookups_;
+            const std::uint64_t hash = hashLine(begin, end);
+            Entry& entry = entries_[hash & mask_];
+            if(entry.hash == hash && std::string_view(entry.text) == std::string_view(begin, end - begin)) {
+                ++hits_;
+                return entry.matched;
+            }
+            entry.hash = hash;
+            entry.text.assign(begin, end);
+            entry.matched = matcher.search(begin, end);
+            endTrial();
+            return entry.matched;
+        }
+
+        /// Lines looked up, including empty ones.
+        std::uint64_t lookups() const { return lookups_; }
+        /// Lookups answered without searching.
+        std::uint64_t hits() const { return hits_; }
+
+    private:
+        /// Once the trial's lookups are done, of either kind, give up on the table if too few hit.
+        void endTrial()
+        {
+            if(!trialDone_ && lookups_ >= TRIAL_LOOKUPS) {
+                trialDone_ = true;
+                if(hits_ < TRIAL_LOOKUPS / MIN_HIT_RATIO) {
+                    enabled_ = false;
+                }
+            }
+        }
+
+        // Longer lines are rarely repeated and are costly to compare:
+        static constexpr std::size_t MAX_LINE_BYTES = 256;
+        // The cache is given up if fewer than one in MIN_HIT_RATIO of the first TRIAL_LOOKUPS hit:
+        static constexpr std::uint64_t TRIAL_LOOKUPS = 4096;
+        static constexpr std::uint64_t MIN_HIT_RATIO = 8;
+
+        struct Entry {
+            std::uint64_t hash = 0;
+            std::string text;
+            bool matched = false;
+        };
+
+        std::vector<Entry> entries_;
+        const std::size_t mask_;
+        bool enabled_;
+        bool trialDone_ = false;
+        // Unknown until the first empty line is searched:
+        int emptyMatches_ = -1;
+        std::uint64_t lookups_ = 0;
+        std::uint64_t hits_ = 0;
+    };
+}
+
+#endif //PARGREP_LINE_CACHE_H
@@ -0,0 +1,248 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "line_reader.h"
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARGREP_X86 1
+#endif
+
+namespace pargrep {
+
+    namespace {
+#if !PARGREP_X86
+        std::uint64_t newlineMaskScalar(const char* const block)
+        {
+            std::uint64_t mask = 0;
+            for(unsigned i = 0; i < 64; ++i) {
+                mask |= std::uint64_t(block[i] == '\n') << i;
+            }
+            return mask;
+        }
+#else
+        __attribute__((target("sse2")))
+        std::uint64_t newlineMaskSse2(const char* const block)
+        {
+            const __m128i newline = _mm_set1_epi8('\n');
+            std::uint64_t mask = 0;
+            for(unsigned i = 0; i < 64; i += 16) {
+                const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+                mask |= std::uint64_t(unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)))) << i;
+            }
+            return mask;
+        }
+
+        __attribute__((target("avx2")))
+        std::uint64_t newlineMaskAvx2(const char* const block)
+        {
+            const __m256i newline = _mm256_set1_epi8('\n');
+            const __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+            const __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32));
+            return std::uint64_t(unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline)))) |
+                   std::uint64_t(unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)))) << 32;
+        }
+#endif
+
+        bool hasAvx2()
+        {
+#if PARGREP_X86
+            // This runs while statics are initialised, perhaps before the CPU has been probed:
+            __builtin_cpu_init();
+            static const bool avx2 = __builtin_cpu_supports("avx2");
+            return avx2;
+#else
+            return false;
+#endif
+        }
+    }
+
+    const NewlineScanner::MaskFunction NewlineScanner::newlineMask_ =
+#if PARGREP_X86
+        hasAvx2() ? newlineMaskAvx2 : newlineMaskSse2;
+#else
+        newlineMaskScalar;
+#endif
+
+    std::uint64_t NewlineScanner::tailMask(const char* const block, const std::size_t length)
+    {
+        // Too short to load 64 bytes without running off the end of the buffer:
+        std::uint64_t mask = 0;
+        for(const char* newline = block; (newline = static_cast<const char*>(std::memchr(newline, '\n', block + length - newline))); ++newline) {
+            mask |= std::uint64_t(1) << (newline - block);
+        }
+        return mask;
+    }
+
+    std::size_t NewlineScanner::count(const char* begin, const char* const end)
+    {
+        std::size_t newlines = 0;
+        for(; end - begin >= 64; begin += 64) {
+            newlines += __builtin_popcountll(newlineMask_(begin));
+        }
+        return newlines + __builtin_popcountll(tailMask(begin, end - begin));
+    }
+
+    const char* NewlineScanner::implementation()
+    {
+#if PARGREP_X86
+        return hasAvx2() ? "avx2" : "sse2";
+#else
+        return "scalar";
+#endif
+    }
+
+    LineReader::LineReader(std::istream& input, const bool partialReads, const std::size_t blockBytes) :
+        input_(input),
+        recycled_(nullptr),
+        budget_(nullptr),
+        maxBuffers_(0),
+        blockBytes_(blockBytes),
+        partialReads_(partialReads)
+    {}
+
+    LineReader::LineReader(std::istream& input, BufferQueue& recycled, MemoryBudget& budget, const std::size_t maxBuffers, const std::size_t blockBytes) :
+        input_(input),
+        recycled_(&recycled),
+        budget_(&budget),
+        maxBuffers_(maxBuffers),
+        blockBytes_(blockBytes),
+        partialReads_(false)
+    {}
+
+    LineReader::~LineReader()
+    {
+        if(current_) {
+            release(current_);
+        }
+        for(ReadBuffer* buffer : free_) {
+            delete buffer;
+        }
+        if(recycled_) {
+            recycled_->tryPopAll(free_);
+            for(ReadBuffer* buffer : free_) {
+                delete buffer;
+            }
+        }
+    }
+
+    bool LineReader::nextLines(std::string& text, const std::size_t bytes)
+    {
+        const std::size_t start = text.size();
+        while(text.size() - start < bytes)
+        {
+            if(current_ && cursor_ != end_)
+            {
+                // As much as is wanted, finishing the line it ends in:
+                const char* const wanted = cursor_ + std::min<std::size_t>(end_ - cursor_, bytes - (text.size() - start));
+                const char* last = static_cast<const char*>(::memrchr(cursor_, '\n', wanted - cursor_));
+                if(wanted != end_ && (!last || last + 1 != wanted)) {
+                    const char* const newline = static_cast<const char*>(std::memchr(wanted, '\n', end_ - wanted));
+                    last = newline ? newline : last;
+                }
+                if(last) {
+                    text.append(cursor_, last + 1);
+                    cursor_ = last + 1;
+                    continue;
+                }
+                if(endOfInput_) {
+                    text.append(cursor_, end_);
+                    text.push_back('\n');
+                    cursor_ = end_;
+                    continue;
+                }
+            }
+            if(endOfInput_) {
+                break;
+            }
+            refill();
+        }
+        // Lines taken here mustn't be handed out again by next():
+        if(current_) {
+            scanner_.reset(cursor_, end_);
+        }
+        return text.size() != start;
+    }
+
+    void LineReader::refill()
+    {
+        // Keep the start of a line that ran off the end of the buffer:
+        if(current_) {
+            carry_.assign(cursor_, end_);
+            release(current_);
+            current_ = nullptr;
+        }
+
+        if(free_.empty() && recycled_) {
+            recycled_->tryPopAll(free_);
+        }
+        // Out of budget, or buffers to be, so wait for another thread to give one back:
+        if(free_.empty() && recycled_ && ((budget_ && budget_->exhausted()) || (maxBuffers_ != 0 && buffersCreated_ >= maxBuffers_))) {
+            recycled_->popAll(free_);
+        }
+        ReadBuffer* buffer = nullptr;
+        if(free_.empty()) {
+            buffer = new ReadBuffer(blockBytes_);
+            ++buffersCreated_;
+        } else {
+            buffer = free_.back();
+            free_.pop_back();
+        }
+        // Make sure there is room to read after a long carried over line:
+        if(buffer->capacity < carry_.size() * 2) {
+            buffer->data.reset(new char[carry_.size() * 2]);
+            buffer->capacity = carry_.size() * 2;
+        }
+        if(budget_) {
+            budget_->charge(buffer->charged, buffer->capacity);
+        }
+
+        std::memcpy(buffer->data.get(), carry_.data(), carry_.size());
+        const std::size_t numRead = read(buffer->data.get() + carry_.size(), buffer->capacity - carry_.size());
+        endOfInput_ = partialReads_ ? numRead == 0 : !input_;
+
+        buffer->users.store(1, std::memory_order_relaxed);
+        current_ = buffer;
+        cursor_ = buffer->data.get();
+        end_ = cursor_ + carry_.size() + numRead;
+        // What was carried over has no newline in it:
+        scanner_.reset(cursor_ + carry_.size(), end_);
+        carry_.clear();
+    }
+
+    /**
+     * Read into a buffer, filling it unless the input ends first or, for partial
+     * reads, taking whatever has arrived once there is at least a whole line.
+     */
+    std::size_t LineReader::read(char* const destination, const std::size_t size)
+    {
+        if(!partialReads_) {
+            input_.read(destination, size);
+            return input_.gcount();
+        }
+        using traits = std::istream::traits_type;
+        std::streambuf* const buffer = input_.rdbuf();
+        std::size_t got = 0;
+        while(got < size)
+        {
+            const std::streamsize available = buffer->in_avail();
+            if(available > 0) {
+                got += buffer->sgetn(destination + got, std::min<std::streamsize>(available, size - got));
+                continue;
+            }
+            if(got > 0 && destination[got - 1] == '\n') {
+                break;
+            }
+            // Nothing the stream can vouch for, so wait for the rest of the line a character at a time like std::getline():
+            const traits::int_type c = buffer->sbumpc();
+            if(traits::eq_int_type(c, traits::eof())) {
+                input_.setstate(std::ios_base::eofbit);
+                break;
+            }
+            destination[got++] = traits::to_char_type(c);
+        }
+        return got;
+    }
+}
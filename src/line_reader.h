@@ -0,0 +1,249 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// Splitting an input stream into lines in large blocks.
+//
+#ifndef PARGREP_LINE_READER_H
+#define PARGREP_LINE_READER_H
+
+#include "concurrent_queue.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pargrep {
+
+    /**
+     * The memory taken by lines in a pipeline, against a limit.
+     * The reader charges buffers to it as they grow and, once it is exhausted,
+     * waits for a recycled buffer rather than allocating a new one.
+     * Buffers are only freed when the pipeline ends, so nothing is ever released.
+     */
+    class MemoryBudget
+    {
+    public:
+        /// @param limit In bytes. Zero for no limit.
+        explicit MemoryBudget(const std::size_t limit) : limit_(limit) {}
+
+        /**
+         * Bring what is charged for a buffer up to date with its size.
+         * @param charged What was charged for the buffer so far, updated to bytes.
+         */
+        void charge(std::size_t& charged, const std::size_t bytes)
+        {
+            if(bytes > charged) {
+                inUse_ += bytes - charged;
+                peak_ = std::max(peak_, inUse_);
+                charged = bytes;
+            }
+        }
+
+        bool exhausted() const { return limit_ != 0 && inUse_ >= limit_; }
+        std::size_t peak() const { return peak_; }
+
+    private:
+        const std::size_t limit_;
+        std::size_t inUse_ = 0;
+        std::size_t peak_ = 0;
+    };
+
+    /**
+     * Finds the newlines in a buffer one after another.
+     * Each SIMD compare covers 64 bytes (two AVX2 or four SSE2 compares, chosen at
+     * runtime) and leaves a bitmask of the newlines in them, which are then handed
+     * out one at a time, so a run of short lines costs a fraction of a compare
+     * each rather than a memchr() call each.
+     */
+    class NewlineScanner
+    {
+    public:
+        /// Start scanning a new range.
+        void reset(const char* const begin, const char* const end)
+        {
+            base_ = begin;
+            next_ = begin;
+            end_ = end;
+            mask_ = 0;
+        }
+
+        /// @return The next newline in the range, or null if there are no more.
+        const char* next()
+        {
+            while(mask_ == 0)
+            {
+                if(next_ == end_) {
+                    return nullptr;
+                }
+                base_ = next_;
+                const std::size_t length = std::min<std::size_t>(64, end_ - next_);
+                mask_ = length == 64 ? newlineMask_(base_) : tailMask(base_, length);
+                next_ += length;
+            }
+            const char* const newline = base_ + __builtin_ctzll(mask_);
+            mask_ &= mask_ - 1;
+            return newline;
+        }
+
+        /// The number of newlines in a range, from the same compares with a popcount for every 64 bytes.
+        static std::size_t count(const char* begin, const char* end);
+
+        /// The name of the implementation chosen for this CPU, e.g. "avx2".
+        static const char* implementation();
+
+    private:
+        using MaskFunction = std::uint64_t (*)(const char* block);
+        static std::uint64_t tailMask(const char* block, std::size_t length);
+        static const MaskFunction newlineMask_;
+
+        const char* base_ = nullptr;
+        const char* next_ = nullptr;
+        const char* end_ = nullptr;
+        // Bit i set for a newline not yet handed out at base_ + i:
+        std::uint64_t mask_ = 0;
+    };
+
+    /**
+     * A large chunk of input shared by all the lines whose text lies in it.
+     * Buffers go back to the reader to be refilled once the last of their lines is
+     * done with, so reading allocates nothing once enough are in use.
+     */
+    struct ReadBuffer {
+        explicit ReadBuffer(const std::size_t capacity) : data(new char[capacity]), capacity(capacity) {}
+
+        std::unique_ptr<char[]> data;
+        std::size_t capacity;
+        // Lines still using the buffer, plus one while the reader is still slicing lines out of it:
+        std::atomic<unsigned> users {0};
+        // The memory charged to the MemoryBudget for this buffer:
+        std::size_t charged = 0;
+    };
+
+    using BufferQueue = SpscQueue<ReadBuffer>;
+
+    /**
+     * Cuts an input stream into lines in place, reading it in large blocks straight
+     * into recycled ReadBuffers rather than a character at a time as std::getline()
+     * does. A line that runs off the end of a buffer is carried over to the start
+     * of the next one, which grows if the line won't fit.
+     * Every version of grep reads its input through one of these. Lines are either
+     * used before asking for the next, or held on to by other threads and given
+     * back with release().
+     */
+    class LineReader
+    {
+    public:
+        static constexpr std::size_t DEFAULT_BLOCK_BYTES = 1024 * 1024;
+
+        /**
+         * Read lines for use on this thread only.
+         * @param partialReads Hand out lines as soon as they arrive rather than waiting
+         * for a whole block, for interactive use at the cost of more, smaller reads.
+         */
+        explicit LineReader(std::istream& input, bool partialReads = false, std::size_t blockBytes = DEFAULT_BLOCK_BYTES);
+
+        /**
+         * Read lines which other threads hold on to.
+         * @param recycled Where other threads give back buffers once their lines are done with.
+         * @param maxBuffers Past this many buffers, or once the budget is spent, wait for one
+         * to be given back rather than allocating another. Zero for no limit.
+         */
+        LineReader(std::istream& input, BufferQueue& recycled, MemoryBudget& budget, std::size_t maxBuffers, std::size_t blockBytes = DEFAULT_BLOCK_BYTES);
+
+        /// Only once every line has been released.
+        ~LineReader();
+        LineReader(const LineReader&) = delete;
+        LineReader& operator=(const LineReader&) = delete;
+
+        /**
+         * Get the next line, without its newline, which is only valid until the next call.
+         * @return False at the end of the input.
+         */
+        bool next(std::string_view& text)
+        {
+            while(true)
+            {
+                if(current_)
+                {
+                    const char* const newline = scanner_.next();
+                    if(newline || (endOfInput_ && cursor_ != end_))
+                    {
+                        // A last line without a newline counts too, as with std::getline:
+                        const char* const lineEnd = newline ? newline : end_;
+                        text = std::string_view(cursor_, lineEnd - cursor_);
+                        cursor_ = newline ? newline + 1 : end_;
+                        return true;
+                    }
+                }
+                if(endOfInput_) {
+                    return false;
+                }
+                refill();
+            }
+        }
+
+        /**
+         * Append whole lines, newlines and all, to some text until at least a number of
+         * bytes have been appended or the input ends. The lines aren't looked at on
+         * the way: the text goes in one copy per buffer read.
+         * A last line without a newline gets one, so the text always ends with one.
+         * @return False at the end of the input, with nothing appended.
+         */
+        bool nextLines(std::string& text, std::size_t bytes);
+
+        /**
+         * Get the next line, without its newline, to keep beyond the next call.
+         * @param buffer Set to the buffer holding the text, which now counts the line as
+         * one of its users. Pass it to release() once done with the line.
+         * @return False at the end of the input.
+         */
+        bool next(std::string_view& text, ReadBuffer*& buffer)
+        {
+            if(!next(text)) {
+                return false;
+            }
+            current_->users.fetch_add(1, std::memory_order_relaxed);
+            buffer = current_;
+            return true;
+        }
+
+        /// Stop a line using its buffer, recycling the buffer if it was the last user.
+        void release(ReadBuffer* const buffer)
+        {
+            if(buffer->users.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                free_.push_back(buffer);
+            }
+        }
+
+        std::size_t buffersCreated() const { return buffersCreated_; }
+
+    private:
+        void refill();
+        std::size_t read(char* destination, std::size_t size);
+
+        std::istream& input_;
+        BufferQueue* const recycled_;
+        MemoryBudget* const budget_;
+        const std::size_t maxBuffers_;
+        const std::size_t blockBytes_;
+        const bool partialReads_;
+        // Buffers ready to be refilled:
+        std::vector<ReadBuffer*> free_;
+        std::size_t buffersCreated_ = 0;
+        // The buffer lines are being cut from and the unsliced part of it:
+        ReadBuffer* current_ = nullptr;
+        const char* cursor_ = nullptr;
+        const char* end_ = nullptr;
+        NewlineScanner scanner_;
+        std::string carry_;
+        bool endOfInput_ = false;
+    };
+}
+
+#endif //PARGREP_LINE_READER_H
@@ -0,0 +1,238 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "literal_prefilter.h"
+#include <cstdlib>
+#include <cctype>
+
+namespace pargrep {
+    using std::string;
+    using std::vector;
+
+    namespace {
+        /**
+         * Skip over a bracketed character class such as "[^a-z[:digit:]\]]".
+         * @param i The index of the opening '['.
+         * @return The index just past the closing ']' or npos if there isn't one.
+         */
+        size_t skipClass(const string& p, size_t i)
+        {
+            ++i;
+            if(i < p.size() && p[i] == '^') {
+                ++i;
+            }
+            while(i < p.size())
+            {
+                const char c = p[i];
+                if(c == '\\') {
+                    i += 2;
+                } else if(c == '[' && i + 1 < p.size() && (p[i + 1] == ':' || p[i + 1] == '.' || p[i + 1] == '=')) {
+                    const char terminator[3] = {p[i + 1], ']', 0};
+                    const size_t close = p.find(terminator, i + 2);
+                    if(close == string::npos) {
+                        return string::npos;
+                    }
+                    i = close + 2;
+                } else if(c == ']') {
+                    return i + 1;
+                } else {
+                    ++i;
+                }
+            }
+            return string::npos;
+        }
+
+        /**
+         * Skip over a parenthesised group, including any nested groups and classes.
+         * @param i The index of the opening '('.
+         * @return The index just past the matching ')' or npos if there isn't one.
+         */
+        size_t skipGroup(const string& p, size_t i)
+        {
+            unsigned depth = 0;
+            while(i < p.size())
+            {
+                const char c = p[i];
+                if(c == '\\') {
+                    i += 2;
+                } else if(c == '[') {
+                    i = skipClass(p, i);
+                    if(i == string::npos) {
+                        return i;
+                    }
+                } else {
+                    if(c == '(') {
+                        ++depth;
+                    } else if(c == ')' && --depth == 0) {
+                        return i + 1;
+                    }
+                    ++i;
+                }
+            }
+            return string::npos;
+        }
+
+        /**
+         * Parse a quantifier starting at i, if there is one.
+         * @param[out] minCount The minimum number of repetitions it allows.
+         * @return The index just past the quantifier, i if there isn't one, or npos if it is malformed.
+         */
+        size_t parseQuantifier(const string& p, size_t i, unsigned& minCount)
+        {
+            if(i >= p.size()) {
+                return i;
+            }
+            size_t next = i;
+            switch(p[i])
+            {
+                case '*': minCount = 0; next = i + 1; break;
+                case '?': minCount = 0; next = i + 1; break;
+                case '+': minCount = 1; next = i + 1; break;
+                case '{': {
+                    const size_t close = p.find('}', i);
+                    if(close == string::npos || close == i + 1 || !std::isdigit((unsigned char) p[i + 1])) {
+                        return string::npos;
+                    }
+                    minCount = unsigned(std::strtoul(p.c_str() + i + 1, nullptr, 10));
+                    next = close + 1;
+                    break;
+                }
+                default:
+                    return i;
+            }
+            // Lazy variants match the same set of strings:
+            if(next < p.size() && p[next] == '?') {
+                ++next;
+            }
+            return next;
+        }
+    }
+
+    // See literal_prefilter.h
+    vector<string> requiredLiterals(const string& p)
+    {
+        vector<string> literals;
+        string run;
+        auto endRun = [&]() {
+            // A literal spanning a newline can never be found within a single line:
+            if(!run.empty() && run.find('\n') == string::npos) {
+                literals.push_back(run);
+            }
+            run.clear();
+        };
+
+        size_t i = 0;
+        while(i < p.size())
+        {
+            const char c = p[i];
+            // Whether the atom just consumed was a single literal character at the end of run:
+            bool literalAtom = false;
+            switch(c)
+            {
+                case '|':
+                    // An alternative branch means nothing at this level is required:
+                    return vector<string>();
+                case ')':
+                    return vector<string>();
+                case '(':
+                    endRun();
+                    i = skipGroup(p, i);
+                    if(i == string::npos) {
+                        return vector<string>();
+                    }
+                    break;
+                case '[':
+                    endRun();
+                    i = skipClass(p, i);
+                    if(i == string::npos) {
+                        return vector<string>();
+                    }
+                    break;
+                case '.': case '^': case '$':
+                    endRun();
+                    ++i;
+                    break;
+                case '*': case '+': case '?': case '{':
+                    // A quantifier with nothing to apply to:
+                    return vector<string>();
+                case '\\': {
+                    if(i + 1 >= p.size()) {
+                        return vector<string>();
+                    }
+                    const char e = p[i + 1];
+                    i += 2;
+                    switch(e)
+                    {
+                        case 'n': run.push_back('\n'); literalAtom = true; break;
+                        case 't': run.push_back('\t'); literalAtom = true; break;
+                        case 'r': run.push_back('\r'); literalAtom = true; break;
+                        case 'f': run.push_back('\f'); literalAtom = true; break;
+                        case 'v': run.push_back('\v'); literalAtom = true; break;
+                        case 'd': case 'D': case 'w': case 'W': case 's': case 'S': case 'b': case 'B':
+                            endRun();
+                            break;
+                        default:
+                            if(std::isalnum((unsigned char) e)) {
+                                // Backreferences, \x, \u, \c etc.: give up rather than misread them.
+                                return vector<string>();
+                            }
+                            run.push_back(e);
+                            literalAtom = true;
+                    }
+                    break;
+                }
+                default:
+                    run.push_back(c);
+                    literalAtom = true;
+                    ++i;
+            }
+
+            unsigned minCount = 1;
+            const size_t afterQuantifier = parseQuantifier(p, i, minCount);
+            if(afterQuantifier == string::npos) {
+                return vector<string>();
+            }
+            if(afterQuantifier != i) {
+                // The atom may be absent so it can't contribute:
+                if(minCount == 0 && literalAtom) {
+                    run.pop_back();
+                }
+                // Repetition means what follows is not adjacent to the run:
+                endRun();
+                i = afterQuantifier;
+            }
+        }
+        endRun();
+        return literals;
+    }
+
+    namespace {
+        /// The most selective of the literals a pattern requires, taken to be the longest.
+        string bestLiteral(const string& pattern)
+        {
+            string best;
+            for(const string& literal : requiredLiterals(pattern))
+            {
+                if(literal.size() > best.size()) {
+                    best = literal;
+                }
+            }
+            return best;
+        }
+    }
+
+    LiteralPrefilter::LiteralPrefilter(const string& pattern) :
+        searcher_(bestLiteral(pattern))
+    {}
+
+    LiteralPrefilter::LiteralPrefilter(const string& literal, LiteralTag) :
+        searcher_(literal)
+    {}
+
+    LiteralPrefilter LiteralPrefilter::forLiteral(const string& literal)
+    {
+        return LiteralPrefilter(literal, LiteralTag());
+    }
+}
@@ -0,0 +1,67 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// Cheap rejection of lines which can't possibly match a regex.
+//
+#ifndef PARGREP_LITERAL_PREFILTER_H
+#define PARGREP_LITERAL_PREFILTER_H
+
+#include "substring_search.h"
+#include <string>
+#include <vector>
+
+namespace pargrep {
+
+    /**
+     * Find the runs of literal characters which must appear in any text matched
+     * by an ECMAScript regex, from anywhere in the pattern, not just a prefix.
+     * E.g. "^\[ERROR\] *: *[[:digit:]]+" yields "[ERROR]" and ":".
+     * The analysis is conservative: any construct it doesn't understand ends the
+     * current run, and a top-level alternation (or anything unparsable) yields no
+     * literals at all.
+     */
+    std::vector<std::string> requiredLiterals(const std::string& pattern);
+
+    /**
+     * Scans text for the most selective literal required by a pattern.
+     * Lines without it can be rejected without running the regex.
+     */
+    class LiteralPrefilter
+    {
+    public:
+        explicit LiteralPrefilter(const std::string& pattern);
+
+        /// A prefilter for a pattern which is entirely the literal given, as in fixed string mode.
+        static LiteralPrefilter forLiteral(const std::string& literal);
+
+        /// True if the pattern had a literal to filter on.
+        bool enabled() const { return !searcher_.needle().empty(); }
+        const std::string& literal() const { return searcher_.needle(); }
+
+        /**
+         * @return The start of the first occurrence of the literal in [begin, end),
+         * or end if there is none.
+         */
+        const char* find(const char* begin, const char* end) const
+        {
+            return searcher_.find(begin, end);
+        }
+
+        /**
+         * @return False if the line definitely can't match the pattern.
+         */
+        bool mayMatch(const char* begin, const char* end) const
+        {
+            return !enabled() || find(begin, end) != end;
+        }
+
+    private:
+        struct LiteralTag {};
+        LiteralPrefilter(const std::string& literal, LiteralTag);
+
+        SubstringSearcher searcher_;
+    };
+}
+
+#endif //PARGREP_LITERAL_PREFILTER_H
@@ -2,34 +2,51 @@
 // Created by Andrew Cox on 04/10/2017.
 //
 #include "pargrep.h"
-#include <fstream>
+#include "command_line.h"
+#include "matcher.h"
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 using namespace std;
 
-int main()
+int main(int argc, char** argv)
 {
     using namespace pargrep;
 
-    std::string filename = "/tmp/pargrep.in";
-    std::string pattern = "[qz]";
-
-    ifstream in(filename);
-
-    //grep_stream(in, pattern, std::cout, true);
-    in.close();
-    cout.flush();
-
-
-    in.open(filename);
-    //pargrep_stream_par1(in, pattern, std::cout, true);
-    in.close();
-    cout.flush();
-
-    in.open(filename);
-    pargrep_stream_par2(in, pattern, std::cout, true);
-    in.close();
+    Command command;
+    try
+    {
+        command = parseCommandLine(std::vector<std::string>(argv + 1, argv + argc));
+    }
+    catch(const std::invalid_argument& e)
+    {
+        cerr << "pargrep: " << e.what() << endl;
+        cerr << "usage: prep " << COMMAND_LINE_USAGE << endl;
+        return 2;
+    }
+    std::uint64_t matches = 0;
+    try
+    {
+        const std::vector<std::string> patterns = patternList(command.pattern, command.options);
+        matches = runCommand(command, patterns, makeMatcher(patterns, command.options), std::cout);
+    }
+    catch(const UnsearchedFiles& e)
+    {
+        // Each was reported as it failed. Like grep, that's an error unless -q has already found a match:
+        cout.flush();
+        return exitStatus(command.options, e.matches(), true);
+    }
+    catch(const std::exception& e)
+    {
+        // Such as a pattern file that can't be read or a pattern that won't compile, which are errors, like in grep:
+        cout.flush();
+        cerr << "pargrep: " << e.what() << endl;
+        return 2;
+    }
     cout.flush();
 
     ///@ToDo The moment the output file is closed, kill the process. There is no need for clean shutdown.
-    return 0;
-}
\ No newline at end of file
+    return exitStatus(command.options, matches, false);
+}
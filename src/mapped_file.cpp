@@ -0,0 +1,50 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "mapped_file.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace pargrep {
+
+    MappedFile::MappedFile(const std::string& filename)
+    {
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd < 0) {
+            return;
+        }
+        opened_ = true;
+
+        struct stat info;
+        if(::fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+        {
+            size_ = std::size_t(info.st_size);
+            if(size_ == 0) {
+                // mmap() refuses zero length mappings but an empty file is trivially searchable:
+                valid_ = true;
+            } else {
+                void* const p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(p != MAP_FAILED) {
+                    data_ = static_cast<const char*>(p);
+                    valid_ = true;
+                    // Workers each walk their own range front to back:
+                    ::madvise(p, size_, MADV_SEQUENTIAL);
+                } else {
+                    size_ = 0;
+                }
+            }
+        }
+        ::close(fd);
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if(data_) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+    }
+}
@@ -0,0 +1,46 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// A read-only memory mapping of a whole file.
+//
+#ifndef PARGREP_MAPPED_FILE_H
+#define PARGREP_MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+namespace pargrep {
+
+    /**
+     * RAII owner of a read-only, private mapping of a regular file.
+     * The file descriptor is closed as soon as the mapping is established.
+     * Mapping fails for anything that is not a regular file (pipes, ttys, etc.),
+     * in which case valid() is false and callers should fall back to streaming.
+     */
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::string& filename);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        /// True if the file was opened and mapped (or is a regular file of length zero).
+        bool valid() const { return valid_; }
+        /// True if the file could be opened at all.
+        bool opened() const { return opened_; }
+        const char* data() const { return data_; }
+        std::size_t size() const { return size_; }
+        const char* begin() const { return data_; }
+        const char* end() const { return data_ + size_; }
+
+    private:
+        const char* data_ = nullptr;
+        std::size_t size_ = 0;
+        bool valid_ = false;
+        bool opened_ = false;
+    };
+}
+
+#endif //PARGREP_MAPPED_FILE_H
@@ -0,0 +1,212 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "match_writer.h"
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace pargrep {
+
+    MatchWriter::MatchWriter(std::ostream& output, const bool lineBuffered, const std::size_t capacity) :
+        lineBuffered_(lineBuffered),
+        buffer_(new char[capacity]),
+        capacity_(capacity)
+    {
+        if(&output == &std::cout) {
+            // Anything already in cout must come out first:
+            output.flush();
+            fd_ = STDOUT_FILENO;
+        } else {
+            stream_ = &output;
+        }
+    }
+
+    MatchWriter::MatchWriter(const int fd, const bool lineBuffered, const std::size_t capacity) :
+        fd_(fd),
+        lineBuffered_(lineBuffered),
+        buffer_(new char[capacity]),
+        capacity_(capacity)
+    {}
+
+    MatchWriter::~MatchWriter()
+    {
+        flush();
+    }
+
+    void MatchWriter::line(const std::string_view text)
+    {
+        append(prefix_);
+        endLine(text);
+    }
+
+    void MatchWriter::line(const std::uint64_t number, const std::string_view separator, const std::string_view text)
+    {
+        append(prefix_);
+        constexpr std::size_t MAX_DIGITS = 20;
+        if(capacity_ - size_ < MAX_DIGITS + separator.size()) {
+            emit();
+        }
+        char* const begin = buffer_.get() + size_;
+        size_ += std::to_chars(begin, begin + MAX_DIGITS, number).ptr - begin;
+        append(separator);
+        endLine(text);
+    }
+
+    void MatchWriter::write(const std::string_view lines)
+    {
+        if(capacity_ - size_ >= lines.size()) {
+            std::memcpy(buffer_.get() + size_, lines.data(), lines.size());
+            size_ += lines.size();
+        } else {
+            emit(lines);
+        }
+        if(lineBuffered_) {
+            flush();
+        }
+    }
+
+    void MatchWriter::flush()
+    {
+        if(size_ > 0) {
+            emit();
+        }
+        if(stream_) {
+            stream_->flush();
+        }
+    }
+
+    void MatchWriter::append(const std::string_view text)
+    {
+        if(capacity_ - size_ < text.size()) {
+            emit();
+        }
+        std::memcpy(buffer_.get() + size_, text.data(), text.size());
+        size_ += text.size();
+    }
+
+    void MatchWriter::endLine(const std::string_view text)
+    {
+        if(capacity_ - size_ >= text.size() + 1) {
+            std::memcpy(buffer_.get() + size_, text.data(), text.size());
+            size_ += text.size();
+            buffer_[size_++] = '\n';
+        } else {
+            // Too long to buffer so write it out directly behind what is buffered:
+            emit(text);
+            buffer_[size_++] = '\n';
+        }
+        if(lineBuffered_) {
+            flush();
+        }
+    }
+
+    /**
+     * Write out the buffer followed by some extra text, emptying the buffer.
+     */
+    void MatchWriter::emit(const std::string_view extra)
+    {
+        if(stream_) {
+            stream_->rdbuf()->sputn(buffer_.get(), size_);
+            stream_->rdbuf()->sputn(extra.data(), extra.size());
+            size_ = 0;
+            return;
+        }
+        iovec pieces[2] = {
+            {buffer_.get(), size_},
+            {const_cast<char*>(extra.data()), extra.size()}
+        };
+        iovec* piece = pieces;
+        int numPieces = extra.empty() ? 1 : 2;
+        while(numPieces > 0)
+        {
+            const ssize_t written = ::writev(fd_, piece, numPieces);
+            if(written < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                // Nowhere to report it, like a failed stream, so give up on this output:
+                break;
+            }
+            // Skip what was written, which may end part way through a piece:
+            std::size_t remaining = std::size_t(written);
+            while(numPieces > 0 && remaining >= piece->iov_len) {
+                remaining -= piece->iov_len;
+                ++piece;
+                --numPieces;
+            }
+            if(numPieces > 0) {
+                piece->iov_base = static_cast<char*>(piece->iov_base) + remaining;
+                piece->iov_len -= remaining;
+            }
+        }
+        size_ = 0;
+    }
+
+    void formatLine(std::string& out, const std::string_view text)
+    {
+        out.append(text);
+        out.push_back('\n');
+    }
+
+    void formatLine(std::string& out, const std::uint64_t number, const std::string_view separator, const std::string_view text)
+    {
+        char digits[20];
+        out.append(digits, std::to_chars(digits, digits + sizeof(digits), number).ptr);
+        out.append(separator);
+        out.append(text);
+        out.push_back('\n');
+    }
+
+    int positionalOutput(std::ostream& output, std::uint64_t& offset)
+    {
+        if(&output != &std::cout) {
+            return -1;
+        }
+        struct stat status;
+        if(::fstat(STDOUT_FILENO, &status) != 0 || !S_ISREG(status.st_mode)) {
+            return -1;
+        }
+        const int flags = ::fcntl(STDOUT_FILENO, F_GETFL);
+        if(flags < 0 || (flags & O_APPEND)) {
+            return -1;
+        }
+        // Anything already in cout must come out first:
+        output.flush();
+        const off_t position = ::lseek(STDOUT_FILENO, 0, SEEK_CUR);
+        if(position < 0) {
+            return -1;
+        }
+        offset = std::uint64_t(position);
+        return STDOUT_FILENO;
+    }
+
+    void writeAt(const int fd, std::string_view text, std::uint64_t offset)
+    {
+        while(!text.empty())
+        {
+            const ssize_t written = ::pwrite(fd, text.data(), text.size(), off_t(offset));
+            if(written < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                // As in MatchWriter::emit(), there is nowhere to report it:
+                return;
+            }
+            text.remove_prefix(std::size_t(written));
+            offset += std::uint64_t(written);
+        }
+    }
+
+    void endPositionalOutput(const int fd, const std::uint64_t end)
+    {
+        ::lseek(fd, off_t(end), SEEK_SET);
+    }
+}
@@ -0,0 +1,93 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// Batched output of matching lines.
+//
+#ifndef PARGREP_MATCH_WRITER_H
+#define PARGREP_MATCH_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace pargrep {
+
+    /**
+     * Formats matching lines, with or without line numbers, into a large buffer
+     * and hands the buffer to the output in one go when it fills, rather than
+     * flushing the stream for every line as std::endl does.
+     * Output to std::cout skips the stream and goes straight to file descriptor 1
+     * with write() (or writev(), to append a long line without copying it).
+     *
+     * Whatever is buffered is written by flush() or the destructor. Only one
+     * thread may use a writer at a time.
+     */
+    class MatchWriter
+    {
+    public:
+        static constexpr std::size_t DEFAULT_CAPACITY = 64 * 1024;
+
+        /**
+         * @param lineBuffered Write out every line as soon as it is complete, for
+         * interactive use, like grep --line-buffered. Otherwise write whole buffers.
+         */
+        explicit MatchWriter(std::ostream& output, bool lineBuffered = false, std::size_t capacity = DEFAULT_CAPACITY);
+        /// Write to a file descriptor, which the writer doesn't close.
+        explicit MatchWriter(int fd, bool lineBuffered = false, std::size_t capacity = DEFAULT_CAPACITY);
+        ~MatchWriter();
+        MatchWriter(const MatchWriter&) = delete;
+        MatchWriter& operator=(const MatchWriter&) = delete;
+
+        /// Output a line, adding its newline.
+        void line(std::string_view text);
+        /// Output a line prefixed with its number and a separator such as ": ".
+        void line(std::uint64_t number, std::string_view separator, std::string_view text);
+        /// Output text already formatted into whole lines by formatLine().
+        void write(std::string_view lines);
+
+        /// Write out everything buffered.
+        void flush();
+
+        /// Start every line output by line() with some text, such as a filename and colon.
+        void prefixLines(std::string prefix) { prefix_ = std::move(prefix); }
+
+    private:
+        void append(std::string_view text);
+        void endLine(std::string_view text);
+        void emit(std::string_view extra = std::string_view());
+
+        std::ostream* stream_ = nullptr;
+        int fd_ = -1;
+        const bool lineBuffered_;
+        std::unique_ptr<char[]> buffer_;
+        const std::size_t capacity_;
+        std::size_t size_ = 0;
+        std::string prefix_;
+    };
+
+    /// Append a line and its newline to a string, as MatchWriter::line() would output it.
+    void formatLine(std::string& out, std::string_view text);
+    /// Append a numbered line and its newline to a string, as MatchWriter::line() would output it.
+    void formatLine(std::string& out, std::uint64_t number, std::string_view separator, std::string_view text);
+
+    /**
+     * Find out whether many threads can write to an output at offsets of their own
+     * choosing. Only true of std::cout redirected to a regular file which wasn't
+     * opened for appending.
+     * @param offset Set to the current position of the file, where output should start.
+     * @return The file descriptor to pwrite() to, or -1 if the output must be written in order.
+     */
+    int positionalOutput(std::ostream& output, std::uint64_t& offset);
+
+    /// pwrite() all of some text, however many calls it takes.
+    void writeAt(int fd, std::string_view text, std::uint64_t offset);
+
+    /// Move the file position past what was written with writeAt(), so later output follows it.
+    void endPositionalOutput(int fd, std::uint64_t end);
+}
+
+#endif //PARGREP_MATCH_WRITER_H
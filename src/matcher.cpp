@@ -0,0 +1,107 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "matcher.h"
+#include "regex_functions.h"
+#include <algorithm>
+
+namespace pargrep {
+
+    namespace {
+        bool hasRegexSyntax(const std::string& pattern)
+        {
+            return pattern.find_first_of("\\^$.|?*+()[]{}") != std::string::npos;
+        }
+
+        /// A single regex matching any of the patterns.
+        std::string alternation(const std::vector<std::string>& patterns)
+        {
+            if(patterns.size() == 1) {
+                return patterns[0];
+            }
+            std::string combined;
+            for(const std::string& pattern : patterns) {
+                combined += combined.empty() ? "(?:" : "|(?:";
+                combined += pattern;
+                combined += ')';
+            }
+            return combined;
+        }
+    }
+
+    Matcher::Matcher(const std::string& pattern, const bool fixedString)
+    {
+        compile(pattern, fixedString);
+    }
+
+    Matcher::Matcher(const std::vector<std::string>& patterns, const bool fixedStrings)
+    {
+        if(patterns.size() == 1) {
+            compile(patterns[0], fixedStrings);
+        } else if(fixedStrings || std::none_of(patterns.begin(), patterns.end(), hasRegexSyntax)) {
+            engine_ = Engine::MultiString;
+            multi_ = std::make_shared<const AhoCorasick>(patterns);
+        } else {
+            compile(alternation(patterns), false);
+        }
+    }
+
+    void Matcher::compile(const std::string& pattern, const bool fixedString)
+    {
+        if(fixedString) {
+            engine_ = Engine::FixedString;
+            prefilter_ = LiteralPrefilter::forLiteral(pattern);
+        } else {
+            prefilter_ = LiteralPrefilter(pattern);
+            compileRegex(pattern);
+        }
+    }
+
+    void Matcher::compileRegex(const std::string& pattern)
+    {
+        bitParallel_ = BitParallelMatcher::compile(pattern);
+        if(bitParallel_) {
+            engine_ = Engine::BitParallel;
+            return;
+        }
+        auto program = RegexProgram::compile(pattern);
+        if(program) {
+            engine_ = Engine::LazyDfa;
+            dfa_.emplace(std::move(program));
+        } else {
+            engine_ = Engine::Regex;
+            regex_ = std::regex(pattern);
+        }
+    }
+
+    const char* Matcher::engineName() const
+    {
+        switch(engine_)
+        {
+            case Engine::Regex: return "std::regex";
+            case Engine::BitParallel: return "bit-parallel NFA";
+            case Engine::LazyDfa: return "lazy DFA";
+            case Engine::FixedString: return "fixed string";
+            case Engine::MultiString: return "Aho-Corasick";
+        }
+        return "unknown";
+    }
+
+    bool Matcher::search(const char* const begin, const char* const end)
+    {
+        if(!prefilter_.mayMatch(begin, end)) {
+            return false;
+        }
+        switch(engine_)
+        {
+            case Engine::FixedString: return true;
+            case Engine::MultiString: return multi_->search(begin, end);
+            case Engine::BitParallel: return pargrep::search(begin, end, *bitParallel_);
+            case Engine::LazyDfa: return pargrep::search(begin, end, *dfa_);
+            case Engine::Regex: break;
+        }
+        return pargrep::search(begin, end, regex_);
+    }
+}
@@ -0,0 +1,105 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// A compiled search pattern.
+//
+#ifndef PARGREP_MATCHER_H
+#define PARGREP_MATCHER_H
+
+#include "literal_prefilter.h"
+#include "aho_corasick.h"
+#include "lazy_dfa.h"
+#include "bit_parallel.h"
+#include <memory>
+#include <optional>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace pargrep {
+
+    /**
+     * Decides whether lines match a pattern.
+     * Wraps the regex engine with a prefilter on the literals it requires, so most
+     * non-matching lines are rejected by a fast scan without ever reaching it.
+     * The engine is chosen automatically: short regexes run on a bit-parallel NFA,
+     * longer ones on a lazily built DFA, unless they use features only std::regex
+     * supports (backreferences, lookahead, ...).
+     * In fixed string mode no regex is built at all: the prefilter's vectorised
+     * substring search is the whole of the matching. Sets of fixed strings are
+     * matched together by an Aho-Corasick automaton.
+     *
+     * Copies share the compiled pattern but have their own scratch state (the DFA
+     * cache), so copying is cheap and each thread should search with its own copy.
+     */
+    class Matcher
+    {
+    public:
+        enum class Engine {
+            Regex,
+            BitParallel,
+            LazyDfa,
+            FixedString,
+            MultiString
+        };
+
+        /**
+         * @param pattern An ECMAScript regex, or a plain string if fixedString is set.
+         * @param fixedString Match the pattern literally, like fgrep / grep -F.
+         */
+        explicit Matcher(const std::string& pattern, bool fixedString = false);
+
+        /**
+         * Match lines containing any of a set of patterns, as with grep -f.
+         * Sets of plain strings are matched in a single pass with Aho-Corasick. If
+         * fixedStrings isn't set and some pattern uses regex syntax, the set falls
+         * back to a regex alternation.
+         */
+        Matcher(const std::vector<std::string>& patterns, bool fixedStrings);
+
+        Engine engine() const { return engine_; }
+        /// A short name for the engine doing the matching, for diagnostics.
+        const char* engineName() const;
+
+        /**
+         * @param begin The start of a line.
+         * @param end The end of the line, not including its newline.
+         */
+        bool search(const char* begin, const char* end);
+        bool search(const std::string& line)
+        {
+            return search(line.data(), line.data() + line.size());
+        }
+
+        /**
+         * Skip quickly through a buffer holding many lines to a position that might be
+         * part of a match. No match lies wholly in the text before the returned position,
+         * so callers can skip over the lines ending before it.
+         * @return A position in [begin, end], end if nothing in the buffer can match.
+         */
+        const char* nextCandidate(const char* begin, const char* end) const
+        {
+            if(engine_ == Engine::MultiString) {
+                return multi_->findEnd(begin, end);
+            }
+            return prefilter_.enabled() ? prefilter_.find(begin, end) : begin;
+        }
+
+        /// True if nextCandidate() can skip text.
+        bool canSkip() const { return engine_ == Engine::MultiString || prefilter_.enabled(); }
+
+    private:
+        void compile(const std::string& pattern, bool fixedString);
+        void compileRegex(const std::string& pattern);
+
+        Engine engine_ = Engine::Regex;
+        std::regex regex_;
+        LiteralPrefilter prefilter_ = LiteralPrefilter::forLiteral(std::string());
+        std::shared_ptr<const AhoCorasick> multi_;
+        std::shared_ptr<const BitParallelMatcher> bitParallel_;
+        std::optional<LazyDfa> dfa_;
+    };
+}
+
+#endif //PARGREP_MATCHER_H
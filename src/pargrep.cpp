@@ -7,15 +7,31 @@
  * See bottom of file.
  */
 #include "pargrep.h"
-#include "regex_functions.h"
+#include "matcher.h"
+#include "mapped_file.h"
+#include "match_writer.h"
+#include "trigram_index.h"
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <cstring>
 #include <cassert>
 #include <random>
 #include <cstdint>
+#include <memory>
+#include <string_view>
+#include <filesystem>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace pargrep
 {
-    using std::regex;
     using std::string;
     using std::cerr;
     using std::endl;
@@ -23,267 +39,289 @@ namespace pargrep
     using std::ostream;
     using std::vector;
 
-    constexpr bool LOGGING_DIAGNOSTIC_ON    = true;
-    constexpr bool DEBUG_CODE_ON            = false;
-    constexpr bool DEBUG_CODE_SLEEPS_ON     = DEBUG_CODE_ON && false;
-    constexpr bool DEBUG_CODE_DELETE_ARRAYS = DEBUG_CODE_ON && false;
-
-    constexpr LineNumber END_OF_LINES = LineNumber(0) - 1;
-
     std::mutex outputMutex;
 
     // See pargrep.h
-    void grep_stream(istream &input, const string pattern, ostream &output, bool lineNumbers)
+    vector<string> patternList(const string& pattern, const Options& options)
     {
-      const regex toFind {pattern};
-
+        if(!options.patternFile) {
+            return {pattern};
+        }
+        std::ifstream patternsIn(pattern);
+        // Searching for nothing would look like finding nothing:
+        if(!patternsIn) {
+            throw std::runtime_error("unable to open pattern file " + pattern);
+        }
+        vector<string> patterns;
         string line;
-        int lineNumber = 1;
-        while(std::getline(input, line))
-        {
-            //std::cerr << "LINE: \"" << line << "\"" << std::endl;
-            const bool found = pargrep::search(line, toFind);
-            if(found)
-            {
-                if(lineNumbers)
-                {
-                    output << lineNumber << ':'<< line << std::endl;
-                } else {
-                    output << line << std::endl;
-                }
-                // std::cerr << "MATCH: " << line << std::endl;
-            }
-            ++lineNumber;
+        while(std::getline(patternsIn, line)) {
+            patterns.push_back(line);
         }
+        if constexpr(LOGGING_DIAGNOSTIC_ON) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            cerr << "Read " << patterns.size() << " patterns from " << pattern << endl;
+        }
+        return patterns;
+    }
+
+    // See pargrep.h
+    Matcher makeMatcher(const vector<string>& patterns, const Options& options)
+    {
+        Matcher matcher = options.patternFile ? Matcher(patterns, options.fixedStrings) : Matcher(patterns.front(), options.fixedStrings);
+        logEngine(matcher);
+        return matcher;
     }
 
     /**
-     * A reusable bundle of per-line data.
-     * These are passed from input thread to worker and writer threads and then
-     * recirculated back to reader thread to minimise allocations.
+     * Compile the pattern, or the patterns in the file it names, as the options say.
      */
-    struct Line {
-        Line (const LineNumber n, const LineNumber s) :
-                number(n),
-                skipped(s),
-                matched(false)
-        {}
-        /**
-         * Get ready to reuse an old Line object for a new line.
-         * @param number The number of this new line.
-         * @param skipped The count of completely empty lines that have been
-         */
-        void reset(const LineNumber number, const LineNumber skipped)
-        {
-            this->number = number;
+    Matcher makeMatcher(const string& pattern, const Options& options)
+    {
+        return makeMatcher(patternList(pattern, options), options);
+    }
 
-            this->text.clear();
-            this->skipped = skipped;
-            this->matched = false;
+    /**
+     * What UnsearchedFiles says, naming each of the paths.
+     */
+    string unsearchedMessage(const vector<string>& paths)
+    {
+        string message = "unable to search";
+        for(const string& path : paths) {
+            message.append(&path == &paths.front() ? " " : ", ");
+            message.append(path);
         }
-        LineNumber number;
-        LineNumber skipped;
-        std::string text;
-        bool matched = false;
-    };
+        return message;
+    }
 
-    Line* createLine(const LineNumber n, const LineNumber s)
+    // See pargrep.h
+    UnsearchedFiles::UnsearchedFiles(vector<string> paths, const std::uint64_t matches) :
+        std::runtime_error(unsearchedMessage(paths)),
+        paths_(std::move(paths)),
+        matches_(matches)
+    {}
+
+    // See pargrep.h
+    std::uint64_t grep_stream(istream &input, const string pattern, ostream &output, bool lineNumbers)
     {
-        ///@ToDo Support aligned allocation when compiler incs to C++17 / Clang 5.
-        return new Line(n, s);
+        Options options;
+        options.lineNumbers = lineNumbers;
+        return grep_stream(input, pattern, output, options);
     }
 
-    /**
-     * A set of pointers to Lines which are owned _elsewhere_ (**if at all**).
-     */
-    class LineSet
+    // See pargrep.h
+    std::uint64_t grep_stream(istream &input, const string pattern, ostream &output, const Options& options)
     {
-    public:
+        return grep_stream(input, makeMatcher(pattern, options), output, options);
+    }
 
-        /**
-         * Add a pointer to a Line to the back of the set.
-         * The Line passed may not be used by the caller after the call returns.
-         * @param line A reference to a pointer to a line. This will be null on return
-         * to force the caller to segfault if it uses it.
-         */
-        void push(Line*& line)
-        {
-            std::lock_guard<std::mutex> lock(m_);
-            {
-                s_.push_back(line);
-            }
-            line = nullptr;
-        }
+    ContextWriter::ContextWriter(const Options& options, string name, const bool separateFirst) :
+        lineNumbers_(options.lineNumbers),
+        before_(options.beforeContext),
+        after_(options.afterContext),
+        name_(std::move(name)),
+        separateFirst_(separateFirst),
+        ring_(options.beforeContext)
+    {}
 
-        /**
-         * Retrieve all Line objects in the set under a single lock.
-         * If the set is empty, the function will return immediately and outLines will be empty.
-         * @param outLines A buffer to hold popped Lines. Contents will be overwritten not appended-to.
-         */
-        void popAll(std::vector<Line*>& outLines)
+    void ContextWriter::match(const LineNumber number, const std::string_view text, string& out)
+    {
+        const LineNumber first = std::max(lastOutput_ + 1, number > before_ ? number - before_ : 1);
+        if(lastOutput_ == 0 ? separateFirst_ : first > lastOutput_ + 1) {
+            out.append("--\n");
+        }
+        for(; ringSize_ > 0; --ringSize_)
         {
-            std::lock_guard<std::mutex> lock(m_);
-            {
-                outLines.swap(s_);
-                // Start with a completely fresh buffer:
-                if constexpr (DEBUG_CODE_DELETE_ARRAYS){
-                    vector<Line*> clean;
-                    s_ = clean;
-                }
-                s_.clear();
-
+            const std::pair<LineNumber, string>& kept = ring_[ringStart_];
+            if(kept.first >= first) {
+                format(kept.first, '-', kept.second, out);
             }
+            ringStart_ = (ringStart_ + 1) % ring_.size();
         }
+        format(number, ':', text, out);
+        lastOutput_ = number;
+        afterUntil_ = number + after_;
+    }
 
-        /**
-         * Test whether there are any Lines in the set. In concurrent use, this is of course only a hint.
-         * @return True if the set has some Lines in it, else false.
-         */
-        bool empty() const {
-            bool e = false;
-            std::lock_guard<std::mutex> lock(m_);
-            {
-                e = s_.empty();
-            }
-            return e;
+    void ContextWriter::other(const LineNumber number, const std::string_view text, string& out)
+    {
+        if(number <= afterUntil_) {
+            format(number, '-', text, out);
+            lastOutput_ = number;
+        } else {
+            keep(number, text);
         }
+    }
 
-    private:
-        mutable std::mutex m_;
-        std::vector<Line*> s_;
-    };
+    void ContextWriter::empty(LineNumber first, const LineNumber end, string& out)
+    {
+        for(; first < end && first <= afterUntil_; ++first) {
+            other(first, std::string_view(), out);
+        }
+        // Only the last few can come before a match:
+        for(first = std::max(first, end > before_ ? end - before_ : 1); first < end; ++first) {
+            keep(first, std::string_view());
+        }
+    }
 
-   /**
-    * A set of pointers to Lines which are owned _elsewhere_ (**if at all**).
-    * Popping Lines blocks and puts the calling thread into a waiting state if none
-    * are available.
-    */
-    class BlockingLineSet
+    void ContextWriter::gap(const std::string_view text, LineNumber number, const LineNumber nextMatch, string& out)
     {
-    public:
-       /**
-        * Add a pointer to a Line to the back of the set.
-        * The Line passed may not be used by the caller after the call returns.
-        * Any blocked threads waiting for data to be available in the set will be woken.
-        * @param line A reference to a pointer to a line. This will be null on return
-        * to force the caller to segfault if it uses it.
-        */
-        void push(Line*& line)
+        const char* cursor = text.data();
+        const char* const end = text.data() + text.size();
+        // The lines after the last match:
+        while(cursor < end && number <= afterUntil_)
         {
-            std::unique_lock<std::mutex> lock(m_);
-            {
-                s_.push_back(line);
+            const char* const newline = static_cast<const char*>(std::memchr(cursor, '\n', end - cursor));
+            const char* const lineEnd = newline ? newline : end;
+            other(number++, std::string_view(cursor, lineEnd - cursor), out);
+            cursor = newline ? newline + 1 : end;
+        }
+        if(nextMatch == 0 || cursor == end) {
+            return;
+        }
+        // And the lines before the next, found by stepping back from it:
+        const LineNumber first = std::max(number, nextMatch > before_ ? nextMatch - before_ : 1);
+        const char* lineStart = end;
+        for(LineNumber line = first; line < nextMatch; ++line)
+        {
+            --lineStart;
+            while(lineStart > cursor && lineStart[-1] != '\n') {
+                --lineStart;
             }
-            c_.notify_all();
-            //c_.notify_one();
-            // Force callers to segfault if they use the thing they just threw away:
-            line = nullptr;
         }
+        for(number = first; number < nextMatch; ++number)
+        {
+            const char* const newline = static_cast<const char*>(std::memchr(lineStart, '\n', end - lineStart));
+            keep(number, std::string_view(lineStart, newline - lineStart));
+            lineStart = newline + 1;
+        }
+    }
 
-        /**
-         * Retrieve all Line objects in the set under a single lock.
-         * Only returns when there is data available, otherwise it waits for some.
-         * @param outLines A buffer to hold popped Lines. Contents will be overwritten not appended-to.
-         */
-        void popAll(std::vector<Line*>& inOutLines)
+    void ContextWriter::block(const LineBlock& block, std::uint64_t& matches, const std::uint64_t limit, string& out)
+    {
+        const std::size_t numLines = block.numLines();
+        // Blocks left over when the search was cancelled are never flagged:
+        const bool flagged = block.matched.size() == numLines;
+        for(std::size_t i = 0; i < numLines; ++i)
         {
-            std::unique_lock<std::mutex> lock(m_);
+            const LineNumber number = block.firstLine + i;
+            const std::string_view text(block.lineBegin(i), block.lineEnd(i) - block.lineBegin(i));
+            if(flagged && block.matched[i] && (limit == 0 || matches < limit))
             {
-                while(s_.empty()) {
-                    c_.wait(lock);
+                // The lines before it in the block join those kept from earlier blocks:
+                const LineNumber first = std::max({lastOutput_ + 1, number > before_ ? number - before_ : 1, block.firstLine});
+                for(LineNumber line = first; line < number; ++line) {
+                    const std::size_t j = line - block.firstLine;
+                    keep(line, std::string_view(block.lineBegin(j), block.lineEnd(j) - block.lineBegin(j)));
                 }
-
-                inOutLines.swap(s_);
-                if(DEBUG_CODE_DELETE_ARRAYS){
-                    vector<Line*> clean;
-                    s_ = clean;
-                }
-                s_.clear();
+                match(number, text, out);
+                ++matches;
+            } else if(number <= afterUntil_) {
+                other(number, text, out);
             }
         }
-
-        /**
-         * Test whether there are any Lines in the set. In concurrent use, this is of course only a hint.
-         * @return True if the set has some Lines in it, else false.
-         */
-        bool empty() const {
-            bool e = false;
-            std::unique_lock<std::mutex> lock(m_);
-            {
-                e = s_.empty();
-            }
-            return e;
+        // Keep the end of the block for a match at the start of the next one:
+        const LineNumber end = block.firstLine + numLines;
+        for(LineNumber line = std::max({lastOutput_ + 1, end > before_ ? end - before_ : 1, block.firstLine}); line < end; ++line) {
+            const std::size_t j = line - block.firstLine;
+            keep(line, std::string_view(block.lineBegin(j), block.lineEnd(j) - block.lineBegin(j)));
         }
+    }
 
-    private:
-        mutable std::mutex m_;
-        std::condition_variable c_;
-        std::vector<Line*> s_;
-    };
-
-    class GrepThreadState
+    void ContextWriter::format(const LineNumber number, const char separator, const std::string_view text, string& out)
     {
-    public:
-        GrepThreadState(const std::regex& regex, BlockingLineSet& results, unsigned workerId) :
-            regex(regex), results(results), workerId(workerId)
-        {}
-        const std::regex& regex;
-        BlockingLineSet input;
-        // Wired up to the output thread for in-order retirement:
-        BlockingLineSet& results;
-        unsigned workerId = 0;
-    };
+        if(!name_.empty()) {
+            out.append(name_);
+            out.push_back(separator);
+        }
+        if(lineNumbers_) {
+            const char numbered[2] = {separator, ' '};
+            formatLine(out, number, std::string_view(numbered, 2), text);
+        } else {
+            formatLine(out, text);
+        }
+    }
 
-    void grepThreadFunc(GrepThreadState* state)
+    void ContextWriter::keep(const LineNumber number, const std::string_view text)
     {
-        if constexpr (LOGGING_DIAGNOSTIC_ON) {
-            std::lock_guard<std::mutex> lock(outputMutex);
-            cerr << "Starting a Grep Thread " << state->workerId << " with state pointer: " << (uint64_t) state << endl;
+        if(ring_.empty()) {
+            return;
         }
-        const std::regex& regex = state->regex;
-        BlockingLineSet& input = state->input;
-        BlockingLineSet& results = state->results;
-        std::vector<Line*> inputBuffer;
+        // Once full, the newest line replaces the oldest:
+        std::pair<LineNumber, string>& slot = ring_[(ringStart_ + ringSize_) % ring_.size()];
+        slot.first = number;
+        slot.second.assign(text.data(), text.size());
+        if(ringSize_ < ring_.size()) {
+            ++ringSize_;
+        } else {
+            ringStart_ = (ringStart_ + 1) % ring_.size();
+        }
+    }
 
-        bool running = true;
-        while(running)
+    /**
+     * A reusable bundle of per-line data.
+     * These are passed from input thread to worker and writer threads and then
+     * recirculated back to reader thread to minimise allocations.
+     * The text is a view of a ReadBuffer rather than a copy. Aligned so that
+     * lines being filled by the reader don't share cachelines with lines being
+     * written out.
+     */
+    struct alignas(64) Line {
+        /**
+         * Get ready to reuse an old Line object for a new line.
+         * @param number The number of this new line.
+         * @param skipped The count of empty lines which didn't match skipped just before this one.
+         */
+        void reset(const LineNumber number, const LineNumber skipped)
         {
-            input.popAll(inputBuffer);
-            for(auto line : inputBuffer)
-            {
-                if(line->skipped != END_OF_LINES)
-                {
-                    const bool found = regex_search(line->text, regex);
-                    line->matched = found;
-                    results.push(line);
-                } else {
-                    running = false;
-                    if constexpr(LOGGING_DIAGNOSTIC_ON){
-                        std::lock_guard<std::mutex> lock(outputMutex);
-                        cerr << "Grep Thread # " << state->workerId << " quiting." << endl;
-                    }
-                }
-            }
-            inputBuffer.clear();
+            this->number = number;
+
+            this->text = std::string_view();
+            this->buffer = nullptr;
+            this->skipped = skipped;
+            this->matched = false;
         }
-    }
+        LineNumber number = 0;
+        LineNumber skipped = 0;
+        std::string_view text;
+        // Where the text lives, null for the end marker:
+        ReadBuffer* buffer = nullptr;
+        bool matched = false;
+    };
+
+    // The two thread version never has more lines than this in flight, so its queues never fill:
+    constexpr unsigned MAX_LINES_IN_FLIGHT = 256;
+    // One per line in flight and one being read into is all there can be, so the recycle queue never fills:
+    constexpr std::size_t MAX_BUFFERS = MAX_LINES_IN_FLIGHT + 1;
+
+    using LineQueue = SpscQueue<Line>;
 
     class WriterThreadState
     {
     public:
-        WriterThreadState(ostream& output, LineSet& recycler, bool outputLineNumbers = false) :
+        WriterThreadState(ostream& output, LineQueue& recycler, BufferQueue& bufferRecycler, bool outputLineNumbers = false, bool lineBuffered = false, bool writeLines = true) :
             output(output),
             recycler(recycler),
-            outputLineNumbers(outputLineNumbers)
+            bufferRecycler(bufferRecycler),
+            outputLineNumbers(outputLineNumbers),
+            lineBuffered(lineBuffered),
+            writeLines(writeLines)
         {}
         // Lines to be reordered into original order and output if they match:
-        BlockingLineSet input;
+        LineQueue input {MAX_LINES_IN_FLIGHT};
         // A text stream to write to:
         ostream& output;
         // Wired up to the main thread to reuse for future lines:
-        LineSet& recycler;
+        LineQueue& recycler;
+        // Wired up to the main thread to refill with input once their lines are all written:
+        BufferQueue& bufferRecycler;
         // whether to prefix lines with line numbers:
         bool outputLineNumbers = false;
+        // whether to write out each line as soon as it is complete:
+        bool lineBuffered = false;
+        // Clear for the modes which only count matches, so lines are just recycled:
+        bool writeLines = true;
+        // Set if lines around the matches are output too:
+        ContextWriter* context = nullptr;
     };
 
     void writerThreadFunc(WriterThreadState* const state)
@@ -292,49 +330,34 @@ namespace pargrep
             std::lock_guard<std::mutex> lock(outputMutex);
             cerr << "Writer thread started with state at address: " << (uint64_t) state << endl;
         }
-        ostream& output = state->output;
-        LineSet& recycler = state->recycler;
-        // A place to grab lines in a batch while entering a mutex just once:
+        MatchWriter output(state->output, state->lineBuffered);
+        LineQueue& recycler = state->recycler;
+        // A place to grab lines in a batch without touching the queue for each one:
         vector<Line*> inputBuffer;
-        // A place to sort lines into their original order, oldest/lowest lines at the front:
-        vector<Line*> reorderBuffer;
         // A high-tide mark showing how far line processing has reached:
         LineNumber lastOutput = 0;
         const bool outputLineNumbers = state->outputLineNumbers;
+        ContextWriter* const context = state->context;
+        std::string formatted;
 
         bool running = true;
         while(running) {
             if constexpr (DEBUG_CODE_SLEEPS_ON) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
 
-            // Grab a batch of lines, waiting if there are none:
-            assert(inputBuffer.empty());
+            // Grab a batch of lines, waiting if there are none.
+            // There is a single reader pushing through a FIFO so they arrive in order and need no sorting:
             state->input.popAll(inputBuffer);
             assert(inputBuffer.size() > 0UL);
 
-            // Sort the new lines into the ordered buffer, oldest, lowest at the back:
-            reorderBuffer.reserve(reorderBuffer.size() + inputBuffer.size());
-            reorderBuffer.insert(reorderBuffer.end(), inputBuffer.begin(), inputBuffer.end());
-            inputBuffer.clear();
-
-            std::sort(reorderBuffer.begin(), reorderBuffer.end(), [](const Line *l, const Line *r) -> bool {
-                assert(l);
-                assert(r);
-                const auto ln = l->number;
-                const auto rn = r->number;
-                bool result = false;
-                if (ln > rn) {
-                    result = true;
-                }
-                return result;
-            });
-
-            unsigned numLinesProcessed = 0;
-            for(auto it = reorderBuffer.rbegin(), end = reorderBuffer.rend(); it != end; ++it)
+            for(Line* line : inputBuffer)
             {
-                Line* line = *it;
-                assert(lastOutput < line->number); ///@Note This fired when the loop above hadn't. [TEMP]
+                assert(lastOutput < line->number);
                 // Look out for thread quit signal:
                 if(line->skipped == END_OF_LINES) {
+                    // Any empty lines at the end can still be context:
+                    if(context) {
+                        context->empty(lastOutput + 1, line->number, formatted);
+                    }
 
                     if constexpr (LOGGING_DIAGNOSTIC_ON) {
                         std::lock_guard<std::mutex> lock(outputMutex);
@@ -343,95 +366,233 @@ namespace pargrep
                     running = false;
                     line->skipped = 0;
                     line->matched = false;
+                    continue;
+                }
+                assert(lastOutput + line->skipped + 1 == line->number);
+                if (context) {
+                    // The reader skips empty lines which don't match, which can only be context:
+                    context->empty(line->number - line->skipped, line->number, formatted);
+                    if(line->matched) {
+                        context->match(line->number, line->text, formatted);
+                    } else {
+                        context->other(line->number, line->text, formatted);
+                    }
+                } else if (line->matched && state->writeLines) {
+                    if (outputLineNumbers) {
+                        output.line(line->number, ": ", line->text);
+                    } else {
+                        output.line(line->text);
+                    }
+                }
+
+                lastOutput = line->number;
+                ReadBuffer* buffer = line->buffer;
+                // Send the line back to the main thread to be reused:
+                recycler.push(line); ///< You may never access line again on this thread until you give it a new value.
+                if(buffer->users.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    state->bufferRecycler.push(buffer);
                 }
-                else if(lastOutput + line->skipped + 1 == line->number)
+            }
+            inputBuffer.clear();
+            if(!formatted.empty()) {
+                output.write(formatted);
+                formatted.clear();
+            }
+        }
+        // Flush and close the output on this thread since we have its data structures in cache:
+        output.flush();
+        ///@ToDo: - caller passes a policy which we invoke here. It could close the output file and do an immediate process exit without cleanup.
+    }
+
+    /**
+     * The writer for the many thread version.
+     * As writerThreadFunc() but retires whole blocks in sequence order, copying out
+     * the lines the workers have already formatted.
+     */
+    void blockWriterThreadFunc(BlockWriterThreadState* const state)
+    {
+        if constexpr(LOGGING_DIAGNOSTIC_ON){
+            std::lock_guard<std::mutex> lock(outputMutex);
+            cerr << "Block writer thread started with state at address: " << (uint64_t) state << endl;
+        }
+        const Options& options = state->options;
+        MatchWriter output(state->output, options.lineBuffered);
+        RecycleBlockQueue& recycler = state->recycler;
+        vector<LineBlock*> inputBuffer;
+        // Blocks put back into their original order:
+        ReorderWindow<LineBlock>& window = state->window;
+        const std::uint64_t limit = matchLimit(options);
+        std::uint64_t& matches = state->matches;
+
+        // Counting needs no order, so blocks are added up and recycled as they come:
+        if(options.mode != OutputMode::Lines)
+        {
+            LineNumber retired = 0;
+            LineNumber endSequence = 0;
+            while(endSequence == 0 || retired < endSequence)
+            {
+                state->input.popAll(inputBuffer);
+                for(LineBlock* block : inputBuffer)
                 {
-                    if (line->matched) {
-                        if (outputLineNumbers) {
-                            output << line->number << ": ";
+                    if(block->endOfLines) {
+                        endSequence = block->sequence;
+                    } else {
+                        const std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - block->dispatched;
+                        state->latenciesMs.push_back(latency.count());
+                        matches += block->matchCount;
+                        if(limit != 0 && matches >= limit) {
+                            state->queues.cancel();
                         }
-                        output << line->text << endl;
                     }
+                    recycler.push(block);
+                    window.retireUnordered();
+                    ++retired;
+                }
+                inputBuffer.clear();
+            }
+            writeSummary(output, options, capMatches(matches, limit), options.label);
+            output.flush();
+            return;
+        }
 
-                    lastOutput = line->number;
-                    if constexpr (DEBUG_CODE_ON) { *it = 0; } // < Null the array entry.
-                    // Send the line back to the main thread to be reused:
-                    ++numLinesProcessed;
-                    recycler.push(line); ///< You may never access line again on this thread until you give it a new value.
+        // Context lines are in the blocks but weren't formatted by the workers:
+        std::unique_ptr<ContextWriter> context;
+        if(hasContext(options)) {
+            context.reset(new ContextWriter(options));
+        }
+        std::string formatted;
 
+        bool running = true;
+        while(running) {
+            state->input.popAll(inputBuffer);
+            assert(inputBuffer.size() > 0UL);
+
+            for(LineBlock* block : inputBuffer) {
+                window.insert(block, block->sequence);
+            }
+            inputBuffer.clear();
+            state->maxReorderBlocks = std::max(state->maxReorderBlocks, window.size());
+
+            LineBlock* block = nullptr;
+            while(running && (block = window.pop()))
+            {
+                // The end marker is only honoured in order, once every earlier block is out:
+                if(block->endOfLines) {
+                    if constexpr (LOGGING_DIAGNOSTIC_ON) {
+                        std::lock_guard<std::mutex> lock(outputMutex);
+                        cerr << "Block writer thread quiting at block # " << block->sequence << endl;
+                    }
+                    running = false;
                 } else {
-                    // We have a gap in the order we are waiting to fill:
-                    break;
+                    const std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - block->dispatched;
+                    state->latenciesMs.push_back(latency.count());
+                }
+
+                // Blocks still unformatted were searched before their lines were numbered, or not at all:
+                if(!context && !block->linesFormatted && block->matched.size() == block->numLines()) {
+                    formatMatches(*block, options.lineNumbers);
+                }
+                if(context) {
+                    formatted.clear();
+                    context->block(*block, matches, limit, formatted);
+                    output.write(formatted);
+                    // Stop once the context after the last match allowed is out too:
+                    if(limit != 0 && matches >= limit && !context->wantsAfter(block->firstLine + block->numLines())) {
+                        state->queues.cancel();
+                    }
+                }
+                // The workers did the formatting, so this is only a copy:
+                else if(limit != 0 && matches + block->matchCount >= limit && matches < limit) {
+                    // Just the lines up to the limit, then stop the search:
+                    const char* const begin = block->formatted.data();
+                    const char* end = begin;
+                    for(; matches < limit; ++matches) {
+                        end = static_cast<const char*>(std::memchr(end, '\n', block->formatted.data() + block->formatted.size() - end)) + 1;
+                    }
+                    output.write(std::string_view(begin, end - begin));
+                    state->queues.cancel();
+                } else if(limit == 0 || matches < limit) {
+                    if(!state->writtenByWorkers) {
+                        output.write(block->formatted);
+                    }
+                    matches += block->matchCount;
                 }
+                recycler.push(block);
             }
-            reorderBuffer.resize(reorderBuffer.size() - numLinesProcessed);
         }
-        // Flush and close the output on this thread since we have its data structures in cache:
         output.flush();
-        ///@ToDo: - caller passes a policy which we invoke here. It could close the output file and do an immediate process exit without cleanup.
     }
 
     // See pargrep.h
-    void pargrep_stream_par1(istream& input, const string pattern, ostream& output, bool lineNumbers)
+    std::uint64_t pargrep_stream_par1(istream& input, const string pattern, ostream& output, bool lineNumbers)
     {
-        constexpr unsigned MAX_LINES_IN_FLIGHT = 256;
-        const regex toFind {pattern};
+        Options options;
+        options.lineNumbers = lineNumbers;
+        return pargrep_stream_par1(input, pattern, output, options);
+    }
+
+    // See pargrep.h
+    std::uint64_t pargrep_stream_par1(istream& input, const string pattern, ostream& output, const Options& options)
+    {
+        Matcher matcher = makeMatcher(pattern, options);
+        const bool lineNumbers = options.lineNumbers;
 
         // Writer thread:
-        // Returned lines after output by writer thread:
-        LineSet recycled;
+        // Returned lines and buffers after output by writer thread:
+        LineQueue recycled {MAX_LINES_IN_FLIGHT};
+        BufferQueue recycledBuffers {MAX_BUFFERS};
         std::vector<Line*> recycledBuffer;
         WriterThreadState writerState {
                 output,
                 recycled,
-                lineNumbers
+                recycledBuffers,
+                lineNumbers,
+                options.lineBuffered,
+                options.mode == OutputMode::Lines
         };
+        std::unique_ptr<ContextWriter> context;
+        if(hasContext(options)) {
+            context.reset(new ContextWriter(options));
+            writerState.context = context.get();
+        }
         std::thread writerThread(writerThreadFunc, &writerState);
+        const std::uint64_t limit = matchLimit(options);
+        std::uint64_t matches = 0;
+        // Once at the limit, reading goes on for the context after the last match:
+        LineNumber lastMatch = 0;
+        const LineNumber afterContext = context ? options.afterContext : 0;
 
         LineNumber lineNumber = 0;
         LineNumber skipped = 0;
-        unsigned linesCreated = 0;
-
+        LineCache cache(options.lineCacheEntries);
+        SlabArena<Line> lines;
+        MemoryBudget budget(options.memoryBudget);
+        LineReader reader(input, recycledBuffers, budget, MAX_BUFFERS);
 
         ///@ToDo Lower priority of current thread so background threads starve it from generating new work as long as there is existing work to do in background.
 
         Line *line = nullptr;
+        std::string_view text;
+        ReadBuffer* buffer = nullptr;
         while(true)
         {
             ++lineNumber;
 
             // Get a Line struct:
             if(!skipped) {
-                unsigned yieldCount = 0;
-                get_a_line:
                 if (recycledBuffer.empty()) {
                     if(DEBUG_CODE_DELETE_ARRAYS){
                         vector<Line*> temp;
                         recycledBuffer = temp;
                     }
+                    recycled.tryPopAll(recycledBuffer);
+                }
+                // Out of lines, so wait for the writer to give one back:
+                if (recycledBuffer.empty() && lines.size() >= MAX_LINES_IN_FLIGHT) {
                     recycled.popAll(recycledBuffer);
                 }
                 if (recycledBuffer.empty()) {
-                    if(linesCreated < MAX_LINES_IN_FLIGHT) {
-                        line = createLine(lineNumber, skipped);
-                        ++linesCreated;
-                        if constexpr(LOGGING_DIAGNOSTIC_ON)
-                        {
-                            std::lock_guard<std::mutex> l(outputMutex);
-                            cerr << "Lines created: " << linesCreated << endl;
-                        }
-                    } else {
-                        std::this_thread::yield();
-                        if(yieldCount % 32 == 0){
-                            if constexpr(LOGGING_DIAGNOSTIC_ON)
-                            {
-                                std::lock_guard<std::mutex> l(outputMutex);
-                                cerr << '.';
-                            }
-                        }
-                        ++yieldCount;
-                        goto get_a_line;
-                    }
+                    line = lines.create();
                 } else {
                     line = recycledBuffer.back();
                     recycledBuffer.resize(recycledBuffer.size() - 1);
@@ -439,25 +600,33 @@ namespace pargrep
             }
             assert(line);
             line->reset(lineNumber, skipped);
-            std::string& lineBuffer = line->text;
-            if(!std::getline(input, lineBuffer)){
+            // Stop at the end of the input or as soon as the search has its answer:
+            if((limit != 0 && matches == limit && lineNumber > lastMatch + afterContext) || !reader.next(text, buffer)){
                 line->number = lineNumber;
                 line->skipped = END_OF_LINES;
                 writerState.input.push(line);
                 break;
             }
 
-            if(lineBuffer.length() < 1) {
+            // Empty lines are skipped unless the pattern matches them, which is only found out once:
+            if(text.empty() && !cache.search(matcher, text.data(), text.data())) {
+                reader.release(buffer);
                 ++skipped;
                 continue;
             }
+            line->text = text;
+            line->buffer = buffer;
 
             if constexpr (false && LOGGING_DIAGNOSTIC_ON) {
                 std::lock_guard<std::mutex> lock(outputMutex);
                 cerr << "Push #" << line->number << " (" << line << "." << endl;
             }
-            const bool found = regex_search(lineBuffer, toFind);
+            const bool found = (limit == 0 || matches < limit) && cache.search(matcher, text.data(), text.data() + text.size());
             line->matched = found;
+            matches += found;
+            if(found) {
+                lastMatch = lineNumber;
+            }
             assert(lineNumber == line->number);
             assert(skipped == line->skipped);
             writerState.input.push(line);
@@ -466,130 +635,673 @@ namespace pargrep
             skipped = 0;
         }
         writerThread.join();
+
+        if constexpr(LOGGING_DIAGNOSTIC_ON)
+        {
+            std::lock_guard<std::mutex> l(outputMutex);
+            cerr << "Lines created: " << lines.size() << ", buffers created: " << reader.buffersCreated() << ", peak bytes: " << budget.peak()
+                 << ", line cache hits: " << cache.hits() << " of " << cache.lookups() << endl;
+        }
+        if(options.stats) {
+            *options.stats = PipelineStats();
+            options.stats->peakBytes = budget.peak();
+            options.stats->lineCacheLookups = cache.lookups();
+            options.stats->lineCacheHits = cache.hits();
+        }
+        MatchWriter summary(output, options.lineBuffered);
+        writeSummary(summary, options, matches, options.label);
+        return matches;
     }
 
     // See pargrep.h
-    void pargrep_stream_par2(istream& input, const string pattern, ostream& output, bool lineNumbers)
+    std::uint64_t pargrep_stream_par2(istream& input, const string pattern, ostream& output, bool lineNumbers, std::size_t blockBytes)
     {
-        Line endSentinel = Line(0, END_OF_LINES);
-        const regex toFind {pattern};
+        Options options;
+        options.lineNumbers = lineNumbers;
+        options.blockBytes = blockBytes;
+        return pargrep_stream_par2(input, pattern, output, options);
+    }
 
-        // Worker threads:
-        const unsigned numThreads = std::thread::hardware_concurrency();
-        if constexpr(LOGGING_DIAGNOSTIC_ON)
+    // See pargrep.h
+    std::uint64_t pargrep_stream_par2(istream& input, const string pattern, ostream& output, const Options& options)
+    {
+        return pargrep_stream_par2(input, makeMatcher(pattern, options), output, options);
+    }
+
+    // See pargrep.h
+    std::uint64_t pargrep_auto(istream& input, const string pattern, ostream& output, const Options& options)
+    {
+        return pargrep_auto(input, makeMatcher(pattern, options), output, options);
+    }
+
+    /**
+     * A matching line found by a worker in a memory-mapped chunk.
+     */
+    struct ChunkMatch {
+        // Zero-based line number relative to the first line of the chunk:
+        LineNumber line;
+        // Offset of the line from the start of the mapping:
+        std::size_t begin;
+        // Length of the line excluding its newline:
+        std::size_t length;
+    };
+
+    /**
+     * Everything a worker learns about one newline-aligned chunk of a mapped file.
+     * Aligned to keep workers writing to neighbouring chunks off each other's cachelines.
+     */
+    struct alignas(64) ChunkResult {
+        std::vector<ChunkMatch> matches;
+        // Count of lines in the chunk, used by the writer to rebuild absolute line numbers:
+        LineNumber numLines = 0;
+        // Set under the shared mutex once the matches and line count are final:
+        bool done = false;
+    };
+
+    /**
+     * Split a buffer into ranges of roughly the requested size, each ending just after a
+     * newline (except possibly the last one).
+     * @return The offsets where each range starts, with a final entry equal to the size.
+     */
+    std::vector<std::size_t> splitAtNewlines(const char* const data, const std::size_t size, const std::size_t targetChunkSize)
+    {
+        std::vector<std::size_t> bounds;
+        bounds.push_back(0);
+        std::size_t start = 0;
+        while(size - start > targetChunkSize)
         {
-            std::lock_guard<std::mutex> l(outputMutex);
-            cerr << "Hardware concurrency: " << numThreads << endl;
+            const char* const nominal = data + start + targetChunkSize;
+            const char* const newline = static_cast<const char*>(std::memchr(nominal, '\n', size - (nominal - data)));
+            if(!newline) {
+                break;
+            }
+            start = (newline - data) + 1;
+            if(start < size) {
+                bounds.push_back(start);
+            }
         }
-        // Threads and thread states are pointed-to to avoid false sharing of cachelines.
-        std::vector<std::thread*> workers;
-        workers.reserve(numThreads);
-        std::vector<GrepThreadState*> taskStates;
-        taskStates.reserve(numThreads);
+        bounds.push_back(size);
+        return bounds;
+    }
 
-        // Writer thread:
-        // Returned lines after output by writer thread:
-        LineSet recycled;
-        std::vector<Line*> recycledBuffer;
-        WriterThreadState writerState {
-                output,
-                recycled,
-                lineNumbers
-        };
-        std::thread writerThread(writerThreadFunc, &writerState);
+    /**
+     * Search lines in a byte range of a mapped file, recording matches and a line count.
+     * @param limit Stop after this many matches, leaving the line count short. Zero for no limit.
+     */
+    void grepChunk(const char* const base, const std::size_t begin, const std::size_t end, Matcher& matcher, ChunkResult& result, const std::uint64_t limit = 0)
+    {
+        const char* cursor = base + begin;
+        const char* const last = base + end;
+        LineNumber line = 0;
+        while(cursor < last)
+        {
+            if(matcher.canSkip())
+            {
+                // Jump to the start of the line holding the next candidate, counting the lines skipped:
+                const char* const candidate = matcher.nextCandidate(cursor, last);
+                const char* lineStart = candidate;
+                while(lineStart > cursor && lineStart[-1] != '\n') {
+                    --lineStart;
+                }
+                line += NewlineScanner::count(cursor, lineStart);
+                cursor = lineStart;
+                if(cursor == last) {
+                    break;
+                }
+            }
+            const char* newline = static_cast<const char*>(std::memchr(cursor, '\n', last - cursor));
+            const char* const lineEnd = newline ? newline : last;
+            if(matcher.search(cursor, lineEnd)) {
+                result.matches.push_back(ChunkMatch{line, std::size_t(cursor - base), std::size_t(lineEnd - cursor)});
+                if(result.matches.size() == limit) {
+                    break;
+                }
+            }
+            ++line;
+            cursor = lineEnd + 1;
+        }
+        result.numLines = line;
+    }
 
-        std::default_random_engine generator;
-        std::uniform_int_distribution<unsigned> distribution(0, numThreads - 1);
+    // See pargrep.h
+    std::uint64_t pargrep_file_mmap(const string& filename, const string pattern, ostream& output, bool lineNumbers)
+    {
+        Options options;
+        options.lineNumbers = lineNumbers;
+        return pargrep_file_mmap(filename, pattern, output, options);
+    }
 
-        bool launchedThreads = false;
-        LineNumber lineNumber = 0;
-        LineNumber skipped = 0;
+    /**
+     * The chunks of a mapped file to search, when an index has ruled out the rest.
+     */
+    struct ChunkPlan {
+        // Where each chunk starts and ends in the file:
+        std::vector<std::size_t> begins;
+        std::vector<std::size_t> ends;
+        // Number of the first line of each chunk:
+        std::vector<LineNumber> firstLines;
+    };
 
-        ///@ToDo Lower priority of current thread so background threads starve it from generating new work as long as there is existing work to do in background.
+    std::uint64_t grepMappedFile(const MappedFile& file, const string& filename, const Matcher& matcher, ostream& output, const Options& options, bool separateContext = false, const ChunkPlan* plan = nullptr);
 
-        Line *line = nullptr;
-        while(true)
+    // See pargrep.h
+    std::uint64_t pargrep_file_mmap(const string& filename, const string pattern, ostream& output, const Options& options)
+    {
+        return pargrep_file_mmap(filename, makeMatcher(pattern, options), output, options);
+    }
+
+    // See pargrep.h
+    std::uint64_t pargrep_file_mmap(const string& filename, const Matcher& matcher, ostream& output, const Options& options)
+    {
+        MappedFile file(filename);
+        if(!file.valid())
         {
-            ++lineNumber;
+            if(!file.opened()) {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                cerr << "pargrep: unable to open " << filename << endl;
+                throw UnsearchedFiles({filename}, 0);
+            }
+            // Not something we can map so stream it instead:
+            std::ifstream in(filename);
+            Options streamOptions = options;
+            streamOptions.label = filename;
+            return pargrep_stream_par2(in, matcher, output, streamOptions);
+        }
+        return grepMappedFile(file, filename, matcher, output, options);
+    }
 
-            // Get a Line struct:
-            if(!skipped) {
-                if (recycledBuffer.empty()) {
-                    recycled.popAll(recycledBuffer);
+    // See pargrep.h
+    std::uint64_t pargrep_file_indexed(const string& filename, const string& indexFilename, const string pattern, ostream& output, const Options& options)
+    {
+        const vector<string> patterns = patternList(pattern, options);
+        return pargrep_file_indexed(filename, indexFilename, patterns, makeMatcher(patterns, options), output, options);
+    }
+
+    // See pargrep.h
+    std::uint64_t pargrep_file_indexed(const string& filename, const string& indexFilename, const vector<string>& patterns, const Matcher& matcher, ostream& output, const Options& options)
+    {
+        const TrigramIndex index(indexFilename, filename);
+        MappedFile file(filename);
+        // The file may have changed between checking the index and mapping it:
+        if(!index.valid() || !file.valid() || index.blockBegin(index.numBlocks()) != file.size())
+        {
+            if constexpr(LOGGING_DIAGNOSTIC_ON) {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                cerr << "Not using the missing or out of date index " << indexFilename << endl;
+            }
+            return pargrep_file_mmap(filename, matcher, output, options);
+        }
+        const TrigramQuery query = trigramQuery(patterns, options.fixedStrings);
+        ChunkPlan plan;
+        for(const std::size_t block : index.candidates(query)) {
+            plan.begins.push_back(index.blockBegin(block));
+            plan.ends.push_back(index.blockBegin(block + 1));
+            plan.firstLines.push_back(index.blockFirstLine(block));
+        }
+        if constexpr(LOGGING_DIAGNOSTIC_ON) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            cerr << "Trigram query " << query.toString() << " leaves " << plan.begins.size() << " of " << index.numBlocks() << " blocks to search." << endl;
+        }
+        return grepMappedFile(file, filename, matcher, output, options, false, &plan);
+    }
+
+    /**
+     * The body of pargrep_file_mmap(), for a file already mapped and a pattern already compiled.
+     * @param separateContext Set if context lines from another file were output before this one's.
+     * @param plan The only chunks to search, or null to search the whole file.
+     */
+    std::uint64_t grepMappedFile(const MappedFile& file, const string& filename, const Matcher& matcher, ostream& output, const Options& options, const bool separateContext, const ChunkPlan* const plan)
+    {
+        const bool lineNumbers = options.lineNumbers;
+        const bool writeLines = options.mode == OutputMode::Lines;
+        const std::uint64_t limit = matchLimit(options);
+        MatchWriter writer(output, options.lineBuffered);
+        // The writer finds the lines around each match itself, since the whole file is to hand:
+        std::unique_ptr<ContextWriter> context;
+        if(hasContext(options)) {
+            context.reset(new ContextWriter(options, options.withFilenames ? filename : string(), separateContext));
+        } else if(options.withFilenames && options.mode != OutputMode::FilesWithMatches) {
+            writer.prefixLines(filename + ':');
+        }
+        if(file.size() == 0) {
+            writeSummary(writer, options, 0, filename);
+            return 0;
+        }
+        const unsigned numThreads = std::max(1u, std::thread::hardware_concurrency());
+        // Enough chunks per thread to even out skew between them but not so many as to
+        // drown in per-chunk overhead:
+        constexpr std::size_t MIN_CHUNK_SIZE = 64 * 1024;
+        constexpr std::size_t MAX_CHUNK_SIZE = 16 * 1024 * 1024;
+        const std::size_t targetChunkSize = std::min(MAX_CHUNK_SIZE, std::max(MIN_CHUNK_SIZE, file.size() / (numThreads * 8)));
+        const std::vector<std::size_t> bounds = plan ? std::vector<std::size_t>() : splitAtNewlines(file.data(), file.size(), targetChunkSize);
+        const std::size_t numChunks = plan ? plan->begins.size() : bounds.size() - 1;
+        auto chunkBegin = [&](const std::size_t chunk) { return plan ? plan->begins[chunk] : bounds[chunk]; };
+        auto chunkEnd = [&](const std::size_t chunk) { return plan ? plan->ends[chunk] : bounds[chunk + 1]; };
+
+        std::vector<ChunkResult> results(numChunks);
+        std::atomic<std::size_t> nextChunk {0};
+        std::mutex doneMutex;
+        std::condition_variable doneCondition;
+        // Only kept by workers in the modes which don't output lines:
+        std::atomic<std::uint64_t> counted {0};
+
+        auto worker = [&](const unsigned workerId)
+        {
+            if constexpr (LOGGING_DIAGNOSTIC_ON) {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                cerr << "Starting a mapped file grep thread " << workerId << endl;
+            }
+            Matcher localMatcher = matcher;
+            for(std::size_t chunk = nextChunk++; chunk < numChunks; chunk = nextChunk++)
+            {
+                // No chunk needs more matches than the whole search:
+                grepChunk(file.data(), chunkBegin(chunk), chunkEnd(chunk), localMatcher, results[chunk], limit);
+                if(!writeLines)
+                {
+                    // Counting needs no order so the workers keep the count, stopping the rest once it has reached the limit:
+                    const std::uint64_t total = counted += results[chunk].matches.size();
+                    vector<ChunkMatch>().swap(results[chunk].matches);
+                    if(limit != 0 && total >= limit) {
+                        nextChunk.store(numChunks);
+                    }
+                    continue;
                 }
-                if (recycledBuffer.empty()) {
-                    line = createLine(lineNumber, skipped);
+                {
+                    std::lock_guard<std::mutex> lock(doneMutex);
+                    results[chunk].done = true;
+                }
+                doneCondition.notify_all();
+            }
+        };
+
+        const unsigned numWorkers = unsigned(std::min<std::size_t>(numThreads, numChunks));
+        if constexpr(LOGGING_DIAGNOSTIC_ON)
+        {
+            std::lock_guard<std::mutex> l(outputMutex);
+            cerr << "Mapped " << file.size() << " bytes as " << numChunks << " chunks for " << numWorkers << " threads." << endl;
+        }
+        // Threads come from the caller's pool if there is one, as in the many thread version:
+        std::vector<std::future<void>> workers;
+        workers.reserve(numWorkers);
+        for(unsigned i = 0; i < numWorkers; ++i) {
+            workers.push_back(launchTask(options, [&worker, i]() { worker(i); }));
+        }
+
+        // This thread is the writer, retiring chunks in file order:
+        LineNumber firstLineOfChunk = 1;
+        std::uint64_t matches = 0;
+        // With context, the text after the last match output and its first line's number:
+        const char* const fileEnd = file.data() + file.size();
+        const char* gapBegin = file.data();
+        LineNumber gapLine = 1;
+        string formatted;
+        for(std::size_t chunk = 0; writeLines && chunk < numChunks; ++chunk)
+        {
+            ChunkResult& result = results[chunk];
+            {
+                std::unique_lock<std::mutex> lock(doneMutex);
+                while(!result.done) {
+                    doneCondition.wait(lock);
+                }
+            }
+            // Planned chunks needn't follow on from each other:
+            if(plan) {
+                firstLineOfChunk = plan->firstLines[chunk];
+            }
+            for(const ChunkMatch& match : result.matches)
+            {
+                const std::string_view text(file.data() + match.begin, match.length);
+                if(context) {
+                    const LineNumber number = firstLineOfChunk + match.line;
+                    context->gap(std::string_view(gapBegin, text.data() - gapBegin), gapLine, number, formatted);
+                    context->match(number, text, formatted);
+                    gapBegin = std::min(fileEnd, text.data() + text.size() + 1);
+                    gapLine = number + 1;
+                } else if(lineNumbers) {
+                    writer.line(firstLineOfChunk + match.line, ": ", text);
                 } else {
-                    line = recycledBuffer.back();
-                    recycledBuffer.resize(recycledBuffer.size() - 1);
+                    writer.line(text);
+                }
+                if(++matches == limit) {
+                    break;
                 }
             }
-            line->reset(lineNumber, skipped);
-            std::string& lineBuffer = line->text;
-            if(!std::getline(input, lineBuffer)){
-                line->number = lineNumber;
-                line->skipped = END_OF_LINES;
-                writerState.input.push(line);
+            firstLineOfChunk += result.numLines;
+            // Free matches as we go since the whole results array lives until we return:
+            vector<ChunkMatch>().swap(result.matches);
+            writer.write(formatted);
+            formatted.clear();
+            if(limit != 0 && matches == limit) {
+                // Leave the chunks not yet taken:
+                nextChunk.store(numChunks);
+                break;
+            }
+        }
 
-                // Tell worker threads to stop:
-                for(auto workerState : taskStates)
-                {
-                    auto* p = &endSentinel;
-                    workerState->input.push(p);
+        // The context after the last match, which may lie in chunks never searched:
+        if(context) {
+            context->gap(std::string_view(gapBegin, fileEnd - gapBegin), gapLine, 0, formatted);
+            writer.write(formatted);
+        }
+
+        for(auto& thread : workers) {
+            thread.get();
+        }
+        if(!writeLines) {
+            matches = capMatches(counted, limit);
+            writeSummary(writer, options, matches, filename);
+        }
+        writer.flush();
+        return matches;
+    }
+
+    /**
+     * The paths left to search in pargrep_tree().
+     * A directory is listed by whichever thread takes it, adding its contents back
+     * here, so walking the tree is spread over the threads along with the searching.
+     */
+    class SearchTasks
+    {
+    public:
+        void push(string path)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_);
+                if(cancelled_) {
+                    return;
                 }
+                paths_.push_back(std::move(path));
+            }
+            c_.notify_one();
+        }
 
-                break;
+        /**
+         * Take a path to search, waiting if other threads may still add more.
+         * Call finished() once it has been searched.
+         * @return False once there are no paths left and no thread is busy with one.
+         */
+        bool pop(string& path)
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            c_.wait(lock, [&]() { return !paths_.empty() || busy_ == 0; });
+            if(paths_.empty() || cancelled_) {
+                return false;
             }
+            // Most recent first, so the walk goes depth first and the list stays short:
+            path = std::move(paths_.back());
+            paths_.pop_back();
+            ++busy_;
+            return true;
+        }
 
-            if(lineBuffer.length() < 1) {
-                ++skipped;
+        void finished()
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            if(--busy_ == 0 && paths_.empty()) {
+                c_.notify_all();
+            }
+        }
+
+        /// Drop the paths left, and any added from now on, once the search has its answer.
+        void cancel()
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            cancelled_ = true;
+            paths_.clear();
+            large_.clear();
+        }
+
+        /// Set aside a file too big to be searched by one thread.
+        void deferLarge(string path)
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            if(cancelled_) {
+                return;
+            }
+            large_.push_back(std::move(path));
+        }
+
+        /// Only call once the threads have quit.
+        vector<string>& large() { return large_; }
+
+    private:
+        std::mutex m_;
+        std::condition_variable c_;
+        vector<string> paths_;
+        unsigned busy_ = 0;
+        bool cancelled_ = false;
+        vector<string> large_;
+    };
+
+    /**
+     * Files this big or bigger are searched by all the threads at once, as
+     * pargrep_file_mmap() does, once the smaller files are done.
+     */
+    constexpr std::size_t LARGE_FILE_BYTES = 16 * 1024 * 1024;
+
+    /**
+     * Read the whole of a file.
+     * @return False if it couldn't all be read.
+     */
+    bool readFile(const int fd, const std::size_t size, string& contents)
+    {
+        contents.resize(size);
+        std::size_t got = 0;
+        while(got < size)
+        {
+            const ssize_t n = ::read(fd, &contents[got], size - got);
+            if(n < 0 && errno == EINTR) {
                 continue;
             }
+            if(n <= 0) {
+                // The file shrank or can't be read:
+                contents.resize(got);
+                return n == 0;
+            }
+            got += std::size_t(n);
+        }
+        return true;
+    }
 
-            unsigned threadIndex = 0;
-            // Build a background thread on demand to optimise for short inputs:
-            if(!launchedThreads)
-            {
-                threadIndex = workers.size();
-                taskStates.push_back(new GrepThreadState(toFind, writerState.input, threadIndex));
-                workers.push_back(new std::thread(grepThreadFunc, taskStates.back()));
+    // See pargrep.h
+    std::uint64_t pargrep_tree(const vector<string>& paths, const string pattern, ostream& output, const Options& options)
+    {
+        return pargrep_tree(paths, makeMatcher(pattern, options), output, options);
+    }
+
+    // See pargrep.h
+    std::uint64_t pargrep_tree(const vector<string>& paths, const Matcher& matcher, ostream& output, const Options& options)
+    {
+        namespace fs = std::filesystem;
+        const bool lineNumbers = options.lineNumbers;
+        // Limits such as Options::maxCount apply to each file, as in grep:
+        const std::uint64_t limit = matchLimit(options);
+        std::atomic<std::uint64_t> matches {0};
 
-                if(threadIndex + 1 >= numThreads)
+        SearchTasks tasks;
+        for(const string& path : paths) {
+            tasks.push(path);
+        }
+
+        // Paths which couldn't be searched, added under outputMutex as they are reported:
+        vector<string> unsearched;
+
+        // Each file's matches go out in one piece so they stay together:
+        std::mutex writerMutex;
+        MatchWriter writer(output, options.lineBuffered);
+        bool wroteContext = false;
+
+        auto searchFile = [&](const string& path, const int fd, const std::size_t size, Matcher& localMatcher, string& contents, string& formatted, ChunkResult& result)
+        {
+            if(size >= LARGE_FILE_BYTES) {
+                tasks.deferLarge(path);
+                return;
+            }
+            if(!readFile(fd, size, contents)) {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                cerr << "pargrep: unable to read " << path << endl;
+                unsearched.push_back(path);
+                return;
+            }
+            result.matches.clear();
+            grepChunk(contents.data(), 0, contents.size(), localMatcher, result, limit);
+            matches += result.matches.size();
+            formatted.clear();
+            if(options.mode == OutputMode::Quiet) {
+                if(!result.matches.empty()) {
+                    tasks.cancel();
+                }
+                return;
+            } else if(options.mode == OutputMode::Count) {
+                if(options.withFilenames) {
+                    formatted.append(path);
+                    formatted.push_back(':');
+                }
+                formatLine(formatted, result.matches.size(), "", "");
+            } else if(options.mode == OutputMode::FilesWithMatches) {
+                if(!result.matches.empty()) {
+                    formatLine(formatted, path);
+                }
+            }
+            if(hasContext(options))
+            {
+                ContextWriter context(options, options.withFilenames ? path : string());
+                const char* const contentsEnd = contents.data() + contents.size();
+                const char* gapBegin = contents.data();
+                LineNumber gapLine = 1;
+                for(const ChunkMatch& match : result.matches)
                 {
-                    launchedThreads = true;
+                    const std::string_view text(contents.data() + match.begin, match.length);
+                    context.gap(std::string_view(gapBegin, text.data() - gapBegin), gapLine, match.line + 1, formatted);
+                    context.match(match.line + 1, text, formatted);
+                    gapBegin = std::min(contentsEnd, text.data() + text.size() + 1);
+                    gapLine = match.line + 2;
+                }
+                context.gap(std::string_view(gapBegin, contentsEnd - gapBegin), gapLine, 0, formatted);
+            }
+            for(std::size_t i = 0; options.mode == OutputMode::Lines && !hasContext(options) && i < result.matches.size(); ++i)
+            {
+                const ChunkMatch& match = result.matches[i];
+                if(options.withFilenames) {
+                    formatted.append(path);
+                    formatted.push_back(':');
+                }
+                const std::string_view text(contents.data() + match.begin, match.length);
+                if(lineNumbers) {
+                    formatLine(formatted, match.line + 1, ": ", text);
+                } else {
+                    formatLine(formatted, text);
                 }
             }
-            // Pick an existing thread to send the line to at random to avoid repeating patterns in input line length causing asymetric thread workloads:
-            else
+            if(formatted.empty()) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(writerMutex);
+            // Context groups from different files are separated like those within a file:
+            if(hasContext(options) && wroteContext) {
+                writer.write("--\n");
+            }
+            wroteContext = true;
+            writer.write(formatted);
+        };
+
+        auto listDirectory = [&](const string& path)
+        {
+            std::error_code error;
+            for(fs::directory_iterator entries(path, fs::directory_options::skip_permission_denied, error), end; !error && entries != end; entries.increment(error))
             {
-                threadIndex = distribution(generator);
+                // Links inside the tree aren't followed, like grep -r:
+                const fs::file_type type = entries->symlink_status(error).type();
+                if(type == fs::file_type::directory || type == fs::file_type::regular) {
+                    tasks.push(entries->path().string());
+                }
             }
+            if(error) {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                cerr << "pargrep: unable to list " << path << ": " << error.message() << endl;
+                unsearched.push_back(path);
+            }
+        };
 
-            GrepThreadState* workerState = taskStates[threadIndex];
-            workerState->input.push(line);
+        auto worker = [&](const unsigned workerId)
+        {
+            if constexpr (LOGGING_DIAGNOSTIC_ON) {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                cerr << "Starting a file search thread " << workerId << endl;
+            }
+            Matcher localMatcher = matcher;
+            // Reused from file to file:
+            string path, contents, formatted;
+            ChunkResult result;
+            while(tasks.pop(path))
+            {
+                const int fd = ::open(path.c_str(), O_RDONLY);
+                struct stat info;
+                if(fd < 0 || ::fstat(fd, &info) != 0) {
+                    std::lock_guard<std::mutex> lock(outputMutex);
+                    cerr << "pargrep: unable to open " << path << endl;
+                    unsearched.push_back(path);
+                } else if(S_ISDIR(info.st_mode)) {
+                    if(options.recursive) {
+                        listDirectory(path);
+                    } else {
+                        std::lock_guard<std::mutex> lock(outputMutex);
+                        cerr << "pargrep: " << path << ": Is a directory" << endl;
+                        unsearched.push_back(path);
+                    }
+                } else if(S_ISREG(info.st_mode)) {
+                    searchFile(path, fd, std::size_t(info.st_size), localMatcher, contents, formatted, result);
+                }
+                if(fd >= 0) {
+                    ::close(fd);
+                }
+                tasks.finished();
+            }
+        };
 
-            skipped = 0;
+        const unsigned numThreads = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::future<void>> workers;
+        workers.reserve(numThreads);
+        for(unsigned i = 0; i < numThreads; ++i) {
+            workers.push_back(launchTask(options, [&worker, i]() { worker(i); }));
         }
-        // Wait for all background work to quit:
-        writerThread.join();
-        ///@ToDo: can do an immediate exit here assuming writer won't quit until all work from worker threads is output.
-        for(auto thread : workers)
+        for(auto& thread : workers) {
+            thread.get();
+        }
+        writer.flush();
+
+        // Now the big files, each split over all the threads:
+        vector<string>& large = tasks.large();
+        std::sort(large.begin(), large.end());
+        for(const string& path : large)
         {
-            thread->join();
+            MappedFile file(path);
+            if(!file.valid()) {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                cerr << "pargrep: unable to open " << path << endl;
+                unsearched.push_back(path);
+                continue;
+            }
+            const std::uint64_t fileMatches = grepMappedFile(file, path, matcher, output, options, wroteContext);
+            wroteContext = wroteContext || fileMatches > 0;
+            matches += fileMatches;
+            if(options.mode == OutputMode::Quiet && matches > 0) {
+                break;
+            }
+        }
+        if(!unsearched.empty()) {
+            std::sort(unsearched.begin(), unsearched.end());
+            throw UnsearchedFiles(std::move(unsearched), matches);
         }
+        return matches;
     }
 }
 
-///@ToDo - Limit the number of Line structs in flight for the worker threads version (say 32 * num threads).
-///@ToDo - Special case matches for zero length lines ("^$", ".*", "^.*", "^", "$", etc.) or this skipping empty lines optimisation is a bug. [On first empty line, apply regex on reader thread: if it matches, send all empty lines to writer directly as matches without running any regex, if it doesn't: do as we do now: skip them completely.]
 ///@ToDo - Wrap the cerr usage in a locking mechanism.
 ///@ToDo - Docopt command line parser: https://github.com/docopt/docopt.cpp
-///@ToDo - Analyse file size and avoid spawning threads if a file is small.
 ///@ToDo - Benchmark against grep using these locale options: http://www.inmotionhosting.com/support/website/ssh/speed-up-grep-searches-with-lc-all
-///@ToDo - Add simple string matching without regex and compare to fgrep.
+///@ToDo - Compare fixed string mode (Options::fixedStrings) to fgrep.
 ///@ToDo - Aligned allocation of threads and thread state structs to avoid false sharing.     constexpr bool USE_ALIGNED_ALLOC        = true;
-///@ToDo - Aligned allocation of Line structures.
-///@ToDo - Integrate the buffer returned by [Blocking]LineSet::popAll() into the class to clean up the caller.
+///@ToDo - Integrate the buffer returned by the queues' popAll() into the class to clean up the caller.
 /// # Optimisation Ideas
-///@ToDo - Check patterns for a prefix of non-special characters (e.g. [a-z,A-Z,0-9]) and do a begins_with(prefix) match on lines if the pattern has one. This might be done on the reader/main thread before launching lines to worker threads.
 
@@ -6,11 +6,111 @@
 #ifndef PARGREP_PARGREP_H
 #define PARGREP_PARGREP_H
 #include <iostream>
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
 
 namespace pargrep {
 
+    class ThreadPool;
+    class Matcher;
+
     using LineNumber = std::uint64_t;
 
+    /**
+     * How the many thread version's pipeline behaved, for tuning.
+     */
+    struct PipelineStats {
+        /// The most blocks the writer held back waiting for an earlier block.
+        std::size_t maxReorderBlocks = 0;
+        /// The most memory held by lines in the pipeline at once, in bytes.
+        std::size_t peakBytes = 0;
+        /// Blocks a worker took from another worker's queue.
+        std::uint64_t blocksStolen = 0;
+        /// The most worker threads being handed blocks at once.
+        unsigned peakWorkers = 0;
+        /// Time from a block being queued for the workers to it being written, in milliseconds.
+        double medianBlockLatencyMs = 0;
+        double p99BlockLatencyMs = 0;
+        double maxBlockLatencyMs = 0;
+        /// Lines looked up in the searching threads' LineCaches, and how many were answered without a search.
+        std::uint64_t lineCacheLookups = 0;
+        std::uint64_t lineCacheHits = 0;
+    };
+
+    /**
+     * What a search outputs.
+     * Every version of grep returns the number of matching lines it found. Modes
+     * which only need the first match, and Options::maxCount, stop the search (and
+     * that number) short as soon as the answer is known.
+     */
+    enum class OutputMode {
+        /// The matching lines.
+        Lines,
+        /// The number of matching lines, like grep -c.
+        Count,
+        /// The name of the input if any line matches, like grep -l.
+        FilesWithMatches,
+        /// Nothing, for callers which only want to know if anything matched, like grep -q.
+        Quiet
+    };
+
+    /**
+     * Settings shared by all the variants of grep.
+     */
+    struct Options {
+        /// If true, matching lines are prefixed with their line numbers, else they are ouput exactly as read.
+        bool lineNumbers = true;
+        /// Match the pattern as a plain string rather than a regex, like fgrep / grep -F.
+        bool fixedStrings = false;
+        /// The pattern argument names a file of patterns, one per line, any of which may match, like grep -f. Searches
+        /// throw std::runtime_error if the file can't be opened.
+        bool patternFile = false;
+        /// What to output for the matching lines.
+        OutputMode mode = OutputMode::Lines;
+        /// Stop after this many matching lines, like grep -m. Zero for no limit.
+        std::uint64_t maxCount = 0;
+        /// For OutputMode::Lines, also output this many lines before each matching line, like grep -B.
+        LineNumber beforeContext = 0;
+        /// For OutputMode::Lines, also output this many lines after each matching line, like grep -A. These still
+        /// follow the last match allowed by Options::maxCount.
+        LineNumber afterContext = 0;
+        /// The name OutputMode::FilesWithMatches gives a stream, like grep --label.
+        std::string label = "(standard input)";
+        /// Write out each matching line as soon as it is found, for interactive use, like grep --line-buffered. Otherwise output is written in large batches.
+        bool lineBuffered = false;
+        /// For the many thread version, when the output is std::cout redirected to a regular file, have the worker threads
+        /// pwrite() their matching lines straight to their places in the file rather than pass them all through one writer thread.
+        bool parallelWrite = false;
+        /// Search the contents of directories, and of directories within them, like grep -r.
+        bool recursive = false;
+        /// Prefix each matching line with the name of the file it is in and a colon, like grep -H.
+        bool withFilenames = false;
+        /// For the many thread version, the number of worker threads. Zero for one per hardware thread.
+        unsigned workers = 0;
+        /// For the many thread version, start with Options::workers workers then add or retire them, up to one per
+        /// hardware thread, as they fall behind the reader or sit idle.
+        bool adaptiveWorkers = false;
+        /// For the many thread version, the amount of line text to batch into each block. Zero is adaptive.
+        std::size_t blockBytes = 0;
+        /**
+         * For the two and many thread versions, roughly the most memory lines may
+         * take up in the pipeline, counting their text. When it is used up the reader
+         * waits for the writer to finish with a line (or block) before reading more.
+         * Zero means no limit beyond the pipeline's fixed queue sizes.
+         */
+        std::size_t memoryBudget = 256 * 1024 * 1024;
+        /// For the two and many thread versions, how many recently seen lines each searching thread remembers the
+        /// result for, so lines repeated throughout the input are only searched once. Zero to only remember empty lines.
+        std::size_t lineCacheEntries = 4096;
+        /// If set, the many thread, mapped file and tree versions run their threads on the pool instead of starting their own.
+        ThreadPool* pool = nullptr;
+        /// If set, the two and many thread versions report how their pipelines behaved here.
+        PipelineStats* stats = nullptr;
+    };
+
     /**
      * Grep for an expression on a single stream and output results on an outstream
      * provided.
@@ -22,20 +122,147 @@ namespace pargrep {
      * @param lineNumbers If true, matching lines are prefixed with their line
      * numbers, else they are ouput exactly as read.
      */
-    void grep_stream(std::istream &input, const std::string pattern, std::ostream &output, bool lineNumbers = true);
+    std::uint64_t grep_stream(std::istream &input, const std::string pattern, std::ostream &output, bool lineNumbers = true);
+    std::uint64_t grep_stream(std::istream &input, const std::string pattern, std::ostream &output, const Options& options);
+
+    /**
+     * The patterns a search is for: the pattern itself, or the lines of the file
+     * it names if Options::patternFile is set.
+     * @throw std::runtime_error If the file of patterns can't be opened.
+     */
+    std::vector<std::string> patternList(const std::string& pattern, const Options& options);
+
+    /**
+     * Compile the patterns from patternList(), as the options say, for the overloads
+     * below which take a matcher and callers which search again and again.
+     */
+    Matcher makeMatcher(const std::vector<std::string>& patterns, const Options& options);
+
+    /// Only matcher objects, not strings, select the templated overloads below.
+    template<typename MatcherT>
+    using if_matcher = std::enable_if_t<!std::is_convertible<MatcherT, std::string>::value, std::uint64_t>;
+
+    /**
+     * Grep with a matcher supplied by the caller rather than compiled from a
+     * pattern string, such as a static_pattern.
+     * The matcher needs search(const std::string&), search(const char*, const char*),
+     * nextCandidate(), canSkip() and engineName(), as Matcher has. Options which
+     * say how to compile the pattern (fixedStrings, patternFile) are ignored.
+     */
+    template<typename MatcherT>
+    if_matcher<MatcherT> grep_stream(std::istream& input, MatcherT matcher, std::ostream& output, const Options& options);
 
     /**
      * Two thread version.
      * Probably slower than single threaded.
      **/
-    void pargrep_stream_par1(std::istream& input, const std::string pattern, std::ostream& output, bool lineNumbers = true);
+    std::uint64_t pargrep_stream_par1(std::istream& input, const std::string pattern, std::ostream& output, bool lineNumbers = true);
+    std::uint64_t pargrep_stream_par1(std::istream& input, const std::string pattern, std::ostream& output, const Options& options);
 
     /**
     * Many thread version.
+    * Lines are batched into blocks which are handed to worker threads and retired
+    * in order by a writer thread as single units.
+    *
+    * @param blockBytes The amount of line text to batch into each block. Zero
+    * selects adaptive sizing: blocks start small so short inputs are spread over
+    * workers quickly and grow as the input proves to be long.
     **/
-    void pargrep_stream_par2(std::istream& input, const std::string pattern, std::ostream& output, bool lineNumbers = true);
+    std::uint64_t pargrep_stream_par2(std::istream& input, const std::string pattern, std::ostream& output, bool lineNumbers = true, std::size_t blockBytes = 0);
+    std::uint64_t pargrep_stream_par2(std::istream& input, const std::string pattern, std::ostream& output, const Options& options);
 
+    /**
+     * Many thread version with a matcher supplied by the caller, as for grep_stream().
+     * Each worker thread searches with its own copy of the matcher.
+     */
+    template<typename MatcherT>
+    if_matcher<MatcherT> pargrep_stream_par2(std::istream& input, MatcherT matcher, std::ostream& output, const Options& options);
 
+    /**
+     * Pick the fastest version for the input.
+     * Reads a sample of the input and times the pattern on it, then estimates the
+     * cost of searching the rest from its size, if the stream can tell. Inputs
+     * quick to search go to grep_stream() to save starting threads. Others go to
+     * pargrep_stream_par2() with as many workers as it takes to keep up with
+     * reading the input, in adaptive mode so that number follows the input as it
+     * changes.
+     */
+    std::uint64_t pargrep_auto(std::istream& input, const std::string pattern, std::ostream& output, const Options& options);
+
+    /**
+     * As pargrep_auto(), with a matcher supplied by the caller as for grep_stream().
+     */
+    template<typename MatcherT>
+    if_matcher<MatcherT> pargrep_auto(std::istream& input, MatcherT matcher, std::ostream& output, const Options& options);
+
+    /**
+     * Thrown by the file searches once they are over if some of their files
+     * couldn't be searched. Each was reported on cerr as it failed, and the
+     * rest were searched and output as usual.
+     */
+    class UnsearchedFiles : public std::runtime_error
+    {
+    public:
+        UnsearchedFiles(std::vector<std::string> paths, std::uint64_t matches);
+
+        /// The files which couldn't be opened or read:
+        const std::vector<std::string>& paths() const { return paths_; }
+        /// Matching lines in the files which were searched:
+        std::uint64_t matches() const { return matches_; }
+
+    private:
+        std::vector<std::string> paths_;
+        std::uint64_t matches_;
+    };
+
+    /**
+     * Many thread version for regular files.
+     * The file is memory-mapped and split into newline-aligned byte ranges which
+     * worker threads search in place, so there is no single reader thread and no
+     * copying of lines. Matches are output in file order with line numbers rebuilt
+     * from per-range line counts.
+     * Falls back to pargrep_stream_par2() if the file can't be mapped (e.g. a pipe).
+     *
+     * @param filename Path of the file to search.
+     * @throw UnsearchedFiles If the file can't be opened.
+     */
+    std::uint64_t pargrep_file_mmap(const std::string& filename, const std::string pattern, std::ostream& output, bool lineNumbers = true);
+    std::uint64_t pargrep_file_mmap(const std::string& filename, const std::string pattern, std::ostream& output, const Options& options);
+    /// As above, with the pattern already compiled by makeMatcher().
+    std::uint64_t pargrep_file_mmap(const std::string& filename, const Matcher& matcher, std::ostream& output, const Options& options);
+
+    /**
+     * pargrep_file_mmap() for a file indexed by prep-index.
+     * The patterns are turned into a query on the trigrams in the index, and only
+     * the blocks of the file the query can't rule out are searched. Line numbers
+     * come from the index, and context lines are still found around each match.
+     * Falls back to pargrep_file_mmap() if the index is missing or the file has
+     * changed since it was built.
+     *
+     * @param indexFilename Path of the file's index, see TrigramIndex.
+     */
+    std::uint64_t pargrep_file_indexed(const std::string& filename, const std::string& indexFilename, const std::string pattern, std::ostream& output, const Options& options);
+    /// As above, with the patterns from patternList() already compiled by makeMatcher().
+    std::uint64_t pargrep_file_indexed(const std::string& filename, const std::string& indexFilename, const std::vector<std::string>& patterns, const Matcher& matcher, std::ostream& output, const Options& options);
+
+    /**
+     * Many thread version for many files, such as a tree of logs.
+     * Threads take whole files, and directories to list if Options::recursive is
+     * set, from a shared list of paths. Files are read and searched by one thread
+     * each and their matching lines output in one piece, so each file's lines stay
+     * together, though files come out in no particular order. Files too big to
+     * leave to one thread are searched afterwards as pargrep_file_mmap() does.
+     * Links found inside directories aren't followed.
+     *
+     * @param paths Files and directories to search.
+     * @throw UnsearchedFiles After searching the rest if any of them can't be
+     * opened, read or listed.
+     */
+    std::uint64_t pargrep_tree(const std::vector<std::string>& paths, const std::string pattern, std::ostream& output, const Options& options);
+    /// As above, with the pattern already compiled by makeMatcher().
+    std::uint64_t pargrep_tree(const std::vector<std::string>& paths, const Matcher& matcher, std::ostream& output, const Options& options);
 }
 
+#include "pipeline.h"
+
 #endif //PARGREP_PARGREP_H
@@ -0,0 +1,1198 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// The line searching loops, templated on the matcher so that patterns compiled
+// when the program is built run without going through Matcher.
+// Included by pargrep.h: don't include it directly.
+//
+#ifndef PARGREP_PIPELINE_H
+#define PARGREP_PIPELINE_H
+
+#include "pargrep.h"
+#include "concurrent_queue.h"
+#include "line_cache.h"
+#include "line_reader.h"
+#include "match_writer.h"
+#include "thread_pool.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace pargrep
+{
+    constexpr bool LOGGING_DIAGNOSTIC_ON    = true;
+    constexpr bool DEBUG_CODE_ON            = false;
+    constexpr bool DEBUG_CODE_SLEEPS_ON     = DEBUG_CODE_ON && false;
+    constexpr bool DEBUG_CODE_DELETE_ARRAYS = DEBUG_CODE_ON && false;
+
+    constexpr LineNumber END_OF_LINES = LineNumber(0) - 1;
+
+    extern std::mutex outputMutex;
+
+    template<typename MatcherT>
+    void logEngine(const MatcherT& matcher)
+    {
+        if constexpr(LOGGING_DIAGNOSTIC_ON) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cerr << "Matching with engine: " << matcher.engineName() << std::endl;
+        }
+    }
+
+    /**
+     * Run one of a search's threads on the caller's pool if there is one, else on a
+     * thread started for this search alone.
+     */
+    inline std::future<void> launchTask(const Options& options, std::function<void()> task)
+    {
+        return options.pool ? options.pool->submit(std::move(task)) : std::async(std::launch::async, std::move(task));
+    }
+
+    /**
+     * The number of matching lines after which a search knows its answer, or zero
+     * if it has to see them all.
+     */
+    inline std::uint64_t matchLimit(const Options& options)
+    {
+        if(options.mode == OutputMode::FilesWithMatches || options.mode == OutputMode::Quiet) {
+            return 1;
+        }
+        return options.maxCount;
+    }
+
+    /// The number of matching lines a search reports, which stops at its limit.
+    inline std::uint64_t capMatches(const std::uint64_t matches, const std::uint64_t limit)
+    {
+        return limit != 0 && matches > limit ? limit : matches;
+    }
+
+    /**
+     * Output what the modes other than OutputMode::Lines say about a whole input.
+     * @param name What OutputMode::FilesWithMatches calls the input.
+     */
+    inline void writeSummary(MatchWriter& writer, const Options& options, const std::uint64_t matches, const std::string_view name)
+    {
+        if(options.mode == OutputMode::Count) {
+            char digits[20];
+            writer.line(std::string_view(digits, std::to_chars(digits, digits + sizeof(digits), matches).ptr - digits));
+        } else if(options.mode == OutputMode::FilesWithMatches && matches > 0) {
+            writer.line(name);
+        }
+    }
+
+    /// Whether matching lines go out with lines around them.
+    inline bool hasContext(const Options& options)
+    {
+        return options.mode == OutputMode::Lines && (options.beforeContext != 0 || options.afterContext != 0);
+    }
+
+    struct LineBlock;
+
+    /**
+     * Formats matching lines along with the lines around them, like grep -B and -A.
+     * Lines are handed over in order. A line which may come before a later match
+     * is copied into a ring of Options::beforeContext reused strings, so only that
+     * many lines are held on to, whatever becomes of the buffers they were read
+     * into. Groups of lines which overlap or touch are merged and the rest are
+     * separated by a line of "--".
+     * Context lines have a dash where matching lines have a colon, as in grep.
+     */
+    class ContextWriter
+    {
+    public:
+        /**
+         * @param name Prefixed to every line, with a colon or dash, if not empty.
+         * @param separateFirst Put "--" before the first group too, as it follows another input's.
+         */
+        explicit ContextWriter(const Options& options, std::string name = std::string(), bool separateFirst = false);
+
+        /// Format a matching line, after whichever of the lines before it are due out.
+        void match(LineNumber number, std::string_view text, std::string& out);
+        /// Hand over a line which didn't match, to be output if it closely follows a match or kept in case one follows it.
+        void other(LineNumber number, std::string_view text, std::string& out);
+        /// As other(), for the lines from first up to but not including end, all empty.
+        void empty(LineNumber first, LineNumber end, std::string& out);
+        /**
+         * Hand over the text between two matches, for an input which is all in memory.
+         * Only the lines near enough to the matches to be output are looked at, so a
+         * long gap costs no more than a short one.
+         * @param number The number of the first line of the text.
+         * @param nextMatch The number of the matching line the text runs up to, or zero if it runs to the end of the input.
+         */
+        void gap(std::string_view text, LineNumber number, LineNumber nextMatch, std::string& out);
+        /**
+         * Hand over a block of the many thread version, with its lines flagged by the
+         * workers. Only lines near matches are looked at or copied.
+         * @param matches The matching lines so far. Once this reaches a limit other
+         * than zero the rest of the lines only count as context.
+         */
+        void block(const LineBlock& block, std::uint64_t& matches, std::uint64_t limit, std::string& out);
+
+        /// Whether a line would be output for following a match already handed over.
+        bool wantsAfter(const LineNumber number) const { return number <= afterUntil_; }
+
+    private:
+        void format(LineNumber number, char separator, std::string_view text, std::string& out);
+        void keep(LineNumber number, std::string_view text);
+
+        const bool lineNumbers_;
+        const LineNumber before_;
+        const LineNumber after_;
+        const std::string name_;
+        const bool separateFirst_;
+        // The last line output, zero before the first:
+        LineNumber lastOutput_ = 0;
+        // Lines up to this one follow a match closely enough to be output:
+        LineNumber afterUntil_ = 0;
+        // The last few lines not output, oldest first from ringStart_:
+        std::vector<std::pair<LineNumber, std::string>> ring_;
+        std::size_t ringStart_ = 0;
+        std::size_t ringSize_ = 0;
+    };
+
+    // See pargrep.h
+    template<typename MatcherT>
+    if_matcher<MatcherT> grep_stream(std::istream& input, MatcherT matcher, std::ostream& output, const Options& options)
+    {
+        logEngine(matcher);
+        const bool lineNumbers = options.lineNumbers;
+        const bool writeLines = options.mode == OutputMode::Lines;
+        const std::uint64_t limit = matchLimit(options);
+        MatchWriter writer(output, options.lineBuffered);
+        std::unique_ptr<ContextWriter> context;
+        if(hasContext(options)) {
+            context.reset(new ContextWriter(options));
+        }
+        std::string formatted;
+
+        // Interactive output wants lines as soon as they arrive, not once a block of them has:
+        LineReader reader(input, options.lineBuffered);
+        std::string_view line;
+        LineNumber lineNumber = 1;
+        std::uint64_t matches = 0;
+        while(reader.next(line))
+        {
+            //std::cerr << "LINE: \"" << line << "\"" << std::endl;
+            // Past the limit, lines are only read for the context after the last match:
+            const bool found = (limit == 0 || matches < limit) && matcher.search(line.data(), line.data() + line.size());
+            if(context)
+            {
+                if(found) {
+                    context->match(lineNumber, line, formatted);
+                } else {
+                    context->other(lineNumber, line, formatted);
+                }
+                writer.write(formatted);
+                formatted.clear();
+            }
+            else if(found && writeLines)
+            {
+                if(lineNumbers)
+                {
+                    writer.line(lineNumber, ": ", line);
+                } else {
+                    writer.line(line);
+                }
+            }
+            // std::cerr << "MATCH: " << line << std::endl;
+            matches += found;
+            if(limit != 0 && matches == limit && !(context && context->wantsAfter(lineNumber + 1))) {
+                break;
+            }
+            ++lineNumber;
+        }
+        writeSummary(writer, options, matches, options.label);
+        return matches;
+    }
+
+    /**
+     * A reusable batch of consecutive lines stored back to back in one buffer.
+     * These are the unit of work in the many thread version: a single push hands a
+     * worker or the writer a whole block, amortising queue synchronisation over many
+     * lines, and blocks recirculate to the reader thread like Lines do.
+     * The reader only copies whole lines in: the worker splits them and the lines
+     * are numbered after that, so reading never waits on counting lines.
+     * Aligned so the reader, workers and writer never share a cacheline through neighbouring blocks.
+     */
+    struct alignas(64) LineBlock {
+        explicit LineBlock(const LineNumber sequence) :
+                sequence(sequence)
+        {
+            offsets.push_back(0);
+        }
+        /**
+         * Get ready to reuse an old block, keeping the capacity of its buffers.
+         * @param sequence The position of this block in the input, starting at 1.
+         */
+        void reset(const LineNumber sequence)
+        {
+            this->sequence = sequence;
+            firstLine = 0;
+            numbered.store(false, std::memory_order_relaxed);
+            text.clear();
+            offsets.clear();
+            offsets.push_back(0);
+            matched.clear();
+            formatted.clear();
+            linesFormatted = false;
+            matchCount = 0;
+            endOfLines = false;
+        }
+        /// Find where each line of the text starts, with one vectorised scan for newlines.
+        void splitLines()
+        {
+            offsets.clear();
+            offsets.push_back(0);
+            NewlineScanner scanner;
+            scanner.reset(text.data(), text.data() + text.size());
+            while(const char* const newline = scanner.next()) {
+                offsets.push_back(newline + 1 - text.data());
+            }
+        }
+        std::size_t numLines() const { return offsets.size() - 1; }
+        const char* lineBegin(const std::size_t i) const { return text.data() + offsets[i]; }
+        /// Where the line ends, at its newline.
+        const char* lineEnd(const std::size_t i) const { return text.data() + offsets[i + 1] - 1; }
+
+        LineNumber sequence;
+        // Only meaningful once numbered has been set, by the LineNumberer:
+        LineNumber firstLine = 0;
+        std::atomic<bool> numbered {false};
+        // Whole lines, each with its newline, as read by LineReader::nextLines():
+        std::string text;
+        // Start of each line in text, with a final entry for the end of the text, set by splitLines():
+        std::vector<std::size_t> offsets;
+        // One flag per line, set by a worker thread:
+        std::vector<std::uint8_t> matched;
+        // The matching lines, formatted for output by the worker unless their numbers weren't known in time:
+        std::string formatted;
+        bool linesFormatted = false;
+        // Where the formatted lines go in the output file, when workers write them there:
+        std::uint64_t outputOffset = 0;
+        // Set on the last block of the input, which holds no lines:
+        bool endOfLines = false;
+        // When the reader handed the block to the workers, for latency stats:
+        std::chrono::steady_clock::time_point dispatched;
+        // The memory charged to the MemoryBudget for this block:
+        std::size_t charged = 0;
+        // The number of lines flagged in matched:
+        std::size_t matchCount = 0;
+
+        /// The memory the block holds, including the spare capacity of its buffers.
+        std::size_t bytes() const
+        {
+            return sizeof(LineBlock) + text.capacity() + offsets.capacity() * sizeof(std::size_t) + matched.capacity() + formatted.capacity();
+        }
+    };
+
+    inline LineBlock* createBlock(const LineNumber sequence)
+    {
+        return new LineBlock(sequence);
+    }
+
+    /**
+     * Format the lines of a block flagged by grepBlock() ready for output, so the
+     * writer only has to copy them out.
+     */
+    inline void formatMatches(LineBlock& block, const bool outputLineNumbers)
+    {
+        const std::size_t numLines = block.numLines();
+        for(std::size_t i = 0; i < numLines; ++i)
+        {
+            if(block.matched[i]) {
+                const std::string_view text(block.lineBegin(i), block.lineEnd(i) - block.lineBegin(i));
+                if(outputLineNumbers) {
+                    formatLine(block.formatted, block.firstLine + i, ": ", text);
+                } else {
+                    formatLine(block.formatted, text);
+                }
+            }
+        }
+    }
+
+    /**
+     * Hands out default constructed objects from slabs of many at a time.
+     * Objects are never freed individually: callers recycle them, and the slabs
+     * go when the arena does. An over-aligned T (e.g. alignas(64)) gets aligned
+     * slabs, so objects on different threads never share a cacheline.
+     */
+    template<typename T, std::size_t SlabSize = 64>
+    class SlabArena
+    {
+    public:
+        T* create()
+        {
+            if(used_ == SlabSize) {
+                slabs_.emplace_back(new T[SlabSize]);
+                used_ = 0;
+            }
+            return &slabs_.back()[used_++];
+        }
+
+        std::size_t size() const { return slabs_.size() * SlabSize - (SlabSize - used_); }
+
+    private:
+        std::vector<std::unique_ptr<T[]>> slabs_;
+        std::size_t used_ = SlabSize;
+    };
+
+    /**
+     * A set of pointers to Lines (or LineBlocks) which are owned _elsewhere_ (**if at all**).
+     * Superseded in the pipelines by the lock-free queues of concurrent_queue.h and
+     * kept as the baseline for their benchmarks.
+     */
+    template<typename T>
+    class PointerSet
+    {
+    public:
+
+        /**
+         * Add a pointer to a Line to the back of the set.
+         * The Line passed may not be used by the caller after the call returns.
+         * @param line A reference to a pointer to a line. This will be null on return
+         * to force the caller to segfault if it uses it.
+         */
+        void push(T*& line)
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            {
+                s_.push_back(line);
+            }
+            line = nullptr;
+        }
+
+        /**
+         * Retrieve all Line objects in the set under a single lock.
+         * If the set is empty, the function will return immediately and outLines will be empty.
+         * @param outLines A buffer to hold popped Lines. Contents will be overwritten not appended-to.
+         */
+        void popAll(std::vector<T*>& outLines)
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            {
+                outLines.swap(s_);
+                // Start with a completely fresh buffer:
+                if constexpr (DEBUG_CODE_DELETE_ARRAYS){
+                    std::vector<T*> clean;
+                    s_ = clean;
+                }
+                s_.clear();
+
+            }
+        }
+
+        /**
+         * Test whether there are any Lines in the set. In concurrent use, this is of course only a hint.
+         * @return True if the set has some Lines in it, else false.
+         */
+        bool empty() const {
+            bool e = false;
+            std::lock_guard<std::mutex> lock(m_);
+            {
+                e = s_.empty();
+            }
+            return e;
+        }
+
+    private:
+        mutable std::mutex m_;
+        std::vector<T*> s_;
+    };
+
+   /**
+    * A set of pointers to Lines (or LineBlocks) which are owned _elsewhere_ (**if at all**).
+    * Popping Lines blocks and puts the calling thread into a waiting state if none
+    * are available.
+    */
+    template<typename T>
+    class BlockingPointerSet
+    {
+    public:
+       /**
+        * Add a pointer to a Line to the back of the set.
+        * The Line passed may not be used by the caller after the call returns.
+        * Any blocked threads waiting for data to be available in the set will be woken.
+        * @param line A reference to a pointer to a line. This will be null on return
+        * to force the caller to segfault if it uses it.
+        */
+        void push(T*& line)
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            {
+                s_.push_back(line);
+            }
+            c_.notify_all();
+            //c_.notify_one();
+            // Force callers to segfault if they use the thing they just threw away:
+            line = nullptr;
+        }
+
+        /**
+         * Retrieve all Line objects in the set under a single lock.
+         * Only returns when there is data available, otherwise it waits for some.
+         * @param outLines A buffer to hold popped Lines. Contents will be overwritten not appended-to.
+         */
+        void popAll(std::vector<T*>& inOutLines)
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            {
+                while(s_.empty()) {
+                    c_.wait(lock);
+                }
+
+                inOutLines.swap(s_);
+                if(DEBUG_CODE_DELETE_ARRAYS){
+                    std::vector<T*> clean;
+                    s_ = clean;
+                }
+                s_.clear();
+            }
+        }
+
+        /**
+         * Test whether there are any Lines in the set. In concurrent use, this is of course only a hint.
+         * @return True if the set has some Lines in it, else false.
+         */
+        bool empty() const {
+            bool e = false;
+            std::unique_lock<std::mutex> lock(m_);
+            {
+                e = s_.empty();
+            }
+            return e;
+        }
+
+    private:
+        mutable std::mutex m_;
+        std::condition_variable c_;
+        std::vector<T*> s_;
+    };
+
+    // Capacities of the many thread version's queues, in blocks:
+    constexpr std::size_t QUEUED_BLOCKS_PER_WORKER = 64;
+    constexpr std::size_t RESULT_QUEUE_BLOCKS = 1024;
+    // The most blocks between the oldest one not yet written and the newest one read:
+    constexpr std::size_t REORDER_WINDOW_BLOCKS = 256;
+    // Room for every block that can exist, so the writer never waits to recycle one:
+    constexpr std::size_t RECYCLE_QUEUE_BLOCKS = 2 * REORDER_WINDOW_BLOCKS;
+
+    // All the workers (and the reader, for the end marker) hand blocks to the writer:
+    using ResultBlockQueue = MpscQueue<LineBlock>;
+    // The writer hands spent blocks back to the reader:
+    using RecycleBlockQueue = SpscQueue<LineBlock>;
+
+    /**
+     * The blocks waiting for the worker threads of the many thread version.
+     * The reader deals blocks out to a deque per worker. A worker takes from the
+     * front of its own deque and, once that is empty, steals from the front of
+     * another's, so idle workers take over the backlog of one stuck on slow lines.
+     * The front is the oldest block, which is the one the writer, retiring blocks in
+     * order, is most likely to be waiting for.
+     * The deques are short and blocks are big, so each has a plain mutex.
+     */
+    class WorkStealingQueues
+    {
+    public:
+        explicit WorkStealingQueues(const unsigned numWorkers) :
+            numWorkers_(numWorkers),
+            deques_(new Deque[numWorkers]),
+            active_(numWorkers)
+        {}
+
+        /**
+         * Queue a block on a worker's deque, waiting if too many blocks are queued already.
+         * Only the reader thread may push.
+         * @param block This will be null on return.
+         */
+        void push(const unsigned worker, LineBlock*& block)
+        {
+            notFull_.wait([&]() { return queued_.load(std::memory_order_acquire) < numWorkers_ * QUEUED_BLOCKS_PER_WORKER; });
+            {
+                std::lock_guard<std::mutex> lock(deques_[worker].m);
+                deques_[worker].blocks.push_back(block);
+            }
+            queued_.fetch_add(1, std::memory_order_release);
+            block = nullptr;
+            notEmpty_.notify();
+        }
+
+        /**
+         * Note that the search has its answer, for the reader to stop reading and
+         * the workers to stop searching the blocks still queued.
+         */
+        void cancel() { cancelled_.store(true, std::memory_order_release); }
+        bool cancelled() const { return cancelled_.load(std::memory_order_acquire); }
+
+        /// Tell the workers there are no more blocks coming.
+        void finish()
+        {
+            finished_.store(true, std::memory_order_release);
+            notEmpty_.notify();
+        }
+
+        /**
+         * Set how many workers, numbered from zero, take blocks. The rest wait until
+         * they are brought back, leaving the blocks already on their deques to be
+         * stolen. Only the reader thread may call this.
+         */
+        void setActive(const unsigned active)
+        {
+            active_.store(std::max(1u, std::min(active, numWorkers_)), std::memory_order_release);
+            notEmpty_.notify();
+        }
+
+        /// The number of blocks waiting for a worker.
+        std::size_t queued() const { return queued_.load(std::memory_order_acquire); }
+
+        /**
+         * Take the next block for a worker, waiting if there are none anywhere.
+         * @return Null once finish() has been called and every block has been taken.
+         */
+        LineBlock* pop(const unsigned worker)
+        {
+            while(true)
+            {
+                // Retired workers come back to help empty the queues at the end:
+                if(worker >= active_.load(std::memory_order_acquire) && !finished_.load(std::memory_order_acquire)) {
+                    notEmpty_.wait([&]() {
+                        return worker < active_.load(std::memory_order_acquire) || finished_.load(std::memory_order_acquire);
+                    });
+                    continue;
+                }
+                LineBlock* block = take(worker);
+                for(unsigned i = 1; !block && i < numWorkers_; ++i) {
+                    block = take((worker + i) % numWorkers_);
+                    if(block) {
+                        stolen_.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+                if(block) {
+                    return block;
+                }
+                if(finished_.load(std::memory_order_acquire) && queued_.load(std::memory_order_acquire) == 0) {
+                    return nullptr;
+                }
+                notEmpty_.wait([&]() {
+                    return queued_.load(std::memory_order_acquire) != 0 || finished_.load(std::memory_order_acquire);
+                });
+            }
+        }
+
+        /// The number of blocks taken from a deque other than the taker's own.
+        std::uint64_t stolen() const { return stolen_.load(std::memory_order_relaxed); }
+
+    private:
+        struct alignas(64) Deque {
+            std::mutex m;
+            std::deque<LineBlock*> blocks;
+        };
+
+        LineBlock* take(const unsigned worker)
+        {
+            LineBlock* block = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(deques_[worker].m);
+                std::deque<LineBlock*>& blocks = deques_[worker].blocks;
+                if(blocks.empty()) {
+                    return nullptr;
+                }
+                block = blocks.front();
+                blocks.pop_front();
+            }
+            queued_.fetch_sub(1, std::memory_order_release);
+            notFull_.notify();
+            return block;
+        }
+
+        const unsigned numWorkers_;
+        std::unique_ptr<Deque[]> deques_;
+        std::atomic<std::size_t> queued_ {0};
+        std::atomic<unsigned> active_;
+        std::atomic<bool> finished_ {false};
+        std::atomic<bool> cancelled_ {false};
+        std::atomic<std::uint64_t> stolen_ {0};
+        Parker notEmpty_;
+        Parker notFull_;
+    };
+
+    /**
+     * Works out where each block's formatted lines go in an output file, so workers
+     * can pwrite() them there themselves instead of funnelling them all through the
+     * writer thread.
+     * A block's offset is the running total of the output of every block before it.
+     * Whichever worker finishes the next block in line adds it to the total, along
+     * with any later blocks that finished before it, and writes them all.
+     */
+    class OutputPlacer
+    {
+    public:
+        /// @param start The offset in the file of the first block's output.
+        OutputPlacer(const int fd, const std::uint64_t start, const bool lineNumbers) : fd(fd), end_(start), lineNumbers_(lineNumbers) {}
+
+        /**
+         * Hand over a block, getting back the blocks whose offsets are now known.
+         * A block whose line numbers weren't known when it was searched is formatted
+         * here, once they are.
+         * @param outPlaced A buffer for blocks with their outputOffset set, in order.
+         * Contents will be overwritten not appended-to.
+         */
+        void place(LineBlock* const block, std::vector<LineBlock*>& outPlaced)
+        {
+            outPlaced.clear();
+            std::lock_guard<std::mutex> lock(m_);
+            // The reader waits for the writer's window, which is never ahead of this one, so the block fits:
+            pending_.insert(block, block->sequence);
+            while(LineBlock* const next = pending_.pop())
+            {
+                if(!next->linesFormatted) {
+                    formatMatches(*next, lineNumbers_);
+                    next->linesFormatted = true;
+                }
+                next->outputOffset = end_;
+                end_ += next->formatted.size();
+                outPlaced.push_back(next);
+            }
+        }
+
+        /// The end of the output so far. Only meaningful once the workers have quit.
+        std::uint64_t end() const { return end_; }
+
+        const int fd;
+
+    private:
+        std::mutex m_;
+        ReorderWindow<LineBlock> pending_ {REORDER_WINDOW_BLOCKS};
+        std::uint64_t end_;
+        const bool lineNumbers_;
+    };
+
+    /**
+     * Numbers the lines of blocks split by the workers rather than the reader.
+     * A block's first line is one past the last line of the block before it, a
+     * prefix sum of the lines in every earlier block, so it is known once they have
+     * all been split. As OutputPlacer does for offsets, whichever worker splits the
+     * next block in line numbers it, along with any later blocks split before it.
+     * Splitting comes before searching, so the blocks before one have nearly always
+     * been numbered by the time it is searched and formatted.
+     */
+    class LineNumberer
+    {
+    public:
+        /// Hand over a block split into lines, numbering it and any blocks waiting for it.
+        void count(LineBlock* const block)
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            // Blocks are counted before they reach the writer, so this window is never behind its one:
+            pending_.insert(block, block->sequence);
+            while(LineBlock* const next = pending_.pop())
+            {
+                next->firstLine = nextLine_;
+                nextLine_ += next->numLines();
+                next->numbered.store(true, std::memory_order_release);
+            }
+        }
+
+    private:
+        std::mutex m_;
+        ReorderWindow<LineBlock> pending_ {REORDER_WINDOW_BLOCKS};
+        LineNumber nextLine_ = 1;
+    };
+
+    template<typename MatcherT>
+    class GrepThreadState
+    {
+    public:
+        GrepThreadState(const MatcherT& matcher, WorkStealingQueues& input, ResultBlockQueue& results, unsigned workerId, const Options& options, OutputPlacer* placer, LineNumberer* numberer) :
+            matcher(matcher), input(input), results(results), workerId(workerId),
+            outputLineNumbers(options.lineNumbers),
+            formatLines(options.mode == OutputMode::Lines && !hasContext(options)),
+            stopAtFirstMatch(matchLimit(options) == 1 && options.mode != OutputMode::Lines),
+            placer(placer),
+            numberer(numberer),
+            cache(options.lineCacheEntries)
+        {}
+        // Each worker's own copy, sharing the compiled pattern:
+        MatcherT matcher;
+        // Shared by all the workers:
+        WorkStealingQueues& input;
+        // Wired up to the output thread for in-order retirement:
+        ResultBlockQueue& results;
+        unsigned workerId = 0;
+        // whether to prefix lines with line numbers:
+        bool outputLineNumbers = false;
+        // The other modes, and the writer when it adds context lines, need the lines flagged but not formatted:
+        bool formatLines = true;
+        // Set if any match answers the search, so the worker finding it can stop the rest:
+        bool stopAtFirstMatch = false;
+        // Set if the workers write their blocks to the output file themselves:
+        OutputPlacer* placer = nullptr;
+        // Set if the output needs line numbers:
+        LineNumberer* numberer = nullptr;
+        // This worker's memory of lines already searched:
+        LineCache cache;
+    };
+
+    /**
+     * Flag each line of a block as matching or not, returning how many match.
+     * Where the matcher can, it skips straight over runs of lines which can't match
+     * in one scan of the block's text. Lines it does look at go through the cache.
+     */
+    template<typename MatcherT>
+    std::size_t grepBlock(LineBlock& block, MatcherT& matcher, LineCache& cache)
+    {
+        std::size_t matches = 0;
+        const std::size_t numLines = block.numLines();
+        block.matched.assign(numLines, 0);
+        const char* const text = block.text.data();
+        std::size_t i = 0;
+        while(i < numLines)
+        {
+            if(matcher.canSkip())
+            {
+                const char* const candidate = matcher.nextCandidate(block.lineBegin(i), text + block.text.size());
+                // Find the line the candidate is in:
+                const auto next = std::upper_bound(block.offsets.begin() + i + 1, block.offsets.end(), std::size_t(candidate - text));
+                i = (next - block.offsets.begin()) - 1;
+                if(i >= numLines) {
+                    break;
+                }
+            }
+            const char* const begin = block.lineBegin(i);
+            const char* const end = block.lineEnd(i);
+            block.matched[i] = cache.search(matcher, begin, end);
+            matches += block.matched[i];
+            ++i;
+        }
+        return matches;
+    }
+
+    template<typename MatcherT>
+    void grepThreadFunc(GrepThreadState<MatcherT>* state)
+    {
+        if constexpr (LOGGING_DIAGNOSTIC_ON) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cerr << "Starting a Grep Thread " << state->workerId << " with state pointer: " << (std::uint64_t) state << std::endl;
+        }
+        MatcherT& matcher = state->matcher;
+        WorkStealingQueues& input = state->input;
+        ResultBlockQueue& results = state->results;
+        OutputPlacer* const placer = state->placer;
+        LineNumberer* const numberer = state->numberer;
+        std::vector<LineBlock*> placed;
+
+        while(LineBlock* block = input.pop(state->workerId))
+        {
+            // Every block is counted, even one which won't be searched, so later ones still get numbered:
+            block->splitLines();
+            if(numberer) {
+                numberer->count(block);
+            }
+            // Once the answer is known, blocks still queued only go to the writer to be recycled:
+            if(!input.cancelled())
+            {
+                block->matchCount = grepBlock(*block, matcher, state->cache);
+                if(state->formatLines) {
+                    // Otherwise whoever retires the block formats it, once its lines are numbered:
+                    if(!numberer || block->numbered.load(std::memory_order_acquire)) {
+                        formatMatches(*block, state->outputLineNumbers);
+                        block->linesFormatted = true;
+                    }
+                } else if(state->stopAtFirstMatch && block->matchCount > 0) {
+                    input.cancel();
+                }
+            }
+            if(!placer) {
+                results.push(block);
+                continue;
+            }
+            placer->place(block, placed);
+            for(LineBlock* placedBlock : placed)
+            {
+                writeAt(placer->fd, placedBlock->formatted, placedBlock->outputOffset);
+                // The writer still retires it, to recycle it in order:
+                results.push(placedBlock);
+            }
+        }
+        if constexpr(LOGGING_DIAGNOSTIC_ON){
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cerr << "Grep Thread # " << state->workerId << " quiting." << std::endl;
+        }
+    }
+
+    class BlockWriterThreadState
+    {
+    public:
+        BlockWriterThreadState(std::ostream& output, RecycleBlockQueue& recycler, WorkStealingQueues& queues, const Options& options, bool writtenByWorkers = false) :
+            output(output),
+            recycler(recycler),
+            queues(queues),
+            options(options),
+            writtenByWorkers(writtenByWorkers)
+        {}
+        // Blocks to be reordered into original order and have their matching lines output:
+        ResultBlockQueue input {RESULT_QUEUE_BLOCKS};
+        // Where the writer puts blocks back in order, and the reader waits for it to catch up:
+        ReorderWindow<LineBlock> window {REORDER_WINDOW_BLOCKS};
+        // A text stream to write to:
+        std::ostream& output;
+        // Wired up to the main thread to reuse for future blocks:
+        RecycleBlockQueue& recycler;
+        // To cancel the search once the writer has its answer:
+        WorkStealingQueues& queues;
+        // What to output:
+        const Options& options;
+        // Set if the workers have already written out the blocks' lines:
+        bool writtenByWorkers = false;
+        // The number of matching lines found, to be read once the writer has quit:
+        std::uint64_t matches = 0;
+        // Stats kept by the writer thread, to be read once it has quit:
+        std::size_t maxReorderBlocks = 0;
+        std::vector<double> latenciesMs;
+    };
+
+    void blockWriterThreadFunc(BlockWriterThreadState* state);
+
+    // See pargrep.h
+    template<typename MatcherT>
+    if_matcher<MatcherT> pargrep_stream_par2(std::istream& input, MatcherT matcher, std::ostream& output, const Options& options)
+    {
+        logEngine(matcher);
+        const std::size_t blockBytes = options.blockBytes;
+
+        // Adaptive blocks start small so short inputs reach workers quickly, then grow
+        // to amortise synchronisation once it is clear there is a lot of input:
+        constexpr std::size_t MIN_BLOCK_BYTES = 4 * 1024;
+        constexpr std::size_t MAX_BLOCK_BYTES = 256 * 1024;
+        const bool adaptiveBlocks = blockBytes == 0;
+        std::size_t targetBlockBytes = adaptiveBlocks ? MIN_BLOCK_BYTES : blockBytes;
+
+        // Worker threads:
+        const unsigned hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+        const bool adaptiveWorkers = options.adaptiveWorkers;
+        const unsigned numThreads = options.workers == 0 ? hardwareThreads :
+                                    adaptiveWorkers ? std::max(options.workers, hardwareThreads) : options.workers;
+        // The workers being dealt blocks, which adaptive mode varies up to numThreads:
+        unsigned activeWorkers = options.workers == 0 ? numThreads : options.workers;
+        unsigned peakWorkers = activeWorkers;
+        if constexpr(LOGGING_DIAGNOSTIC_ON)
+        {
+            std::lock_guard<std::mutex> l(outputMutex);
+            std::cerr << "Hardware concurrency: " << hardwareThreads << ", workers: " << activeWorkers << " of " << numThreads << std::endl;
+        }
+        auto launch = [&options](std::function<void()> task) { return launchTask(options, std::move(task)); };
+        // Thread states are pointed-to to avoid false sharing of cachelines.
+        std::vector<std::future<void>> workers;
+        workers.reserve(numThreads);
+        std::vector<std::unique_ptr<GrepThreadState<MatcherT>>> taskStates;
+        taskStates.reserve(numThreads);
+        WorkStealingQueues queues(numThreads);
+        queues.setActive(activeWorkers);
+        // Adaptive mode looks at the backlog of blocks over a few blocks at a time:
+        constexpr unsigned ADAPT_INTERVAL_BLOCKS = 16;
+        unsigned blocksSinceAdapting = 0;
+        std::size_t backlog = 0;
+
+        // Workers write straight to a regular file if asked to:
+        std::unique_ptr<OutputPlacer> placer;
+        std::uint64_t outputStart = 0;
+        const bool placeable = options.parallelWrite && options.mode == OutputMode::Lines && options.maxCount == 0 && !hasContext(options);
+        const int outputFd = placeable ? positionalOutput(output, outputStart) : -1;
+        if(outputFd >= 0) {
+            placer.reset(new OutputPlacer(outputFd, outputStart, options.lineNumbers));
+        }
+        // Lines are only numbered if the output needs it:
+        std::unique_ptr<LineNumberer> numberer;
+        if(options.mode == OutputMode::Lines && (options.lineNumbers || hasContext(options))) {
+            numberer.reset(new LineNumberer());
+        }
+
+        // Writer thread:
+        // Returned blocks after output by writer thread:
+        RecycleBlockQueue recycled {RECYCLE_QUEUE_BLOCKS};
+        std::vector<LineBlock*> recycledBuffer;
+        // Only the reader thread touches the budget:
+        MemoryBudget budget(options.memoryBudget);
+        BlockWriterThreadState writerState {
+                output,
+                recycled,
+                queues,
+                options,
+                bool(placer)
+        };
+        std::future<void> writerThread = launch([&writerState]() { blockWriterThreadFunc(&writerState); });
+
+        std::default_random_engine generator;
+
+        LineNumber sequence = 0;
+        LineReader reader(input, options.lineBuffered);
+
+        ///@ToDo Lower priority of current thread so background threads starve it from generating new work as long as there is existing work to do in background.
+
+        while(true)
+        {
+            ++sequence;
+            writerState.window.waitForRoom(sequence);
+
+            // Get a block:
+            LineBlock* block = nullptr;
+            if (recycledBuffer.empty()) {
+                recycled.tryPopAll(recycledBuffer);
+            }
+            // Once the budget is spent, wait for the writer to give a block back:
+            if (recycledBuffer.empty() && budget.exhausted()) {
+                recycled.popAll(recycledBuffer);
+            }
+            if (recycledBuffer.empty()) {
+                block = createBlock(sequence);
+            } else {
+                block = recycledBuffer.back();
+                recycledBuffer.resize(recycledBuffer.size() - 1);
+            }
+            block->reset(sequence);
+
+            // Fill it with whole lines, unless the search already has its answer, leaving the workers to split and count them:
+            if(!queues.cancelled()) {
+                reader.nextLines(block->text, targetBlockBytes);
+            }
+            if(adaptiveBlocks) {
+                targetBlockBytes = std::min(MAX_BLOCK_BYTES, targetBlockBytes * 2);
+            }
+            budget.charge(block->charged, block->bytes());
+
+            if(block->text.empty()) {
+                // Nothing left so this block becomes the in-order end marker for the writer:
+                block->endOfLines = true;
+                writerState.input.push(block);
+                break;
+            }
+
+            // A backlog bigger than the number of workers means they are falling behind
+            // the reader so add one, while none at all means some are idle so retire one:
+            if(adaptiveWorkers)
+            {
+                backlog += queues.queued();
+                if(++blocksSinceAdapting == ADAPT_INTERVAL_BLOCKS)
+                {
+                    if(backlog > activeWorkers * ADAPT_INTERVAL_BLOCKS && activeWorkers < numThreads) {
+                        ++activeWorkers;
+                    } else if(backlog == 0 && activeWorkers > 1) {
+                        --activeWorkers;
+                    }
+                    queues.setActive(activeWorkers);
+                    peakWorkers = std::max(peakWorkers, activeWorkers);
+                    blocksSinceAdapting = 0;
+                    backlog = 0;
+                }
+            }
+
+            unsigned threadIndex = 0;
+            // Build a background thread on demand to optimise for short inputs:
+            if(workers.size() < activeWorkers)
+            {
+                threadIndex = workers.size();
+                taskStates.emplace_back(new GrepThreadState<MatcherT>(matcher, queues, writerState.input, threadIndex, options, placer.get(), numberer.get()));
+                GrepThreadState<MatcherT>* const taskState = taskStates.back().get();
+                workers.push_back(launch([taskState]() { grepThreadFunc<MatcherT>(taskState); }));
+            }
+            // Pick an existing thread to send the block to at random to avoid repeating patterns in input causing asymetric thread workloads.
+            // Any skew that remains is evened out by idle workers stealing blocks:
+            else
+            {
+                threadIndex = std::uniform_int_distribution<unsigned>(0, activeWorkers - 1)(generator);
+            }
+
+            block->dispatched = std::chrono::steady_clock::now();
+            queues.push(threadIndex, block);
+        }
+
+        // Tell worker threads to stop:
+        queues.finish();
+
+        // Wait for all background work to quit:
+        writerThread.get();
+        ///@ToDo: can do an immediate exit here assuming writer won't quit until all work from worker threads is output.
+        for(auto& worker : workers)
+        {
+            worker.get();
+        }
+        if(placer) {
+            endPositionalOutput(placer->fd, placer->end());
+        }
+        // Blocks are big so give them back rather than leaving them for process exit:
+        for(auto block : recycledBuffer)
+        {
+            delete block;
+        }
+        recycled.tryPopAll(recycledBuffer);
+        for(auto block : recycledBuffer)
+        {
+            delete block;
+        }
+
+        PipelineStats stats;
+        stats.maxReorderBlocks = writerState.maxReorderBlocks;
+        stats.peakBytes = budget.peak();
+        stats.blocksStolen = queues.stolen();
+        stats.peakWorkers = peakWorkers;
+        for(const auto& taskState : taskStates) {
+            stats.lineCacheLookups += taskState->cache.lookups();
+            stats.lineCacheHits += taskState->cache.hits();
+        }
+        std::vector<double>& latencies = writerState.latenciesMs;
+        if(!latencies.empty())
+        {
+            std::sort(latencies.begin(), latencies.end());
+            stats.medianBlockLatencyMs = latencies[latencies.size() / 2];
+            stats.p99BlockLatencyMs = latencies[latencies.size() * 99 / 100];
+            stats.maxBlockLatencyMs = latencies.back();
+        }
+        if constexpr(LOGGING_DIAGNOSTIC_ON)
+        {
+            std::lock_guard<std::mutex> l(outputMutex);
+            std::cerr << "Blocks: " << latencies.size() << ", peak bytes: " << stats.peakBytes << ", stolen: " << stats.blocksStolen
+                      << ", peak workers: " << stats.peakWorkers
+                      << ", line cache hits: " << stats.lineCacheHits << " of " << stats.lineCacheLookups
+                      << ", max reorder depth: " << stats.maxReorderBlocks
+                      << ", latency ms median / p99 / max: " << stats.medianBlockLatencyMs
+                      << " / " << stats.p99BlockLatencyMs << " / " << stats.maxBlockLatencyMs << std::endl;
+        }
+        if(options.stats) {
+            *options.stats = stats;
+        }
+        return capMatches(writerState.matches, matchLimit(options));
+    }
+
+    /**
+     * Gives back text already read from a stream, then carries on with the rest of
+     * the stream, so lines read ahead to decide how to search an input can be
+     * searched along with the rest of it.
+     */
+    class ReplayStreambuf : public std::streambuf
+    {
+    public:
+        /// @param rest The buffer of the stream the head was read from.
+        ReplayStreambuf(std::string head, std::streambuf* const rest) :
+            head_(std::move(head)),
+            rest_(rest),
+            buffer_(64 * 1024)
+        {
+            setg(head_.data(), head_.data(), head_.data() + head_.size());
+        }
+
+    protected:
+        int_type underflow() override
+        {
+            if(gptr() < egptr()) {
+                return traits_type::to_int_type(*gptr());
+            }
+            const std::streamsize got = rest_->sgetn(buffer_.data(), buffer_.size());
+            if(got <= 0) {
+                return traits_type::eof();
+            }
+            setg(buffer_.data(), buffer_.data(), buffer_.data() + got);
+            return traits_type::to_int_type(*gptr());
+        }
+
+    private:
+        std::string head_;
+        std::streambuf* const rest_;
+        std::vector<char> buffer_;
+    };
+
+    // How much of the input pargrep_auto() reads ahead to time the pattern on:
+    constexpr std::size_t AUTO_SAMPLE_BYTES = 64 * 1024;
+    // Inputs estimated to take less than this to search aren't worth starting threads for:
+    constexpr double AUTO_SERIAL_BELOW_MS = 5.0;
+
+    // See pargrep.h
+    template<typename MatcherT>
+    if_matcher<MatcherT> pargrep_auto(std::istream& input, MatcherT matcher, std::ostream& output, const Options& options)
+    {
+        using Clock = std::chrono::steady_clock;
+        using Ms = std::chrono::duration<double, std::milli>;
+
+        // What is left of the input, if it can be found without reading it:
+        std::streamoff remaining = -1;
+        const std::streampos start = input.tellg();
+        if(start != std::streampos(-1))
+        {
+            input.seekg(0, std::ios_base::end);
+            const std::streampos end = input.tellg();
+            if(end != std::streampos(-1)) {
+                remaining = end - start;
+            }
+            input.clear();
+            input.seekg(start);
+        }
+
+        // Read some lines, timing the reading, then time the pattern on them:
+        std::vector<std::string> sample;
+        std::string head;
+        const Clock::time_point readStart = Clock::now();
+        std::string line;
+        while(head.size() < AUTO_SAMPLE_BYTES && std::getline(input, line))
+        {
+            head.append(line);
+            if(!input.eof()) {
+                head.push_back('\n');
+            }
+            sample.push_back(std::move(line));
+        }
+        const bool wholeInput = !input;
+        const Clock::time_point readEnd = Clock::now();
+        std::size_t sampleMatches = 0;
+        for(const std::string& sampled : sample) {
+            sampleMatches += matcher.search(sampled);
+        }
+        const Ms readMs = readEnd - readStart;
+        const Ms matchMs = Clock::now() - readEnd;
+        const double sampleBytes = std::max<double>(1, head.size());
+        const double estimatedMs = wholeInput ? matchMs.count() :
+                                   remaining < 0 ? HUGE_VAL : matchMs.count() * double(remaining) / sampleBytes;
+        // Workers to match as fast as one thread reads:
+        const unsigned hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+        const double neededWorkers = std::ceil(matchMs.count() / std::max(readMs.count(), 1e-6));
+        const unsigned workers = unsigned(std::min<double>(hardwareThreads, std::max(1.0, neededWorkers)));
+
+        // The failure flags were set at the end of the sample:
+        input.clear();
+        ReplayStreambuf replayBuffer(std::move(head), input.rdbuf());
+        std::istream replay(&replayBuffer);
+
+        const bool serial = estimatedMs < AUTO_SERIAL_BELOW_MS;
+        if constexpr(LOGGING_DIAGNOSTIC_ON)
+        {
+            std::lock_guard<std::mutex> l(outputMutex);
+            std::cerr << "Sampled " << sample.size() << " lines, " << sampleMatches << " matching: read " << readMs.count() << " ms, matched " << matchMs.count()
+                      << " ms, estimated " << estimatedMs << " ms in all. Chose " << (serial ? "serial" : "many thread")
+                      << " with " << (serial ? 1u : workers) << " workers." << std::endl;
+        }
+        if(serial)
+        {
+            if(options.stats) {
+                *options.stats = PipelineStats();
+            }
+            return grep_stream(replay, matcher, output, options);
+        }
+        Options parallelOptions = options;
+        parallelOptions.workers = workers;
+        parallelOptions.adaptiveWorkers = true;
+        return pargrep_stream_par2(replay, matcher, output, parallelOptions);
+    }
+}
+
+#endif //PARGREP_PIPELINE_H
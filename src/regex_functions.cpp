@@ -17,4 +17,27 @@ namespace pargrep {
         const bool found = std::regex_search(s, e);
         return found;
     }
-}
\ No newline at end of file
+
+    bool
+    search(const char* first, const char* last,
+                 const regex &e,
+                 regex_constants::match_flag_type flags)
+    {
+        const bool found = std::regex_search(first, last, e, flags);
+        return found;
+    }
+
+    bool
+    search(const char* first, const char* last, LazyDfa& dfa)
+    {
+        const bool found = dfa.search(first, last);
+        return found;
+    }
+
+    bool
+    search(const char* first, const char* last, const BitParallelMatcher& nfa)
+    {
+        const bool found = nfa.search(first, last);
+        return found;
+    }
+}
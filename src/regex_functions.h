@@ -7,6 +7,8 @@
 #ifndef PARGREP_REGEX_FUNCTIONS_H
 #define PARGREP_REGEX_FUNCTIONS_H
 
+#include "lazy_dfa.h"
+#include "bit_parallel.h"
 #include <regex>
 #include <string>
 
@@ -15,5 +17,24 @@ namespace pargrep {
 bool search(const std::string& s,
              const std::regex& e,
              std::regex_constants::match_flag_type flags = std::regex_constants::match_default);
+
+/**
+ * Search a line held in a range of characters, such as part of a memory-mapped
+ * file, without copying it into a std::string first.
+ * The range should not include the line's terminating newline.
+ */
+bool search(const char* first, const char* last,
+             const std::regex& e,
+             std::regex_constants::match_flag_type flags = std::regex_constants::match_default);
+
+/**
+ * Search a line with the lazy DFA engine.
+ */
+bool search(const char* first, const char* last, LazyDfa& dfa);
+
+/**
+ * Search a line with the bit-parallel NFA engine.
+ */
+bool search(const char* first, const char* last, const BitParallelMatcher& nfa);
 }
 #endif //PARGREP_REGEX_FUNCTIONS_H
@@ -0,0 +1,349 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "regex_syntax.h"
+#include <algorithm>
+#include <cctype>
+
+namespace pargrep::regex_syntax {
+    using std::string;
+    using std::vector;
+    using std::uint32_t;
+    using std::bitset;
+
+    namespace {
+        constexpr unsigned MAX_REPEAT = 1000;
+
+        /**
+         * Recursive descent parser for the supported subset of ECMAScript regex.
+         * Anything outside the subset just clears ok.
+         */
+        class Parser
+        {
+        public:
+            Parser(const string& pattern, vector<bitset<256>>& sets) : p_(pattern), sets_(sets) {}
+
+            bool parse(Node& root)
+            {
+                root = parseAlternation();
+                return ok_ && i_ == p_.size();
+            }
+
+        private:
+            Node parseAlternation()
+            {
+                Node first = parseConcatenation();
+                if(!more() || p_[i_] != '|') {
+                    return first;
+                }
+                Node alt;
+                alt.kind = Node::Alt;
+                alt.children.push_back(std::move(first));
+                while(ok_ && more() && p_[i_] == '|') {
+                    ++i_;
+                    alt.children.push_back(parseConcatenation());
+                }
+                return alt;
+            }
+
+            Node parseConcatenation()
+            {
+                Node concat;
+                concat.kind = Node::Concat;
+                while(ok_ && more() && p_[i_] != '|' && p_[i_] != ')') {
+                    concat.children.push_back(parseRepeat());
+                }
+                return concat;
+            }
+
+            Node parseRepeat()
+            {
+                Node atom = parseAtom();
+                if(!ok_ || !more()) {
+                    return atom;
+                }
+                int min = 1, max = 1;
+                const char c = p_[i_];
+                if(c == '*') { min = 0; max = UNBOUNDED; ++i_; }
+                else if(c == '+') { min = 1; max = UNBOUNDED; ++i_; }
+                else if(c == '?') { min = 0; max = 1; ++i_; }
+                else if(c == '{') {
+                    ++i_;
+                    if(!parseCount(min)) { return fail(); }
+                    max = min;
+                    if(more() && p_[i_] == ',') {
+                        ++i_;
+                        max = UNBOUNDED;
+                        if(more() && std::isdigit((unsigned char) p_[i_]) && (!parseCount(max) || max < min)) {
+                            return fail();
+                        }
+                    }
+                    if(!more() || p_[i_] != '}') { return fail(); }
+                    ++i_;
+                } else {
+                    return atom;
+                }
+                // Laziness changes which match is found, not whether there is one:
+                if(more() && p_[i_] == '?') {
+                    ++i_;
+                }
+                if(atom.kind == Node::Begin || atom.kind == Node::End ||
+                   (more() && (p_[i_] == '*' || p_[i_] == '+' || p_[i_] == '?' || p_[i_] == '{'))) {
+                    return fail();
+                }
+                Node repeat;
+                repeat.kind = Node::Repeat;
+                repeat.min = min;
+                repeat.max = max;
+                repeat.children.push_back(std::move(atom));
+                return repeat;
+            }
+
+            bool parseCount(int& count)
+            {
+                if(!more() || !std::isdigit((unsigned char) p_[i_])) {
+                    return false;
+                }
+                unsigned value = 0;
+                while(more() && std::isdigit((unsigned char) p_[i_])) {
+                    value = value * 10 + (p_[i_++] - '0');
+                    if(value > MAX_REPEAT) {
+                        return false;
+                    }
+                }
+                count = int(value);
+                return true;
+            }
+
+            Node parseAtom()
+            {
+                const char c = p_[i_++];
+                switch(c)
+                {
+                    case '(': {
+                        if(more() && p_[i_] == '?') {
+                            // Only non-capturing groups, not lookahead:
+                            if(i_ + 1 >= p_.size() || p_[i_ + 1] != ':') { return fail(); }
+                            i_ += 2;
+                        }
+                        Node group = parseAlternation();
+                        if(!more() || p_[i_] != ')') { return fail(); }
+                        ++i_;
+                        return group;
+                    }
+                    case '[': return parseClass();
+                    case '.': {
+                        bitset<256> any;
+                        any.set();
+                        any.reset('\n');
+                        any.reset('\r');
+                        return setNode(any);
+                    }
+                    case '^': { Node n; n.kind = Node::Begin; return n; }
+                    case '$': { Node n; n.kind = Node::End; return n; }
+                    case '*': case '+': case '?': case '{': case ')': case '|':
+                        return fail();
+                    case '\\': {
+                        bitset<256> set;
+                        if(!parseEscape(set, false)) { return fail(); }
+                        return setNode(set);
+                    }
+                    default: {
+                        bitset<256> one;
+                        one.set((unsigned char) c);
+                        return setNode(one);
+                    }
+                }
+            }
+
+            /**
+             * Parse the escape after a backslash into a set of bytes.
+             * @param inClass Inside brackets, where \b means backspace.
+             * @param single[out] If not null, set to whether it was a single character.
+             */
+            bool parseEscape(bitset<256>& set, const bool inClass, bool* single = nullptr)
+            {
+                if(!more()) {
+                    return false;
+                }
+                const char e = p_[i_++];
+                bool isSingle = true;
+                switch(e)
+                {
+                    case 'd': case 'D': addClass(set, "digit", e == 'D'); isSingle = false; break;
+                    case 'w': case 'W': addClass(set, "w", e == 'W'); isSingle = false; break;
+                    case 's': case 'S': addClass(set, "space", e == 'S'); isSingle = false; break;
+                    case 'n': set.set('\n'); break;
+                    case 't': set.set('\t'); break;
+                    case 'r': set.set('\r'); break;
+                    case 'f': set.set('\f'); break;
+                    case 'v': set.set('\v'); break;
+                    case 'b':
+                        if(!inClass) { return false; }
+                        set.set('\b');
+                        break;
+                    default:
+                        // Backreferences, \B, \x, \u, \c, ...:
+                        if(std::isalnum((unsigned char) e)) {
+                            return false;
+                        }
+                        set.set((unsigned char) e);
+                }
+                if(single) {
+                    *single = isSingle;
+                }
+                return true;
+            }
+
+            static bool addClass(bitset<256>& set, const string& name, const bool negate)
+            {
+                int (*test)(int) = nullptr;
+                if(name == "alnum") test = isalnum;
+                else if(name == "alpha") test = isalpha;
+                else if(name == "blank") test = isblank;
+                else if(name == "cntrl") test = iscntrl;
+                else if(name == "digit" || name == "d") test = isdigit;
+                else if(name == "graph") test = isgraph;
+                else if(name == "lower") test = islower;
+                else if(name == "print") test = isprint;
+                else if(name == "punct") test = ispunct;
+                else if(name == "space" || name == "s") test = isspace;
+                else if(name == "upper") test = isupper;
+                else if(name == "xdigit") test = isxdigit;
+                else if(name != "w") return false;
+                for(unsigned b = 0; b < 128; ++b)
+                {
+                    const bool in = test ? test(int(b)) != 0 : (std::isalnum(int(b)) || b == '_');
+                    if(in != negate) {
+                        set.set(b);
+                    }
+                }
+                if(negate) {
+                    for(unsigned b = 128; b < 256; ++b) {
+                        set.set(b);
+                    }
+                }
+                return true;
+            }
+
+            Node parseClass()
+            {
+                bitset<256> set;
+                bool negate = false;
+                if(more() && p_[i_] == '^') {
+                    negate = true;
+                    ++i_;
+                }
+                // ECMAScript's empty classes "[]" and "[^]" aren't worth supporting:
+                if(more() && p_[i_] == ']') {
+                    return fail();
+                }
+                while(ok_ && more() && p_[i_] != ']')
+                {
+                    unsigned char lo = 0;
+                    if(!classCharacter(set, lo)) {
+                        // A class such as \d or [:digit:] which can't start a range:
+                        if(more() && p_[i_] == '-' && i_ + 1 < p_.size() && p_[i_ + 1] != ']') {
+                            return fail();
+                        }
+                        continue;
+                    }
+                    if(more() && p_[i_] == '-' && i_ + 1 < p_.size() && p_[i_ + 1] != ']')
+                    {
+                        ++i_;
+                        bitset<256> unused;
+                        unsigned char hi = 0;
+                        if(!classCharacter(unused, hi) || hi < lo || hi >= 128) {
+                            return fail();
+                        }
+                        for(unsigned b = lo; b <= hi; ++b) {
+                            set.set(b);
+                        }
+                    } else {
+                        set.set(lo);
+                    }
+                }
+                if(!ok_ || !more()) {
+                    return fail();
+                }
+                ++i_;
+                if(negate) {
+                    set.flip();
+                }
+                return setNode(set);
+            }
+
+            /**
+             * Parse one item of a bracketed class.
+             * @return True if it was a single character, returned in c, else its members have been added to set.
+             */
+            bool classCharacter(bitset<256>& set, unsigned char& c)
+            {
+                const char first = p_[i_++];
+                if(first == '[' && more() && (p_[i_] == ':' || p_[i_] == '.' || p_[i_] == '='))
+                {
+                    const char kind = p_[i_];
+                    const size_t close = p_.find(string{kind, ']'}, i_ + 1);
+                    if(kind != ':' || close == string::npos || !addClass(set, p_.substr(i_ + 1, close - i_ - 1), false)) {
+                        fail();
+                        return false;
+                    }
+                    i_ = close + 2;
+                    return false;
+                }
+                if(first == '\\')
+                {
+                    bitset<256> escaped;
+                    bool single = false;
+                    if(!parseEscape(escaped, true, &single)) {
+                        fail();
+                        return false;
+                    }
+                    if(!single) {
+                        set |= escaped;
+                        return false;
+                    }
+                    for(unsigned b = 0; b < 256; ++b) {
+                        if(escaped[b]) { c = (unsigned char) b; }
+                    }
+                    return true;
+                }
+                c = (unsigned char) first;
+                return true;
+            }
+
+            Node setNode(const bitset<256>& set)
+            {
+                Node n;
+                n.kind = Node::Set;
+                const auto existing = std::find(sets_.begin(), sets_.end(), set);
+                n.set = uint32_t(existing - sets_.begin());
+                if(existing == sets_.end()) {
+                    sets_.push_back(set);
+                }
+                return n;
+            }
+
+            Node fail()
+            {
+                ok_ = false;
+                return Node();
+            }
+
+            bool more() const { return i_ < p_.size(); }
+
+            const string& p_;
+            vector<bitset<256>>& sets_;
+            size_t i_ = 0;
+            bool ok_ = true;
+        };
+    }
+
+    bool parse(const string& pattern, Node& root, vector<bitset<256>>& sets)
+    {
+        Parser parser(pattern, sets);
+        return parser.parse(root);
+    }
+}
@@ -0,0 +1,47 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// Parsing of the subset of ECMAScript regex compiled by pargrep's own engines.
+//
+#ifndef PARGREP_REGEX_SYNTAX_H
+#define PARGREP_REGEX_SYNTAX_H
+
+#include <bitset>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pargrep::regex_syntax {
+
+    constexpr int UNBOUNDED = -1;
+
+    /**
+     * A node of a regex parse tree.
+     * Every character, class, escape and "." becomes a Set, an index into a table
+     * of the sets of bytes they accept.
+     */
+    struct Node {
+        enum Kind { Empty, Set, Concat, Alt, Repeat, Begin, End };
+        Kind kind = Empty;
+        // For Set nodes:
+        std::uint32_t set = 0;
+        // For Repeat nodes, with max UNBOUNDED for "*" and "+":
+        int min = 0;
+        int max = 0;
+        std::vector<Node> children;
+    };
+
+    /**
+     * Parse a pattern if it only uses supported features: literals, ".", bracket
+     * classes (including POSIX [:name:] classes), \d \w \s and their negations,
+     * groups, alternation, greedy or lazy quantifiers, and ^ / $ anchors.
+     * @param[out] root The parse tree.
+     * @param[out] sets The sets of bytes referred to by the tree's Set nodes.
+     * @return False if the pattern uses anything else (e.g. backreferences,
+     * lookahead, \b) so the caller can fall back to std::regex.
+     */
+    bool parse(const std::string& pattern, Node& root, std::vector<std::bitset<256>>& sets);
+}
+
+#endif //PARGREP_REGEX_SYNTAX_H
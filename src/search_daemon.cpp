@@ -0,0 +1,376 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "search_daemon.h"
+#include "command_line.h"
+#include "matcher.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <streambuf>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace pargrep {
+
+    namespace {
+        // Output is sent in frames of up to this many bytes:
+        constexpr std::size_t FRAME_BYTES = 64 * 1024;
+        // In place of a length, marks a frame holding an error message rather than output:
+        constexpr std::uint32_t ERROR_FRAME = 0xFFFFFFFF;
+
+        bool sendAll(const int fd, const char* data, std::size_t size)
+        {
+            while(size > 0)
+            {
+                // A client which has gone mustn't kill the daemon with SIGPIPE:
+                const ssize_t sent = ::send(fd, data, size, MSG_NOSIGNAL);
+                if(sent < 0) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                data += sent;
+                size -= std::size_t(sent);
+            }
+            return true;
+        }
+
+        bool receiveAll(const int fd, char* data, std::size_t size)
+        {
+            while(size > 0)
+            {
+                const ssize_t got = ::recv(fd, data, size, 0);
+                if(got <= 0) {
+                    if(got < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                data += got;
+                size -= std::size_t(got);
+            }
+            return true;
+        }
+
+        /// Fill in the address of a socket, failing if the path is too long for one.
+        bool socketAddress(const std::string& path, sockaddr_un& address)
+        {
+            std::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if(path.size() >= sizeof(address.sun_path)) {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                std::cerr << "pargrep: socket path too long: " << path << std::endl;
+                return false;
+            }
+            std::memcpy(address.sun_path, path.data(), path.size());
+            return true;
+        }
+
+        /**
+         * Sends what is written to it down a socket in frames, each time its buffer
+         * fills or it is flushed.
+         */
+        class FrameBuffer : public std::streambuf
+        {
+        public:
+            explicit FrameBuffer(const int fd) :
+                fd_(fd),
+                buffer_(new char[FRAME_BYTES])
+            {
+                setp(buffer_.get(), buffer_.get() + FRAME_BYTES);
+            }
+
+            /// Send the output so far, then a message for the client's stderr.
+            bool error(const std::string& message)
+            {
+                const std::uint32_t marker = ERROR_FRAME;
+                const std::uint32_t size = std::uint32_t(std::min(message.size(), FRAME_BYTES));
+                return sendFrame() && sendAll(fd_, reinterpret_cast<const char*>(&marker), sizeof(marker)) &&
+                       sendAll(fd_, reinterpret_cast<const char*>(&size), sizeof(size)) && sendAll(fd_, message.data(), size);
+            }
+
+            /// Send the last of the output and the frame ending it.
+            bool finish(const std::uint64_t matches, const std::uint8_t status)
+            {
+                const std::uint32_t end = 0;
+                return sendFrame() && sendAll(fd_, reinterpret_cast<const char*>(&end), sizeof(end)) &&
+                       sendAll(fd_, reinterpret_cast<const char*>(&matches), sizeof(matches)) &&
+                       sendAll(fd_, reinterpret_cast<const char*>(&status), sizeof(status));
+            }
+
+        protected:
+            int_type overflow(const int_type c) override
+            {
+                if(!sendFrame()) {
+                    return traits_type::eof();
+                }
+                if(!traits_type::eq_int_type(c, traits_type::eof())) {
+                    *pptr() = traits_type::to_char_type(c);
+                    pbump(1);
+                }
+                return traits_type::not_eof(c);
+            }
+
+            int sync() override
+            {
+                return sendFrame() ? 0 : -1;
+            }
+
+        private:
+            bool sendFrame()
+            {
+                const std::uint32_t size = std::uint32_t(pptr() - pbase());
+                setp(buffer_.get(), buffer_.get() + FRAME_BYTES);
+                return size == 0 || (sendAll(fd_, reinterpret_cast<const char*>(&size), sizeof(size)) && sendAll(fd_, buffer_.get(), size));
+            }
+
+            const int fd_;
+            std::unique_ptr<char[]> buffer_;
+        };
+    }
+
+    MatcherCache::MatcherCache(const std::size_t capacity) :
+        capacity_(std::max<std::size_t>(capacity, 1))
+    {}
+
+    std::shared_ptr<const Matcher> MatcherCache::get(const std::vector<std::string>& patterns, const Options& options)
+    {
+        // The options which change how patterns compile, then each pattern after its length:
+        std::string key {char(options.fixedStrings), char(options.patternFile)};
+        for(const std::string& pattern : patterns) {
+            key.append(std::to_string(pattern.size()));
+            key.push_back(':');
+            key.append(pattern);
+        }
+        const auto found = byKey_.find(key);
+        if(found != byKey_.end()) {
+            ++hits_;
+            entries_.splice(entries_.begin(), entries_, found->second);
+            return found->second->second;
+        }
+        ++misses_;
+        std::shared_ptr<const Matcher> matcher = std::make_shared<const Matcher>(makeMatcher(patterns, options));
+        if(entries_.size() == capacity_) {
+            byKey_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+        entries_.emplace_front(key, matcher);
+        byKey_.emplace(std::move(key), entries_.begin());
+        return matcher;
+    }
+
+    SearchDaemon::SearchDaemon(const std::string& socketPath, const std::size_t cacheEntries) :
+        // Searches change directory, so the socket is removed by its full path:
+        socketPath_(std::filesystem::absolute(socketPath).string()),
+        cache_(cacheEntries)
+    {}
+
+    SearchDaemon::~SearchDaemon()
+    {
+        if(listener_ >= 0) {
+            ::close(listener_);
+            ::unlink(socketPath_.c_str());
+        }
+    }
+
+    bool SearchDaemon::listen()
+    {
+        sockaddr_un address;
+        if(!socketAddress(socketPath_, address)) {
+            return false;
+        }
+        listener_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if(listener_ < 0) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cerr << "pargrep: unable to create a socket: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        bool bound = ::bind(listener_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+        if(!bound && errno == EADDRINUSE)
+        {
+            // Only take over the path if nothing answers on it:
+            const int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            const bool answered = probe >= 0 && ::connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+            if(probe >= 0) {
+                ::close(probe);
+            }
+            if(answered) {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                std::cerr << "pargrep: a daemon is already serving " << socketPath_ << std::endl;
+                ::close(listener_);
+                listener_ = -1;
+                return false;
+            }
+            ::unlink(socketPath_.c_str());
+            bound = ::bind(listener_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+        }
+        if(!bound || ::listen(listener_, SOMAXCONN) != 0) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cerr << "pargrep: unable to listen on " << socketPath_ << ": " << std::strerror(errno) << std::endl;
+            ::close(listener_);
+            listener_ = -1;
+            return false;
+        }
+        return true;
+    }
+
+    void SearchDaemon::serve()
+    {
+        while(!stopping_.load())
+        {
+            const int connection = ::accept(listener_, nullptr, nullptr);
+            if(connection < 0)
+            {
+                if(errno == EINTR || errno == ECONNABORTED || stopping_.load()) {
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(outputMutex);
+                std::cerr << "pargrep: unable to accept a search: " << std::strerror(errno) << std::endl;
+                return;
+            }
+            handle(connection);
+            ::close(connection);
+        }
+    }
+
+    void SearchDaemon::stop()
+    {
+        stopping_.store(true);
+        // Wakes serve() if it is waiting in accept():
+        ::shutdown(listener_, SHUT_RDWR);
+    }
+
+    void SearchDaemon::handle(const int connection)
+    {
+        // The whole request comes before any of the search:
+        std::string request;
+        char buffer[4096];
+        for(ssize_t got; (got = ::recv(connection, buffer, sizeof(buffer), 0)) != 0;)
+        {
+            if(got < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            request.append(buffer, std::size_t(got));
+        }
+        std::vector<std::string> fields;
+        for(std::size_t begin = 0, end; (end = request.find('\0', begin)) != std::string::npos; begin = end + 1) {
+            fields.emplace_back(request, begin, end - begin);
+        }
+        // Nothing at all is another daemon checking whether this one is running:
+        if(fields.empty()) {
+            return;
+        }
+        FrameBuffer frames(connection);
+        if(::chdir(fields.front().c_str()) != 0) {
+            frames.error("unable to search in " + fields.front());
+            frames.finish(0, 2);
+            return;
+        }
+
+        Command command;
+        std::ostream output(&frames);
+        std::uint64_t matches = 0;
+        bool failed = false;
+        try
+        {
+            command = parseCommandLine(std::vector<std::string>(fields.begin() + 1, fields.end()));
+            command.options.pool = &pool_;
+            const std::vector<std::string> patterns = patternList(command.pattern, command.options);
+            const std::shared_ptr<const Matcher> matcher = cache_.get(patterns, command.options);
+            if constexpr(LOGGING_DIAGNOSTIC_ON) {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                std::cerr << "Compiled pattern cache hits: " << cache_.hits() << ", misses: " << cache_.misses() << ", threads: " << pool_.threads() << std::endl;
+            }
+            matches = runCommand(command, patterns, *matcher, output);
+        }
+        catch(const UnsearchedFiles& e)
+        {
+            // Each file was reported here as it failed, and the client is told which:
+            matches = e.matches();
+            failed = true;
+            frames.error(e.what());
+        }
+        catch(const std::exception& e)
+        {
+            // Such as a bad option or a pattern std::regex won't compile, which would end prep but mustn't end the daemon:
+            failed = true;
+            frames.error(e.what());
+        }
+        output.flush();
+        frames.finish(matches, std::uint8_t(exitStatus(command.options, matches, failed)));
+        // Don't keep the client's directory busy:
+        if(::chdir("/") != 0) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cerr << "pargrep: unable to leave " << fields.front() << std::endl;
+        }
+    }
+
+    int searchOnDaemon(const std::string& socketPath, const std::vector<std::string>& args, std::ostream& output, std::uint64_t& matches)
+    {
+        matches = 0;
+        sockaddr_un address;
+        if(!socketAddress(socketPath, address)) {
+            return 2;
+        }
+        const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0 || ::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cerr << "pargrep: unable to reach a daemon on " << socketPath << ": " << std::strerror(errno) << std::endl;
+            if(fd >= 0) {
+                ::close(fd);
+            }
+            return 2;
+        }
+
+        std::string request = std::filesystem::current_path().string();
+        request.push_back('\0');
+        for(const std::string& arg : args) {
+            request.append(arg);
+            request.push_back('\0');
+        }
+        bool ok = sendAll(fd, request.data(), request.size()) && ::shutdown(fd, SHUT_WR) == 0;
+
+        std::unique_ptr<char[]> buffer(new char[FRAME_BYTES]);
+        std::uint32_t size = 0;
+        std::uint8_t status = 2;
+        while(ok && (ok = receiveAll(fd, reinterpret_cast<char*>(&size), sizeof(size))))
+        {
+            if(size == 0) {
+                ok = receiveAll(fd, reinterpret_cast<char*>(&matches), sizeof(matches)) &&
+                     receiveAll(fd, reinterpret_cast<char*>(&status), sizeof(status));
+                break;
+            }
+            if(size == ERROR_FRAME) {
+                ok = receiveAll(fd, reinterpret_cast<char*>(&size), sizeof(size)) && size <= FRAME_BYTES && receiveAll(fd, buffer.get(), size);
+                if(ok) {
+                    // After the output it followed, as prep would have written them:
+                    output.flush();
+                    std::lock_guard<std::mutex> lock(outputMutex);
+                    std::cerr << "pargrep: " << std::string(buffer.get(), size) << std::endl;
+                }
+                continue;
+            }
+            ok = size <= FRAME_BYTES && receiveAll(fd, buffer.get(), size);
+            if(ok) {
+                output.write(buffer.get(), size);
+            }
+        }
+        ::close(fd);
+        if(!ok) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cerr << "pargrep: the daemon on " << socketPath << " gave up on the search" << std::endl;
+            return 2;
+        }
+        return status;
+    }
+}
@@ -0,0 +1,116 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// A long running search server on a Unix domain socket, and its client.
+//
+#ifndef PARGREP_SEARCH_DAEMON_H
+#define PARGREP_SEARCH_DAEMON_H
+
+#include "pargrep.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace pargrep {
+
+    /**
+     * The most recently used compiled patterns, keyed by the patterns and the
+     * options which say how to compile them, so searching for the same thing again
+     * skips compiling it, which for std::regex can take longer than the search.
+     * Entries are shared, so one evicted while a search still uses it lives on
+     * until that search is done.
+     * Not thread safe.
+     */
+    class MatcherCache
+    {
+    public:
+        /// @param capacity The most compiled patterns to keep, at least one.
+        explicit MatcherCache(std::size_t capacity);
+
+        /// Patterns from patternList(), compiled now unless they were recently.
+        std::shared_ptr<const Matcher> get(const std::vector<std::string>& patterns, const Options& options);
+
+        std::uint64_t hits() const { return hits_; }
+        std::uint64_t misses() const { return misses_; }
+
+    private:
+        using Entry = std::pair<std::string, std::shared_ptr<const Matcher>>;
+
+        const std::size_t capacity_;
+        // Most recently used first:
+        std::list<Entry> entries_;
+        std::unordered_map<std::string, std::list<Entry>::iterator> byKey_;
+        std::uint64_t hits_ = 0;
+        std::uint64_t misses_ = 0;
+    };
+
+    /**
+     * Serves searches on a Unix domain socket, so a search doesn't pay to compile
+     * its pattern or start its threads, as every run of prep does.
+     * A request is the client's working directory then prep's arguments, each
+     * ending in a NUL, and ends when the client shuts down its side of the
+     * connection. Requests are served one at a time, each with all the pool's
+     * threads, in the client's working directory, so relative paths work and come
+     * out as they would from prep.
+     * The output is sent back in order as it is written, in frames of a 32-bit
+     * length and then that many bytes. A length of 0xFFFFFFFF instead marks an
+     * error for the client's stderr, as a length and message. A frame of length
+     * zero ends it and is followed by the 64-bit number of matching lines and the
+     * 8-bit status prep would exit with.
+     */
+    class SearchDaemon
+    {
+    public:
+        static constexpr std::size_t DEFAULT_CACHE_ENTRIES = 64;
+
+        explicit SearchDaemon(const std::string& socketPath, std::size_t cacheEntries = DEFAULT_CACHE_ENTRIES);
+        /// Closes and removes the socket.
+        ~SearchDaemon();
+        SearchDaemon(const SearchDaemon&) = delete;
+        SearchDaemon& operator=(const SearchDaemon&) = delete;
+
+        /**
+         * Create the socket, replacing one left behind by a daemon which has gone.
+         * @return False, after saying why on stderr, if it can't be created or another daemon is using it.
+         */
+        bool listen();
+
+        /// Serve requests until stop() is called.
+        void serve();
+
+        /// Have serve() return once any request it is serving is done. Safe to call from another thread or a signal handler.
+        void stop();
+
+        const MatcherCache& cache() const { return cache_; }
+
+    private:
+        void handle(int connection);
+
+        const std::string socketPath_;
+        int listener_ = -1;
+        std::atomic<bool> stopping_ {false};
+        MatcherCache cache_;
+        ThreadPool pool_;
+    };
+
+    /**
+     * Run a search on a SearchDaemon as prep would run it here, writing its
+     * output as it arrives.
+     * @param args prep's arguments, not counting the program name.
+     * Errors sent by the daemon are written to stderr.
+     * @param[out] matches The number of matching lines.
+     * @return The status prep would exit with, see exitStatus(), or 2 after saying
+     * why on stderr if the daemon can't be reached or hangs up part way.
+     */
+    int searchOnDaemon(const std::string& socketPath, const std::vector<std::string>& args, std::ostream& output, std::uint64_t& matches);
+}
+
+#endif //PARGREP_SEARCH_DAEMON_H
@@ -0,0 +1,602 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// Regexes compiled to matchers while the program is being built.
+//
+#ifndef PARGREP_STATIC_PATTERN_H
+#define PARGREP_STATIC_PATTERN_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+namespace pargrep {
+
+    namespace static_pattern_impl {
+        using std::uint64_t;
+
+        constexpr unsigned MAX_POSITIONS = 64;
+        constexpr unsigned MAX_REPEAT = 1000;
+
+        /// A set of bytes.
+        struct ByteSet {
+            uint64_t words[4] = {};
+
+            constexpr void set(const unsigned b) { words[b / 64] |= uint64_t(1) << (b % 64); }
+            constexpr void reset(const unsigned b) { words[b / 64] &= ~(uint64_t(1) << (b % 64)); }
+            constexpr bool test(const unsigned b) const { return (words[b / 64] >> (b % 64)) & 1; }
+            constexpr void flip() { for(auto& w : words) { w = ~w; } }
+            constexpr void add(const ByteSet& other) { for(unsigned i = 0; i < 4; ++i) { words[i] |= other.words[i]; } }
+        };
+
+        /// As BitParallelMatcher's Glushkov construction.
+        struct Glushkov {
+            bool nullable = true;
+            uint64_t first = 0;
+            uint64_t last = 0;
+        };
+
+        /// Everything about a compiled pattern except its follow lookup tables.
+        struct Tables {
+            // Positions accepting each byte:
+            uint64_t accepts[256] = {};
+            // Positions following each position:
+            uint64_t follow[MAX_POSITIONS] = {};
+            unsigned numPositions = 0;
+            uint64_t first = 0;
+            uint64_t last = 0;
+            bool linear = false;
+            bool nullable = false;
+            bool anchoredBegin = false;
+            bool anchoredEnd = false;
+        };
+
+        /// The follow sets of the positions in each byte of the state word, as in BitParallelMatcher.
+        template<unsigned NumTables>
+        struct FollowTables {
+            uint64_t follow[NumTables][256] = {};
+        };
+
+        constexpr bool isDigit(const unsigned b) { return b >= '0' && b <= '9'; }
+        constexpr bool isUpper(const unsigned b) { return b >= 'A' && b <= 'Z'; }
+        constexpr bool isLower(const unsigned b) { return b >= 'a' && b <= 'z'; }
+        constexpr bool isAlpha(const unsigned b) { return isUpper(b) || isLower(b); }
+        constexpr bool isAlnum(const unsigned b) { return isAlpha(b) || isDigit(b); }
+        constexpr bool isGraph(const unsigned b) { return b > ' ' && b < 127; }
+
+        /**
+         * A constexpr version of regex_syntax's parser which builds the Glushkov NFA
+         * as it goes, accepting the same subset of ECMAScript except that ^ and $ may
+         * only appear where BitParallelMatcher supports them.
+         * Counted repetitions are expanded by parsing the repeated atom again for
+         * every copy. Anything unsupported throws, which is a compile error during
+         * constant evaluation.
+         */
+        class Compiler
+        {
+        public:
+            constexpr explicit Compiler(const char* const pattern) : p_(pattern)
+            {
+                while(p_[n_] != '\0') {
+                    ++n_;
+                }
+            }
+
+            constexpr Tables compile()
+            {
+                Tables t;
+                if(more() && p_[i_] == '^') {
+                    t.anchoredBegin = true;
+                    ++i_;
+                }
+                const Glushkov g = parseAlternation();
+                if(i_ != n_) {
+                    throw std::invalid_argument("static_pattern: unbalanced ')'");
+                }
+                if((t.anchoredBegin || anchoredEnd_) && topLevelAlternation_) {
+                    throw std::invalid_argument("static_pattern: anchors are only supported at the ends of the whole pattern");
+                }
+                t.anchoredEnd = anchoredEnd_;
+                t.numPositions = numPositions_;
+                t.first = g.first;
+                t.last = g.last;
+                t.nullable = g.nullable;
+                t.linear = true;
+                for(unsigned i = 0; i < numPositions_; ++i)
+                {
+                    const uint64_t next = i + 1 < numPositions_ ? uint64_t(1) << (i + 1) : 0;
+                    t.linear = t.linear && follow_[i] == next;
+                    t.follow[i] = follow_[i];
+                    for(unsigned b = 0; b < 256; ++b) {
+                        if(sets_[i].test(b)) {
+                            t.accepts[b] |= uint64_t(1) << i;
+                        }
+                    }
+                }
+                return t;
+            }
+
+        private:
+            constexpr Glushkov concatenate(const Glushkov& a, const Glushkov& b)
+            {
+                for(unsigned i = 0; i < numPositions_; ++i) {
+                    if(a.last >> i & 1) {
+                        follow_[i] |= b.first;
+                    }
+                }
+                Glushkov g;
+                g.nullable = a.nullable && b.nullable;
+                g.first = a.first | (a.nullable ? b.first : 0);
+                g.last = b.last | (b.nullable ? a.last : 0);
+                return g;
+            }
+
+            constexpr Glushkov parseAlternation()
+            {
+                Glushkov g = parseConcatenation();
+                while(more() && p_[i_] == '|')
+                {
+                    ++i_;
+                    if(depth_ == 0) {
+                        topLevelAlternation_ = true;
+                    }
+                    const Glushkov branch = parseConcatenation();
+                    g.nullable = g.nullable || branch.nullable;
+                    g.first |= branch.first;
+                    g.last |= branch.last;
+                }
+                return g;
+            }
+
+            constexpr Glushkov parseConcatenation()
+            {
+                Glushkov g;
+                while(more() && p_[i_] != '|' && p_[i_] != ')') {
+                    g = concatenate(g, parseRepeat());
+                }
+                return g;
+            }
+
+            constexpr Glushkov parseRepeat()
+            {
+                const unsigned atomBegin = i_;
+                const unsigned positionsBefore = numPositions_;
+                Glushkov g = parseAtom();
+                if(!more() || !isQuantifier(p_[i_])) {
+                    return g;
+                }
+                unsigned min = 1, max = 1;
+                bool unbounded = false;
+                const char c = p_[i_++];
+                if(c == '*') { min = 0; unbounded = true; }
+                else if(c == '+') { unbounded = true; }
+                else if(c == '?') { min = 0; }
+                else {
+                    min = max = parseCount();
+                    if(more() && p_[i_] == ',') {
+                        ++i_;
+                        unbounded = !(more() && isDigit(p_[i_]));
+                        if(!unbounded) {
+                            max = parseCount();
+                            if(max < min) {
+                                throw std::invalid_argument("static_pattern: bad repeat count");
+                            }
+                        }
+                    }
+                    if(!more() || p_[i_] != '}') {
+                        throw std::invalid_argument("static_pattern: unterminated repeat count");
+                    }
+                    ++i_;
+                }
+                // Laziness changes which match is found, not whether there is one:
+                if(more() && p_[i_] == '?') {
+                    ++i_;
+                }
+                if(more() && isQuantifier(p_[i_])) {
+                    throw std::invalid_argument("static_pattern: repeated quantifier");
+                }
+                const unsigned repeatEnd = i_;
+
+                // Throw the copy parsed to find the atom's extent away and build every copy afresh:
+                for(unsigned i = positionsBefore; i < numPositions_; ++i) {
+                    follow_[i] = 0;
+                }
+                numPositions_ = positionsBefore;
+                g = Glushkov();
+                for(unsigned i = 0; i < min; ++i) {
+                    g = concatenate(g, reparse(atomBegin));
+                }
+                if(unbounded) {
+                    Glushkov loop = reparse(atomBegin);
+                    for(unsigned i = 0; i < numPositions_; ++i) {
+                        if(loop.last >> i & 1) {
+                            follow_[i] |= loop.first;
+                        }
+                    }
+                    loop.nullable = true;
+                    g = concatenate(g, loop);
+                } else {
+                    for(unsigned i = min; i < max; ++i) {
+                        Glushkov optional = reparse(atomBegin);
+                        optional.nullable = true;
+                        g = concatenate(g, optional);
+                    }
+                }
+                i_ = repeatEnd;
+                return g;
+            }
+
+            constexpr Glushkov reparse(const unsigned atomBegin)
+            {
+                i_ = atomBegin;
+                return parseAtom();
+            }
+
+            constexpr unsigned parseCount()
+            {
+                if(!more() || !isDigit(p_[i_])) {
+                    throw std::invalid_argument("static_pattern: bad repeat count");
+                }
+                unsigned value = 0;
+                while(more() && isDigit(p_[i_])) {
+                    value = value * 10 + (p_[i_++] - '0');
+                    if(value > MAX_REPEAT) {
+                        throw std::invalid_argument("static_pattern: repeat count too large");
+                    }
+                }
+                return value;
+            }
+
+            constexpr Glushkov parseAtom()
+            {
+                const char c = p_[i_++];
+                switch(c)
+                {
+                    case '(': {
+                        if(more() && p_[i_] == '?') {
+                            // Only non-capturing groups, not lookahead:
+                            if(i_ + 1 >= n_ || p_[i_ + 1] != ':') {
+                                throw std::invalid_argument("static_pattern: lookahead is not supported");
+                            }
+                            i_ += 2;
+                        }
+                        ++depth_;
+                        const Glushkov group = parseAlternation();
+                        --depth_;
+                        if(!more() || p_[i_] != ')') {
+                            throw std::invalid_argument("static_pattern: unbalanced '('");
+                        }
+                        ++i_;
+                        return group;
+                    }
+                    case '[': return position(parseClass());
+                    case '.': {
+                        ByteSet any;
+                        any.flip();
+                        any.reset('\n');
+                        any.reset('\r');
+                        return position(any);
+                    }
+                    case '^':
+                        // A leading ^ is consumed by compile():
+                        throw std::invalid_argument("static_pattern: ^ is only supported at the start of the pattern");
+                    case '$':
+                        if(i_ != n_ || depth_ != 0) {
+                            throw std::invalid_argument("static_pattern: $ is only supported at the end of the pattern");
+                        }
+                        anchoredEnd_ = true;
+                        return Glushkov();
+                    case '*': case '+': case '?': case '{': case ')': case '|':
+                        throw std::invalid_argument("static_pattern: nothing to repeat");
+                    case '\\': {
+                        ByteSet set;
+                        parseEscape(set, false);
+                        return position(set);
+                    }
+                    default: {
+                        ByteSet one;
+                        one.set((unsigned char) c);
+                        return position(one);
+                    }
+                }
+            }
+
+            /**
+             * Parse the escape after a backslash into a set of bytes.
+             * @param inClass Inside brackets, where \b means backspace.
+             * @return True if it was a single character.
+             */
+            constexpr bool parseEscape(ByteSet& set, const bool inClass)
+            {
+                if(!more()) {
+                    throw std::invalid_argument("static_pattern: trailing backslash");
+                }
+                const char e = p_[i_++];
+                switch(e)
+                {
+                    case 'd': case 'D': addClass(set, "digit", 5, e == 'D'); return false;
+                    case 'w': case 'W': addClass(set, "w", 1, e == 'W'); return false;
+                    case 's': case 'S': addClass(set, "space", 5, e == 'S'); return false;
+                    case 'n': set.set('\n'); return true;
+                    case 't': set.set('\t'); return true;
+                    case 'r': set.set('\r'); return true;
+                    case 'f': set.set('\f'); return true;
+                    case 'v': set.set('\v'); return true;
+                    case 'b':
+                        if(!inClass) {
+                            throw std::invalid_argument("static_pattern: \\b is not supported");
+                        }
+                        set.set('\b');
+                        return true;
+                    default:
+                        // Backreferences, \B, \x, \u, \c, ...:
+                        if(isAlnum((unsigned char) e)) {
+                            throw std::invalid_argument("static_pattern: unsupported escape");
+                        }
+                        set.set((unsigned char) e);
+                        return true;
+                }
+            }
+
+            /// Add a POSIX class (or "w" for \w) in the C locale, as regex_syntax does.
+            static constexpr bool addClass(ByteSet& set, const char* const name, const unsigned length, const bool negate)
+            {
+                for(unsigned b = 0; b < 128; ++b)
+                {
+                    bool in = false;
+                    if(named(name, length, "alnum")) in = isAlnum(b);
+                    else if(named(name, length, "alpha")) in = isAlpha(b);
+                    else if(named(name, length, "blank")) in = b == ' ' || b == '\t';
+                    else if(named(name, length, "cntrl")) in = b < ' ' || b == 127;
+                    else if(named(name, length, "digit")) in = isDigit(b);
+                    else if(named(name, length, "graph")) in = isGraph(b);
+                    else if(named(name, length, "lower")) in = isLower(b);
+                    else if(named(name, length, "print")) in = isGraph(b) || b == ' ';
+                    else if(named(name, length, "punct")) in = isGraph(b) && !isAlnum(b);
+                    else if(named(name, length, "space")) in = b == ' ' || (b >= '\t' && b <= '\r');
+                    else if(named(name, length, "upper")) in = isUpper(b);
+                    else if(named(name, length, "xdigit")) in = isDigit(b) || (b >= 'a' && b <= 'f') || (b >= 'A' && b <= 'F');
+                    else if(named(name, length, "w")) in = isAlnum(b) || b == '_';
+                    else return false;
+                    if(in != negate) {
+                        set.set(b);
+                    }
+                }
+                if(negate) {
+                    for(unsigned b = 128; b < 256; ++b) {
+                        set.set(b);
+                    }
+                }
+                return true;
+            }
+
+            static constexpr bool named(const char* const name, const unsigned length, const char* const candidate)
+            {
+                unsigned i = 0;
+                for(; i < length; ++i) {
+                    if(candidate[i] != name[i]) {
+                        return false;
+                    }
+                }
+                return candidate[i] == '\0';
+            }
+
+            constexpr ByteSet parseClass()
+            {
+                ByteSet set;
+                bool negate = false;
+                if(more() && p_[i_] == '^') {
+                    negate = true;
+                    ++i_;
+                }
+                // ECMAScript's empty classes "[]" and "[^]" aren't worth supporting:
+                if(more() && p_[i_] == ']') {
+                    throw std::invalid_argument("static_pattern: empty class");
+                }
+                while(more() && p_[i_] != ']')
+                {
+                    unsigned char lo = 0;
+                    const bool single = classCharacter(set, lo);
+                    const bool range = more() && p_[i_] == '-' && i_ + 1 < n_ && p_[i_ + 1] != ']';
+                    if(!single) {
+                        // A class such as \d or [:digit:] which can't start a range:
+                        if(range) {
+                            throw std::invalid_argument("static_pattern: bad class range");
+                        }
+                        continue;
+                    }
+                    if(range)
+                    {
+                        ++i_;
+                        ByteSet unused;
+                        unsigned char hi = 0;
+                        if(!classCharacter(unused, hi) || hi < lo || hi >= 128) {
+                            throw std::invalid_argument("static_pattern: bad class range");
+                        }
+                        for(unsigned b = lo; b <= hi; ++b) {
+                            set.set(b);
+                        }
+                    } else {
+                        set.set(lo);
+                    }
+                }
+                if(!more()) {
+                    throw std::invalid_argument("static_pattern: unterminated class");
+                }
+                ++i_;
+                if(negate) {
+                    set.flip();
+                }
+                return set;
+            }
+
+            /**
+             * Parse one item of a bracketed class.
+             * @return True if it was a single character, returned in c, else its members have been added to set.
+             */
+            constexpr bool classCharacter(ByteSet& set, unsigned char& c)
+            {
+                const char first = p_[i_++];
+                if(first == '[' && more() && (p_[i_] == ':' || p_[i_] == '.' || p_[i_] == '='))
+                {
+                    const char kind = p_[i_];
+                    unsigned close = i_ + 1;
+                    while(close + 1 < n_ && !(p_[close] == kind && p_[close + 1] == ']')) {
+                        ++close;
+                    }
+                    if(kind != ':' || close + 1 >= n_ || !addClass(set, p_ + i_ + 1, close - i_ - 1, false)) {
+                        throw std::invalid_argument("static_pattern: unsupported bracket class");
+                    }
+                    i_ = close + 2;
+                    return false;
+                }
+                if(first == '\\')
+                {
+                    ByteSet escaped;
+                    if(!parseEscape(escaped, true)) {
+                        set.add(escaped);
+                        return false;
+                    }
+                    for(unsigned b = 0; b < 256; ++b) {
+                        if(escaped.test(b)) { c = (unsigned char) b; }
+                    }
+                    return true;
+                }
+                c = (unsigned char) first;
+                return true;
+            }
+
+            constexpr Glushkov position(const ByteSet& set)
+            {
+                if(numPositions_ >= MAX_POSITIONS) {
+                    throw std::invalid_argument("static_pattern: more than 64 positions");
+                }
+                sets_[numPositions_] = set;
+                const uint64_t bit = uint64_t(1) << numPositions_;
+                ++numPositions_;
+                Glushkov g;
+                g.nullable = false;
+                g.first = g.last = bit;
+                return g;
+            }
+
+            static constexpr bool isQuantifier(const char c) { return c == '*' || c == '+' || c == '?' || c == '{'; }
+
+            constexpr bool more() const { return i_ < n_; }
+
+            const char* p_;
+            unsigned n_ = 0;
+            unsigned i_ = 0;
+            unsigned depth_ = 0;
+            bool topLevelAlternation_ = false;
+            bool anchoredEnd_ = false;
+            ByteSet sets_[MAX_POSITIONS] = {};
+            uint64_t follow_[MAX_POSITIONS] = {};
+            unsigned numPositions_ = 0;
+        };
+
+        constexpr Tables compile(const char* const pattern)
+        {
+            return Compiler(pattern).compile();
+        }
+
+        template<unsigned NumTables>
+        constexpr FollowTables<NumTables> buildFollowTables(const Tables& t)
+        {
+            FollowTables<NumTables> tables;
+            for(unsigned table = 0; table < NumTables; ++table) {
+                for(unsigned v = 0; v < 256; ++v) {
+                    uint64_t follow = 0;
+                    for(unsigned j = 0; j < 8 && 8 * table + j < t.numPositions; ++j) {
+                        if(v >> j & 1) {
+                            follow |= t.follow[8 * table + j];
+                        }
+                    }
+                    tables.follow[table][v] = follow;
+                }
+            }
+            return tables;
+        }
+    }
+
+    /**
+     * A regex parsed and compiled to a bit-parallel NFA by the C++ compiler, for
+     * patterns known when the program is built.
+     * There's no std::regex to construct at runtime and the search loop is
+     * specialised on the pattern: plain sequences of classes compile to a
+     * shift-and with constant tables, and anchor handling is only compiled in if
+     * the pattern has anchors. Patterns outside the subset BitParallelMatcher
+     * supports fail to compile.
+     *
+     * The pattern has to be a char array with static storage duration:
+     *
+     *     static constexpr char ERRORS[] = "^\\[ERROR\\] *:";
+     *     pargrep::grep_stream(in, pargrep::static_pattern<ERRORS>(), out, options);
+     *
+     * It has no literal prefilter so canSkip() is always false.
+     */
+    template<const char* Pattern>
+    class static_pattern
+    {
+    public:
+        static constexpr static_pattern_impl::Tables tables = static_pattern_impl::compile(Pattern);
+
+        static constexpr unsigned numPositions() { return tables.numPositions; }
+
+        /// True if any part of the line [begin, end) matches.
+        bool search(const char* const begin, const char* const end) const
+        {
+            using std::uint64_t;
+            // An empty match at the start (or end) of the line:
+            if constexpr(tables.nullable) {
+                if(!tables.anchoredBegin || !tables.anchoredEnd || begin == end) {
+                    return true;
+                }
+            }
+            uint64_t states = 0;
+            // Positions a match may start on at the next byte:
+            uint64_t start = tables.first;
+            for(const char* p = begin; p < end; ++p)
+            {
+                uint64_t reached = 0;
+                if constexpr(tables.linear) {
+                    reached = states << 1;
+                } else {
+                    for(unsigned t = 0; t < NUM_TABLES; ++t) {
+                        reached |= followTables.follow[t][std::uint8_t(states >> (8 * t))];
+                    }
+                }
+                states = (reached | start) & tables.accepts[std::uint8_t(*p)];
+                if constexpr(tables.anchoredBegin) {
+                    start = 0;
+                    if(!states) {
+                        return false;
+                    }
+                }
+                if constexpr(!tables.anchoredEnd) {
+                    if(states & tables.last) {
+                        return true;
+                    }
+                }
+            }
+            return tables.anchoredEnd && (states & tables.last);
+        }
+
+        bool search(const std::string& line) const
+        {
+            return search(line.data(), line.data() + line.size());
+        }
+
+        const char* nextCandidate(const char* const begin, const char*) const { return begin; }
+        bool canSkip() const { return false; }
+        const char* engineName() const { return "static pattern"; }
+
+    private:
+        static constexpr unsigned NUM_TABLES = tables.linear ? 0 : (tables.numPositions + 7) / 8;
+        static constexpr static_pattern_impl::FollowTables<NUM_TABLES == 0 ? 1 : NUM_TABLES> followTables =
+                static_pattern_impl::buildFollowTables<NUM_TABLES == 0 ? 1 : NUM_TABLES>(tables);
+    };
+}
+
+#endif //PARGREP_STATIC_PATTERN_H
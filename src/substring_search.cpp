@@ -0,0 +1,116 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "substring_search.h"
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARGREP_X86 1
+#endif
+
+namespace pargrep {
+
+    namespace {
+        const char* findScalar(const char* begin, const char* end, const char* needle, std::size_t length)
+        {
+            if(length == 0) {
+                return begin;
+            }
+            if(length == 1) {
+                const void* const found = std::memchr(begin, needle[0], end - begin);
+                return found ? static_cast<const char*>(found) : end;
+            }
+            const void* const found = ::memmem(begin, end - begin, needle, length);
+            return found ? static_cast<const char*>(found) : end;
+        }
+
+#if PARGREP_X86
+        __attribute__((target("sse2")))
+        const char* findSse2(const char* begin, const char* end, const char* needle, std::size_t length)
+        {
+            // glibc's memchr is already vectorised:
+            if(length < 2) {
+                return findScalar(begin, end, needle, length);
+            }
+            const std::size_t size = end - begin;
+            const __m128i first = _mm_set1_epi8(needle[0]);
+            const __m128i last = _mm_set1_epi8(needle[length - 1]);
+            std::size_t i = 0;
+            for(; i + length - 1 + 16 <= size; i += 16)
+            {
+                const __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + i));
+                const __m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + i + length - 1));
+                unsigned mask = unsigned(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast))));
+                while(mask)
+                {
+                    const unsigned bit = __builtin_ctz(mask);
+                    if(std::memcmp(begin + i + bit + 1, needle + 1, length - 2) == 0) {
+                        return begin + i + bit;
+                    }
+                    mask &= mask - 1;
+                }
+            }
+            const char* const found = findScalar(begin + i, end, needle, length);
+            return found;
+        }
+
+        __attribute__((target("avx2")))
+        const char* findAvx2(const char* begin, const char* end, const char* needle, std::size_t length)
+        {
+            if(length < 2) {
+                return findScalar(begin, end, needle, length);
+            }
+            const std::size_t size = end - begin;
+            const __m256i first = _mm256_set1_epi8(needle[0]);
+            const __m256i last = _mm256_set1_epi8(needle[length - 1]);
+            std::size_t i = 0;
+            for(; i + length - 1 + 32 <= size; i += 32)
+            {
+                const __m256i blockFirst = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + i));
+                const __m256i blockLast = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + i + length - 1));
+                unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast))));
+                while(mask)
+                {
+                    const unsigned bit = __builtin_ctz(mask);
+                    if(std::memcmp(begin + i + bit + 1, needle + 1, length - 2) == 0) {
+                        return begin + i + bit;
+                    }
+                    mask &= mask - 1;
+                }
+            }
+            // Finish off with 16 byte steps before dropping to scalar code:
+            return findSse2(begin + i, end, needle, length);
+        }
+#endif
+
+        bool hasAvx2()
+        {
+#if PARGREP_X86
+            static const bool avx2 = __builtin_cpu_supports("avx2");
+            return avx2;
+#else
+            return false;
+#endif
+        }
+    }
+
+    SubstringSearcher::SubstringSearcher(const std::string& needle) :
+        needle_(needle),
+#if PARGREP_X86
+        find_(hasAvx2() ? findAvx2 : findSse2)
+#else
+        find_(findScalar)
+#endif
+    {}
+
+    const char* SubstringSearcher::implementation()
+    {
+#if PARGREP_X86
+        return hasAvx2() ? "avx2" : "sse2";
+#else
+        return "scalar";
+#endif
+    }
+}
@@ -0,0 +1,45 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// Vectorised search for a fixed string.
+//
+#ifndef PARGREP_SUBSTRING_SEARCH_H
+#define PARGREP_SUBSTRING_SEARCH_H
+
+#include <string>
+
+namespace pargrep {
+
+    /**
+     * Finds occurrences of a fixed string using SIMD compares of its first and last
+     * characters against 32 (AVX2) or 16 (SSE2) positions at a time, verifying only
+     * the positions where both agree. The instruction set is chosen at runtime.
+     */
+    class SubstringSearcher
+    {
+    public:
+        explicit SubstringSearcher(const std::string& needle);
+
+        /**
+         * @return The start of the first occurrence of the needle in [begin, end),
+         * or end if there is none. An empty needle is found at begin.
+         */
+        const char* find(const char* begin, const char* end) const
+        {
+            return find_(begin, end, needle_.data(), needle_.size());
+        }
+
+        const std::string& needle() const { return needle_; }
+
+        /// The name of the implementation chosen for this CPU, e.g. "avx2".
+        static const char* implementation();
+
+    private:
+        using FindFunction = const char* (*)(const char* begin, const char* end, const char* needle, std::size_t length);
+        std::string needle_;
+        FindFunction find_;
+    };
+}
+
+#endif //PARGREP_SUBSTRING_SEARCH_H
@@ -0,0 +1,67 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "thread_pool.h"
+
+namespace pargrep {
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stopping_ = true;
+        }
+        c_.notify_all();
+        for(std::thread& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    std::future<void> ThreadPool::submit(std::function<void()> task)
+    {
+        std::packaged_task<void()> packaged(std::move(task));
+        std::future<void> done = packaged.get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            tasks_.push_back(std::move(packaged));
+            // Each queued task needs a thread of its own to take it:
+            if(tasks_.size() > idle_) {
+                threads_.emplace_back(&ThreadPool::run, this);
+                return done;
+            }
+        }
+        c_.notify_one();
+        return done;
+    }
+
+    std::size_t ThreadPool::threads() const
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        return threads_.size();
+    }
+
+    void ThreadPool::run()
+    {
+        std::unique_lock<std::mutex> lock(m_);
+        while(true)
+        {
+            if(!tasks_.empty())
+            {
+                std::packaged_task<void()> task = std::move(tasks_.front());
+                tasks_.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+                continue;
+            }
+            if(stopping_) {
+                return;
+            }
+            ++idle_;
+            c_.wait(lock);
+            --idle_;
+        }
+    }
+}
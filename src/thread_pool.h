@@ -0,0 +1,60 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// Threads kept between searches.
+//
+#ifndef PARGREP_THREAD_POOL_H
+#define PARGREP_THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pargrep {
+
+    /**
+     * Threads which outlive the searches that use them, so a search doesn't pay to
+     * start its reader, workers and writer.
+     * Every task submitted starts running at once, on an idle thread if there is
+     * one or a new thread if not, rather than queueing for a thread to come free.
+     * The threads of a search wait on each other so this is what stops a search
+     * from deadlocking when the pool is busy. The pool grows to the most tasks
+     * that have run at once and keeps its threads until it is destroyed.
+     */
+    class ThreadPool
+    {
+    public:
+        ThreadPool() = default;
+        /// Waits for tasks already submitted to finish.
+        ~ThreadPool();
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /**
+         * Run a task on one of the pool's threads.
+         * @return Becomes ready when the task finishes, holding any exception it threw.
+         */
+        std::future<void> submit(std::function<void()> task);
+
+        /// The number of threads the pool has started.
+        std::size_t threads() const;
+
+    private:
+        void run();
+
+        mutable std::mutex m_;
+        std::condition_variable c_;
+        std::deque<std::packaged_task<void()>> tasks_;
+        std::vector<std::thread> threads_;
+        // Threads waiting for a task:
+        std::size_t idle_ = 0;
+        bool stopping_ = false;
+    };
+}
+
+#endif //PARGREP_THREAD_POOL_H
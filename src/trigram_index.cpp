@@ -0,0 +1,604 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+
+#include "trigram_index.h"
+#include "line_reader.h"
+#include "literal_prefilter.h"
+#include "regex_syntax.h"
+#include <algorithm>
+#include <bitset>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <sys/stat.h>
+
+namespace pargrep {
+
+    /// An entry of the index's table of trigrams, which is sorted by trigram.
+    struct TrigramIndex::Trigram {
+        std::uint32_t trigram;
+        // The number of blocks in the posting list:
+        std::uint32_t numBlocks;
+        // Where the posting list starts, from the start of the postings:
+        std::uint64_t postings;
+    };
+
+    namespace {
+        constexpr char MAGIC[8] = {'P', 'G', 'T', 'R', 'I', 'G', '0', '1'};
+
+        /**
+         * The start of an index file. It is followed by numBlocks + 1 pairs of the
+         * offset and first line number of each block, the last pair marking the end
+         * of the file, then the table of trigrams, then the postings.
+         * Everything is in the byte order of the machine which built it, to be mapped
+         * and used as it is.
+         */
+        struct Header {
+            char magic[8];
+            // The file indexed, to tell when it has changed since:
+            std::uint64_t fileSize;
+            std::int64_t fileModifiedNs;
+            std::uint64_t numBlocks;
+            std::uint64_t numTrigrams;
+            std::uint64_t postingsBytes;
+        };
+
+        bool fileIdentity(const std::string& filename, std::uint64_t& size, std::int64_t& modifiedNs)
+        {
+            struct stat info;
+            if(::stat(filename.c_str(), &info) != 0) {
+                return false;
+            }
+            size = std::uint64_t(info.st_size);
+            modifiedNs = std::int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+            return true;
+        }
+
+        std::uint32_t trigramAt(const char* const p)
+        {
+            return std::uint32_t(std::uint8_t(p[0])) << 16 | std::uint32_t(std::uint8_t(p[1])) << 8 | std::uint8_t(p[2]);
+        }
+
+        void appendVarint(std::string& out, std::uint64_t value)
+        {
+            while(value >= 0x80) {
+                out.push_back(char(value | 0x80));
+                value >>= 7;
+            }
+            out.push_back(char(value));
+        }
+
+        // Sets of exact strings bigger than this are given up on, to bound the analysis:
+        constexpr std::size_t MAX_EXACT = 16;
+        // Classes of more characters than this are treated as matching anything:
+        constexpr std::size_t MAX_SET_CHARS = 4;
+        // Bounded repeats up to this many times are spelt out:
+        constexpr int MAX_REPEAT = 3;
+
+        TrigramQuery forString(const std::string& text)
+        {
+            TrigramQuery query;
+            for(std::size_t i = 0; i + 3 <= text.size(); ++i) {
+                query.trigrams.push_back(trigramAt(text.data() + i));
+            }
+            if(!query.trigrams.empty()) {
+                query.op = TrigramQuery::Op::And;
+                std::sort(query.trigrams.begin(), query.trigrams.end());
+                query.trigrams.erase(std::unique(query.trigrams.begin(), query.trigrams.end()), query.trigrams.end());
+            }
+            return query;
+        }
+
+        TrigramQuery both(const TrigramQuery& a, const TrigramQuery& b)
+        {
+            if(a.op == TrigramQuery::Op::All) {
+                return b;
+            }
+            if(b.op == TrigramQuery::Op::All) {
+                return a;
+            }
+            TrigramQuery query;
+            query.op = TrigramQuery::Op::And;
+            for(const TrigramQuery* part : {&a, &b})
+            {
+                if(part->op == TrigramQuery::Op::And) {
+                    query.trigrams.insert(query.trigrams.end(), part->trigrams.begin(), part->trigrams.end());
+                    query.children.insert(query.children.end(), part->children.begin(), part->children.end());
+                } else {
+                    query.children.push_back(*part);
+                }
+            }
+            std::sort(query.trigrams.begin(), query.trigrams.end());
+            query.trigrams.erase(std::unique(query.trigrams.begin(), query.trigrams.end()), query.trigrams.end());
+            return query;
+        }
+
+        TrigramQuery either(const TrigramQuery& a, const TrigramQuery& b)
+        {
+            if(a.op == TrigramQuery::Op::All || b.op == TrigramQuery::Op::All) {
+                return TrigramQuery();
+            }
+            TrigramQuery query;
+            query.op = TrigramQuery::Op::Or;
+            for(const TrigramQuery* part : {&a, &b})
+            {
+                if(part->op == TrigramQuery::Op::Or) {
+                    query.children.insert(query.children.end(), part->children.begin(), part->children.end());
+                } else {
+                    query.children.push_back(*part);
+                }
+            }
+            return query;
+        }
+
+        /// What is known about the text a part of a regex matches.
+        struct Info {
+            // Set if the part only ever matches one of the strings in exact:
+            bool exactKnown = false;
+            std::vector<std::string> exact;
+            // Met by any text the part matches:
+            TrigramQuery match;
+        };
+
+        /// Everything the exact strings of a part tell about it, as a query.
+        TrigramQuery materialize(const Info& info)
+        {
+            if(!info.exactKnown) {
+                return info.match;
+            }
+            TrigramQuery any;
+            for(std::size_t i = 0; i < info.exact.size(); ++i)
+            {
+                const TrigramQuery one = forString(info.exact[i]);
+                if(one.op == TrigramQuery::Op::All) {
+                    return info.match;
+                }
+                any = i == 0 ? one : either(any, one);
+            }
+            return both(info.match, any);
+        }
+
+        /// Every string in a followed by one in b, unless there would be too many.
+        bool cross(const std::vector<std::string>& a, const std::vector<std::string>& b, std::vector<std::string>& out)
+        {
+            if(a.size() * b.size() > MAX_EXACT) {
+                return false;
+            }
+            std::vector<std::string> product;
+            for(const std::string& first : a) {
+                for(const std::string& second : b) {
+                    product.push_back(first + second);
+                }
+            }
+            std::sort(product.begin(), product.end());
+            product.erase(std::unique(product.begin(), product.end()), product.end());
+            out = std::move(product);
+            return true;
+        }
+
+        using Sets = std::vector<std::bitset<256>>;
+
+        Info analyze(const regex_syntax::Node& node, const Sets& sets);
+
+        Info analyzeConcat(const std::vector<regex_syntax::Node>& children, const Sets& sets)
+        {
+            // The run of exact strings so far, then what is known of the parts before it:
+            Info info;
+            info.exactKnown = true;
+            info.exact = {""};
+            bool whole = true;
+            for(const regex_syntax::Node& child : children)
+            {
+                const Info next = analyze(child, sets);
+                if(info.exactKnown && next.exactKnown && cross(info.exact, next.exact, info.exact)) {
+                    info.match = both(info.match, next.match);
+                    continue;
+                }
+                // The run ends here, so fold it into the query and start another:
+                info.match = both(materialize(info), next.match);
+                info.exactKnown = next.exactKnown;
+                info.exact = next.exact;
+                whole = false;
+            }
+            if(!whole) {
+                info.match = materialize(info);
+                info.exactKnown = false;
+                info.exact.clear();
+            }
+            return info;
+        }
+
+        Info analyze(const regex_syntax::Node& node, const Sets& sets)
+        {
+            using regex_syntax::Node;
+            Info info;
+            switch(node.kind)
+            {
+                case Node::Empty:
+                case Node::Begin:
+                case Node::End:
+                    info.exactKnown = true;
+                    info.exact = {""};
+                    return info;
+
+                case Node::Set:
+                {
+                    // A newline can't be part of a match within a line:
+                    std::bitset<256> set = sets[node.set];
+                    set.reset('\n');
+                    if(set.none() || set.count() > MAX_SET_CHARS) {
+                        return info;
+                    }
+                    info.exactKnown = true;
+                    for(unsigned c = 0; c < 256; ++c) {
+                        if(set.test(c)) {
+                            info.exact.push_back(std::string(1, char(c)));
+                        }
+                    }
+                    return info;
+                }
+
+                case Node::Concat:
+                    return analyzeConcat(node.children, sets);
+
+                case Node::Alt:
+                {
+                    std::vector<Info> alternatives;
+                    bool exact = true;
+                    std::size_t numExact = 0;
+                    for(const Node& child : node.children) {
+                        alternatives.push_back(analyze(child, sets));
+                        exact = exact && alternatives.back().exactKnown;
+                        numExact += alternatives.back().exact.size();
+                    }
+                    info.exactKnown = exact && numExact <= MAX_EXACT;
+                    for(std::size_t i = 0; i < alternatives.size(); ++i)
+                    {
+                        const Info& alternative = alternatives[i];
+                        if(info.exactKnown) {
+                            info.exact.insert(info.exact.end(), alternative.exact.begin(), alternative.exact.end());
+                        }
+                        const TrigramQuery match = info.exactKnown ? alternative.match : materialize(alternative);
+                        info.match = i == 0 ? match : either(info.match, match);
+                    }
+                    std::sort(info.exact.begin(), info.exact.end());
+                    info.exact.erase(std::unique(info.exact.begin(), info.exact.end()), info.exact.end());
+                    return info;
+                }
+
+                case Node::Repeat:
+                {
+                    const Info child = analyze(node.children[0], sets);
+                    if(node.min == 1 && node.max == 1) {
+                        return child;
+                    }
+                    // A few repeats of a few strings can be spelt out:
+                    if(child.exactKnown && node.max != regex_syntax::UNBOUNDED && node.max <= MAX_REPEAT)
+                    {
+                        std::vector<std::string> power = {""};
+                        std::vector<std::string> allowed;
+                        bool fits = true;
+                        for(int count = 0; fits && count <= node.max; ++count)
+                        {
+                            if(count >= node.min) {
+                                allowed.insert(allowed.end(), power.begin(), power.end());
+                            }
+                            fits = count == node.max || cross(power, child.exact, power);
+                        }
+                        std::sort(allowed.begin(), allowed.end());
+                        allowed.erase(std::unique(allowed.begin(), allowed.end()), allowed.end());
+                        if(fits && allowed.size() <= MAX_EXACT) {
+                            info.exactKnown = true;
+                            info.exact = std::move(allowed);
+                            if(node.min > 0) {
+                                info.match = child.match;
+                            }
+                            return info;
+                        }
+                    }
+                    // At least one repeat must be there:
+                    if(node.min > 0) {
+                        info.match = materialize(child);
+                    }
+                    return info;
+                }
+            }
+            return info;
+        }
+
+        TrigramQuery regexQuery(const std::string& pattern)
+        {
+            regex_syntax::Node root;
+            Sets sets;
+            if(regex_syntax::parse(pattern, root, sets)) {
+                return materialize(analyze(root, sets));
+            }
+            // Only std::regex can match it, so make do with the literals it needs:
+            TrigramQuery query;
+            for(const std::string& literal : requiredLiterals(pattern)) {
+                query = both(query, forString(literal));
+            }
+            return query;
+        }
+    }
+
+    std::string TrigramQuery::toString() const
+    {
+        if(op == Op::All) {
+            return "*";
+        }
+        std::string out;
+        const char* const separator = op == Op::And ? " " : " | ";
+        auto add = [&](const std::string& part) {
+            if(!out.empty()) {
+                out.append(separator);
+            }
+            out.append(part);
+        };
+        for(const std::uint32_t trigram : trigrams) {
+            add(std::string{'"', char(trigram >> 16), char(trigram >> 8), char(trigram), '"'});
+        }
+        for(const TrigramQuery& child : children) {
+            add(child.op == Op::All ? "*" : "(" + child.toString() + ")");
+        }
+        return out;
+    }
+
+    TrigramQuery trigramQuery(const std::vector<std::string>& patterns, const bool fixedStrings)
+    {
+        TrigramQuery query;
+        for(std::size_t i = 0; i < patterns.size(); ++i)
+        {
+            const TrigramQuery one = fixedStrings ? forString(patterns[i]) : regexQuery(patterns[i]);
+            query = i == 0 ? one : either(query, one);
+        }
+        return query;
+    }
+
+    bool TrigramIndex::build(const std::string& filename, const std::string& indexFilename, std::size_t blockBytes)
+    {
+        MappedFile file(filename);
+        std::uint64_t fileSize = 0;
+        std::int64_t fileModifiedNs = 0;
+        if(!file.valid() || !fileIdentity(filename, fileSize, fileModifiedNs) || fileSize != file.size()) {
+            std::cerr << "pargrep: unable to map " << filename << std::endl;
+            return false;
+        }
+        blockBytes = std::max<std::size_t>(blockBytes, 1);
+        const char* const data = file.data();
+        const std::size_t size = file.size();
+
+        // The start and first line of each block, in pairs:
+        std::vector<std::uint64_t> blocks;
+        std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> postings;
+        // A bit for each trigram seen in the current block, and the trigrams to clear them for:
+        std::vector<std::uint64_t> seen((1 << 24) / 64, 0);
+        std::vector<std::uint32_t> inBlock;
+        std::uint64_t line = 1;
+        for(std::size_t begin = 0; begin < size;)
+        {
+            std::size_t end = size;
+            if(size - begin > blockBytes) {
+                const char* const newline = static_cast<const char*>(std::memchr(data + begin + blockBytes - 1, '\n', size - begin - blockBytes + 1));
+                end = newline ? newline + 1 - data : size;
+            }
+            const std::uint32_t block = std::uint32_t(blocks.size() / 2);
+            blocks.push_back(begin);
+            blocks.push_back(line);
+            // Trigrams within each line, since no match spans a newline:
+            for(const char* lineBegin = data + begin; lineBegin < data + end;)
+            {
+                const char* const newline = static_cast<const char*>(std::memchr(lineBegin, '\n', data + end - lineBegin));
+                const char* const lineEnd = newline ? newline : data + end;
+                for(const char* p = lineBegin; p + 3 <= lineEnd; ++p)
+                {
+                    const std::uint32_t trigram = trigramAt(p);
+                    std::uint64_t& word = seen[trigram / 64];
+                    const std::uint64_t bit = std::uint64_t(1) << (trigram % 64);
+                    if(!(word & bit)) {
+                        word |= bit;
+                        inBlock.push_back(trigram);
+                    }
+                }
+                lineBegin = lineEnd + 1;
+            }
+            for(const std::uint32_t trigram : inBlock) {
+                postings[trigram].push_back(block);
+                seen[trigram / 64] = 0;
+            }
+            inBlock.clear();
+            line += NewlineScanner::count(data + begin, data + end);
+            begin = end;
+        }
+        const std::size_t numBlocks = blocks.size() / 2;
+        blocks.push_back(size);
+        blocks.push_back(line);
+
+        std::vector<std::uint32_t> keys;
+        keys.reserve(postings.size());
+        for(const auto& posting : postings) {
+            keys.push_back(posting.first);
+        }
+        std::sort(keys.begin(), keys.end());
+        std::vector<Trigram> table;
+        table.reserve(keys.size());
+        std::string postingBytes;
+        for(const std::uint32_t key : keys)
+        {
+            const std::vector<std::uint32_t>& posting = postings[key];
+            table.push_back(Trigram{key, std::uint32_t(posting.size()), postingBytes.size()});
+            std::uint32_t previous = 0;
+            for(const std::uint32_t block : posting) {
+                appendVarint(postingBytes, block - previous);
+                previous = block;
+            }
+        }
+
+        Header header;
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.fileSize = fileSize;
+        header.fileModifiedNs = fileModifiedNs;
+        header.numBlocks = numBlocks;
+        header.numTrigrams = table.size();
+        header.postingsBytes = postingBytes.size();
+
+        // Written alongside then renamed over the old index, so searches never see half of one:
+        const std::string temporary = indexFilename + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios_base::binary | std::ios_base::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(std::uint64_t));
+            out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(Trigram));
+            out.write(postingBytes.data(), postingBytes.size());
+            out.close();
+            if(!out) {
+                std::cerr << "pargrep: unable to write " << temporary << std::endl;
+                std::remove(temporary.c_str());
+                return false;
+            }
+        }
+        if(std::rename(temporary.c_str(), indexFilename.c_str()) != 0) {
+            std::cerr << "pargrep: unable to write " << indexFilename << std::endl;
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    TrigramIndex::TrigramIndex(const std::string& indexFilename, const std::string& filename) :
+        mapping_(new MappedFile(indexFilename))
+    {
+        const std::size_t size = mapping_->size();
+        if(!mapping_->valid() || size < sizeof(Header)) {
+            return;
+        }
+        Header header;
+        std::memcpy(&header, mapping_->data(), sizeof(header));
+        std::uint64_t fileSize = 0;
+        std::int64_t fileModifiedNs = 0;
+        if(std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || !fileIdentity(filename, fileSize, fileModifiedNs) ||
+           fileSize != header.fileSize || fileModifiedNs != header.fileModifiedNs) {
+            return;
+        }
+        // Check the sizes add up before trusting any of them:
+        const std::uint64_t available = size - sizeof(Header);
+        if(header.numBlocks >= available / (2 * sizeof(std::uint64_t)) || header.numTrigrams > available / sizeof(Trigram)) {
+            return;
+        }
+        const std::uint64_t blocksBytes = (header.numBlocks + 1) * 2 * sizeof(std::uint64_t);
+        const std::uint64_t tableBytes = header.numTrigrams * sizeof(Trigram);
+        if(blocksBytes + tableBytes + header.postingsBytes != available) {
+            return;
+        }
+        const char* const base = mapping_->data() + sizeof(Header);
+        numBlocks_ = header.numBlocks;
+        numTrigrams_ = header.numTrigrams;
+        blocks_ = reinterpret_cast<const std::uint64_t*>(base);
+        trigrams_ = reinterpret_cast<const Trigram*>(base + blocksBytes);
+        postings_ = reinterpret_cast<const std::uint8_t*>(base + blocksBytes + tableBytes);
+        postingsEnd_ = postings_ + header.postingsBytes;
+        valid_ = blockBegin(numBlocks_) == header.fileSize;
+    }
+
+    std::uint64_t TrigramIndex::blockBegin(const std::size_t block) const
+    {
+        return blocks_[block * 2];
+    }
+
+    std::uint64_t TrigramIndex::blockFirstLine(const std::size_t block) const
+    {
+        return blocks_[block * 2 + 1];
+    }
+
+    const TrigramIndex::Trigram* TrigramIndex::find(const std::uint32_t trigram) const
+    {
+        const Trigram* const end = trigrams_ + numTrigrams_;
+        const Trigram* const found = std::lower_bound(trigrams_, end, trigram, [](const Trigram& entry, const std::uint32_t key) { return entry.trigram < key; });
+        return found != end && found->trigram == trigram ? found : nullptr;
+    }
+
+    void TrigramIndex::markPostings(const Trigram& trigram, std::vector<std::uint8_t>& marked) const
+    {
+        const std::uint8_t* cursor = postings_ + std::min<std::uint64_t>(trigram.postings, postingsEnd_ - postings_);
+        std::uint64_t block = 0;
+        for(std::uint32_t i = 0; i < trigram.numBlocks && cursor < postingsEnd_; ++i)
+        {
+            std::uint64_t delta = 0;
+            for(unsigned shift = 0; cursor < postingsEnd_ && shift < 64; shift += 7)
+            {
+                const std::uint8_t byte = *cursor++;
+                delta |= std::uint64_t(byte & 0x7f) << shift;
+                if(!(byte & 0x80)) {
+                    break;
+                }
+            }
+            block += delta;
+            if(block < numBlocks_) {
+                marked[block] = 1;
+            }
+        }
+    }
+
+    std::vector<std::uint8_t> TrigramIndex::evaluate(const TrigramQuery& query) const
+    {
+        switch(query.op)
+        {
+            case TrigramQuery::Op::All:
+                return std::vector<std::uint8_t>(numBlocks_, 1);
+
+            case TrigramQuery::Op::Or:
+            {
+                std::vector<std::uint8_t> any(numBlocks_, 0);
+                for(const TrigramQuery& child : query.children) {
+                    const std::vector<std::uint8_t> marked = evaluate(child);
+                    for(std::size_t i = 0; i < numBlocks_; ++i) {
+                        any[i] |= marked[i];
+                    }
+                }
+                return any;
+            }
+
+            case TrigramQuery::Op::And:
+            {
+                std::vector<std::uint8_t> all(numBlocks_, 1);
+                std::vector<std::uint8_t> marked(numBlocks_);
+                for(const std::uint32_t trigram : query.trigrams)
+                {
+                    const Trigram* const entry = find(trigram);
+                    if(!entry) {
+                        return std::vector<std::uint8_t>(numBlocks_, 0);
+                    }
+                    std::fill(marked.begin(), marked.end(), 0);
+                    markPostings(*entry, marked);
+                    for(std::size_t i = 0; i < numBlocks_; ++i) {
+                        all[i] &= marked[i];
+                    }
+                }
+                for(const TrigramQuery& child : query.children) {
+                    const std::vector<std::uint8_t> childMarked = evaluate(child);
+                    for(std::size_t i = 0; i < numBlocks_; ++i) {
+                        all[i] &= childMarked[i];
+                    }
+                }
+                return all;
+            }
+        }
+        return std::vector<std::uint8_t>(numBlocks_, 1);
+    }
+
+    std::vector<std::size_t> TrigramIndex::candidates(const TrigramQuery& query) const
+    {
+        const std::vector<std::uint8_t> marked = evaluate(query);
+        std::vector<std::size_t> blocks;
+        for(std::size_t i = 0; i < numBlocks_; ++i) {
+            if(marked[i]) {
+                blocks.push_back(i);
+            }
+        }
+        return blocks;
+    }
+}
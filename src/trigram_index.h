@@ -0,0 +1,104 @@
+//
+// Copyright Andrew Cox 2017.
+// All rights reserved worldwide.
+//
+// An on-disk index of the trigrams in each block of a file.
+//
+#ifndef PARGREP_TRIGRAM_INDEX_H
+#define PARGREP_TRIGRAM_INDEX_H
+
+#include "mapped_file.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace pargrep {
+
+    /// Where prep-index puts the index of a file, and where searches look for it.
+    constexpr const char* TRIGRAM_INDEX_SUFFIX = ".trigrams";
+
+    /**
+     * A condition on the trigrams (runs of three bytes) in some text, which every
+     * line a pattern matches is sure to meet, so text failing it can be skipped.
+     * An And needs all its trigrams and all its children, an Or any of its children.
+     */
+    struct TrigramQuery {
+        enum class Op { All, And, Or };
+        /// All is met by any text, for patterns nothing can be learnt from.
+        Op op = Op::All;
+        std::vector<std::uint32_t> trigrams;
+        std::vector<TrigramQuery> children;
+
+        /// For diagnostics, e.g. ("ERR" "RRO" "ROR") | ("WAR" "ARN").
+        std::string toString() const;
+    };
+
+    /**
+     * Work out what trigrams lines matching any of some patterns must contain.
+     * Regexes are analysed from their parse tree: literal runs, small classes and
+     * alternations of them give trigrams, while anything else (big classes,
+     * optional parts) only breaks the runs. Patterns only std::regex can match
+     * fall back to their required literals.
+     */
+    TrigramQuery trigramQuery(const std::vector<std::string>& patterns, bool fixedStrings);
+
+    /**
+     * A file cut into newline-aligned blocks, with a list for every trigram of
+     * the blocks it appears in, written to disk once by build() then mapped
+     * read-only by each search.
+     * Postings are delta and varint encoded, so the index of a log is typically
+     * a few percent of its size. Trigrams spanning a newline aren't indexed, as no
+     * match can span one. Each block's first line number is kept too, so blocks
+     * can be searched on their own and still number their lines.
+     * An index records the size and modification time of the file it was built
+     * from and is ignored once the file changes.
+     */
+    class TrigramIndex
+    {
+    public:
+        static constexpr std::size_t DEFAULT_BLOCK_BYTES = 64 * 1024;
+
+        /**
+         * Index a file.
+         * @param blockBytes The size of the blocks to index, roughly: the finer they are the
+         * more a search can skip, the bigger the index.
+         * @return False, after saying why on stderr, if the file can't be read or the index written.
+         */
+        static bool build(const std::string& filename, const std::string& indexFilename, std::size_t blockBytes = DEFAULT_BLOCK_BYTES);
+
+        /// Map the index of a file. Check valid() before using it.
+        TrigramIndex(const std::string& indexFilename, const std::string& filename);
+
+        /// False if the index is missing, damaged, or out of date for its file.
+        bool valid() const { return valid_; }
+
+        std::size_t numBlocks() const { return numBlocks_; }
+        /// Offset in the file of the start of a block. Block numBlocks() starts at the end of the file.
+        std::uint64_t blockBegin(std::size_t block) const;
+        /// Number of the first line of a block, starting at 1.
+        std::uint64_t blockFirstLine(std::size_t block) const;
+
+        /// The blocks which may hold text meeting a query, in order.
+        std::vector<std::size_t> candidates(const TrigramQuery& query) const;
+
+    private:
+        struct Trigram;
+
+        const Trigram* find(std::uint32_t trigram) const;
+        void markPostings(const Trigram& trigram, std::vector<std::uint8_t>& marked) const;
+        std::vector<std::uint8_t> evaluate(const TrigramQuery& query) const;
+
+        std::unique_ptr<MappedFile> mapping_;
+        bool valid_ = false;
+        std::size_t numBlocks_ = 0;
+        std::size_t numTrigrams_ = 0;
+        const std::uint64_t* blocks_ = nullptr;
+        const Trigram* trigrams_ = nullptr;
+        const std::uint8_t* postings_ = nullptr;
+        const std::uint8_t* postingsEnd_ = nullptr;
+    };
+}
+
+#endif //PARGREP_TRIGRAM_INDEX_H